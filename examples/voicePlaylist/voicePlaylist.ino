@@ -0,0 +1,40 @@
+/******************************************************************
+File:             voicePlaylist.ino
+Description:      Play a list of voices back to back without blocking loop()
+Note:             
+******************************************************************/
+#include <BMV31K304.h>
+
+//BMV31K304 myBMV31K304(10,&SPI,9);   //Create an object BMduino UNO
+BMV31K304 myBMV31K304(29,&SPI1,22);   //Create an object,BMduino UNO
+//BMV31K304 myBMV31K304(4,&SPI2,9);  //Create an object,BMduino UNO
+BMV31K304Playlist myPlaylist(&myBMV31K304);
+
+#define DEFAULT_VOLUME 6      //default volume
+#define VOICE_TOTAL_NUMBER 10 //This example plays 10 voices
+
+void setup() {
+  uint8_t voiceNum;
+  myBMV31K304.begin();//Initialize 
+  myPlaylist.begin();//Commands are sent in the background
+  
+  myBMV31K304.setVolume(DEFAULT_VOLUME);//Initialize the default volume
+  
+  for(voiceNum = 0;voiceNum < VOICE_TOTAL_NUMBER;voiceNum++)
+  {
+    myPlaylist.addVoice(voiceNum);//Play once,no gap
+  }
+  myPlaylist.addVoice(0, 2, 500);//Play voice 0 twice with 500ms of silence after each
+}
+
+void loop() {
+  myPlaylist.poll();//Sends the next voice as soon as the current one ends
+  if(myPlaylist.isRunning())
+  {
+    myBMV31K304.setLED(BMV31K304_LED_ON);
+  }
+  else
+  {
+    myBMV31K304.setLED(BMV31K304_LED_OFF);
+  }
+}
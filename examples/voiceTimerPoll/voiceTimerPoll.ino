@@ -0,0 +1,66 @@
+/******************************************************************
+File:             voiceTimerPoll.ino
+Description:      Audio source playback with the commands sent from a 100us
+                  timer interrupt:playVoice() only queues the command,poll()
+                  in the interrupt sends the waveform,so loop() never waits
+                  for the one-wire frame.
+Note:             AVR boards use Timer1(not free with the Servo library).
+                  On other cores attach poll() to a 100us timer of the core,
+                  this example then calls poll() from loop().
+******************************************************************/
+#include <BMV31K304.h>
+
+//BMV31K304 myBMV31K304(10,&SPI,9);   //Create an object BMduino UNO
+BMV31K304 myBMV31K304(29,&SPI1,22);   //Create an object,BMduino UNO
+//BMV31K304 myBMV31K304(4,&SPI2,9);  //Create an object,BMduino UNO
+
+#define DEFAULT_VOLUME 6      //default volume
+#define VOICE_TOTAL_NUMBER 10 //This example tests 10 voices
+#define POLL_PERIOD_US 100    //poll() period,at most 200us
+
+uint8_t voiceNum = 0;
+unsigned long lastPlay = 0;
+unsigned long lastBlink = 0;
+uint8_t ledState = LOW;
+
+#if defined(__AVR__)
+ISR(TIMER1_COMPA_vect)
+{
+  myBMV31K304.poll();//send the next edge of the queued frames
+}
+#endif
+
+void setup() {
+  pinMode(LED_BUILTIN, OUTPUT);
+  myBMV31K304.begin();//Initialize 
+  myBMV31K304.setCmdMode(BMV31K304_CMD_ASYNC);//queue the commands,poll() sends them
+#if defined(__AVR__)
+  noInterrupts();
+  TCCR1A = 0;
+  TCCR1B = _BV(WGM12) | _BV(CS11);//CTC mode,clock/8
+  TCNT1 = 0;
+  OCR1A = F_CPU / 8 / (1000000UL / POLL_PERIOD_US) - 1;
+  TIMSK1 = _BV(OCIE1A);
+  interrupts();
+#endif
+  myBMV31K304.setVolume(DEFAULT_VOLUME);//Initialize the default volume
+}
+
+void loop() {
+#if !defined(__AVR__)
+  myBMV31K304.poll();//no timer attached on this core
+#endif
+  if((myBMV31K304.isIdle() == true) && (millis() - lastPlay >= 200) && (myBMV31K304.isPlaying() == false))//frame sent and voice finished
+  {
+    lastPlay = millis();
+    myBMV31K304.playVoice(voiceNum);//returns at once
+    voiceNum = (voiceNum + 1) % VOICE_TOTAL_NUMBER;
+  }
+
+  if(millis() - lastBlink >= 250)//other work goes on meanwhile
+  {
+    lastBlink = millis();
+    ledState = !ledState;
+    digitalWrite(LED_BUILTIN, ledState);
+  }
+}
@@ -0,0 +1,44 @@
+/******************************************************************
+File:             voiceUpdateInBackground.ino
+Description:      Audio source update(BMduino Voice Widget) driven from loop():
+                  updatePoll() only handles the data that has arrived,so
+                  the rest of loop() keeps running during the update.
+Note:             
+******************************************************************/
+#include <BMV31K304.h>
+
+//BMV31K304 myBMV31K304(10,&SPI,9);   //Create an object BMduino UNO
+BMV31K304 myBMV31K304(29,&SPI1,22);   //Create an object,BMduino UNO
+//BMV31K304 myBMV31K304(4,&SPI2,9);  //Create an object,BMduino UNO
+
+bool updating = false;
+unsigned long lastBlink = 0;
+uint8_t ledState = LOW;
+
+void setup() {
+  pinMode(LED_BUILTIN, OUTPUT);
+  myBMV31K304.begin();//Initialize  
+  myBMV31K304.initAudioUpdate();//Initialize online update of audio source
+}
+
+void loop() {
+  if(updating)
+  {
+    uint8_t state = myBMV31K304.updatePoll();//handle the received frames
+    if(state != BMV31K304_UPDATE_RUNNING)
+    {
+      updating = false;//BMV31K304_UPDATE_DONE or BMV31K304_UPDATE_FAILED
+    }
+  }
+  else if(myBMV31K304.isUpdateBegin() == BMV31K304_UPDATE_BEGIN)//detect update signal
+  {
+    updating = myBMV31K304.beginUpdate(0);//0:Widget,1:Workshop
+  }
+
+  if(millis() - lastBlink >= (updating ? 100 : 500))//other work goes on meanwhile
+  {
+    lastBlink = millis();
+    ledState = !ledState;
+    digitalWrite(LED_BUILTIN, ledState);
+  }
+}
@@ -0,0 +1,138 @@
+/*********************************************************************************************
+File:             devsim.cpp
+Author:           BEST MODULES CORP.
+Description:      Device simulator for upload.cpp without hardware:runs the library(same
+                  loop as voiceUpdateForWidget/voiceUpdateForWorkShop) on the Linux HAL in
+                  real-time mode,with SerialUSB on a pseudo terminal and the simulated
+                  BMV31K304 flash behind it.The pty path is printed on start.
+                  With -f the flash lives in a mapped image file that persists
+                  between runs.
+                  Build: g++ -O2 -Isrc -o bmv31k304-devsim extras/host/devsim.cpp
+                             src/BMV31K304.cpp src/BMV31K304_HAL_Linux.cpp
+                  Usage: bmv31k304-devsim [-t] [-m widget|workshop] [-f image.bin] [-o flash.bin] [-n updates]
+History：    V1.0.1   -- 2024-07-19
+**********************************************************************************************/
+#include "BMV31K304.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+
+/*************************************************************************
+Description:Create the pseudo terminal
+parameter:  *slave:receives the fd of the slave side,kept open so the
+                   master does not see a hang-up between uploads
+Return:     fd of the master side,-1 on error
+Others:     The slave is raw:no echo of the frames back to the device.
+*************************************************************************/
+static int ptyOpen(int *slave)
+{
+  struct termios tio;
+  int fd = posix_openpt(O_RDWR | O_NOCTTY);
+  if((fd < 0) || (grantpt(fd) != 0) || (unlockpt(fd) != 0))
+  {
+    return -1;
+  }
+  *slave = open(ptsname(fd), O_RDWR | O_NOCTTY);
+  if(*slave < 0)
+  {
+    return -1;
+  }
+  tcgetattr(*slave, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(*slave, TCSANOW, &tio);
+  return fd;
+}
+
+static void usage(void)
+{
+  fprintf(stderr, "usage: bmv31k304-devsim [-t] [-m widget|workshop] [-f image.bin] [-o flash.bin] [-n updates]\n"
+                  "  -t  typical flash busy times(page 0.7ms,4KB erase 45ms,chip erase 5s)\n"
+                  "  -m  mode passed to executeUpdate():widget(0,default) or workshop(1)\n"
+                  "  -f  keep the simulated flash in this image file(kept between runs,\n"
+                  "      no larger than the flash)\n"
+                  "  -o  write the simulated flash to a file after every update\n"
+                  "  -n  exit after this many updates,default 0(never)\n");
+}
+
+int main(int argc, char **argv)
+{
+  const char *out = NULL, *image = NULL;
+  uint8_t mode = 0;
+  unsigned long updates = 0, done = 0;
+  int master, slave, opt;
+  bool ok;
+  FILE *fp;
+
+  while((opt = getopt(argc, argv, "tm:f:o:n:")) != -1)
+  {
+    switch(opt)
+    {
+      case 't':
+        BMV31K304Sim::setFlashTiming(700, 45000, 5000);
+        break;
+      case 'm':
+        mode = ((0 == strcmp(optarg, "workshop")) || (0 == strcmp(optarg, "1"))) ? 1 : 0;
+        break;
+      case 'f':
+        image = optarg;
+        break;
+      case 'o':
+        out = optarg;
+        break;
+      case 'n':
+        updates = strtoul(optarg, NULL, 0);
+        break;
+      default:
+        usage();
+        return 2;
+    }
+  }
+  if((image != NULL) && !BMV31K304Sim::setFlashFile(image))
+  {
+    perror(image);
+    return 1;
+  }
+  master = ptyOpen(&slave);
+  if(master < 0)
+  {
+    perror("pty");
+    return 1;
+  }
+  BMV31K304Sim::setRealTime(true);
+  BMV31K304Sim::setSerialFd(master);
+
+  BMV31K304 voice(29, &SPI1, 22);
+  voice.begin();
+  voice.initAudioUpdate();
+  printf("%s\n", ptsname(master));
+  fflush(stdout);
+
+  while((0 == updates) || (done < updates))
+  {
+    if(voice.isUpdateBegin() == BMV31K304_UPDATE_BEGIN)
+    {
+      ok = voice.executeUpdate(mode);
+      done++;
+      fprintf(stderr, "update %lu %s\n", done, ok ? "completed" : "failed");
+      if(out != NULL)
+      {
+        fp = fopen(out, "wb");
+        if(fp != NULL)
+        {
+          fwrite(BMV31K304Sim::flashData(), 1, BMV31K304Sim::flashSize(), fp);
+          fclose(fp);
+        }
+      }
+    }
+    else
+    {
+      delay(1);
+    }
+  }
+  close(slave);
+  close(master);
+  return 0;
+}
@@ -0,0 +1,221 @@
+/*********************************************************************************************
+File:             edgetest.cpp
+Author:           BEST MODULES CORP.
+Description:      Host test of the one-wire command edges on the Linux HAL:sends the same
+                  commands with writeCmd() in BMV31K304_CMD_BLOCKING mode,from poll() on a
+                  100us timer and from poll() in a loop that comes up to 300us late,and
+                  checks every DATA segment against the V1.0.1 widths(start/stop 5000us,
+                  bit cells 1200/400us) and every frame against the simulated decoder,
+                  then overruns the command FIFO and checks that playVoice() never waits.
+                  Build: g++ -O2 -Isrc -o bmv31k304-edgetest extras/host/edgetest.cpp
+                             src/BMV31K304.cpp src/BMV31K304_HAL_Linux.cpp
+                  Usage: bmv31k304-edgetest,exit status 0 when every check passes
+History：    V1.0.1   -- 2024-07-19
+**********************************************************************************************/
+#include "BMV31K304.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#define EDGE_TOLERANCE_US   20    //GPIO and poll() cost allowed on an on-time segment
+#define LATE_MAX_US         300   //largest delay of the loop() polls
+#define CATCH_UP_US         50    //poll() shortens the next segment by up to this(CMD_LATE_US)
+#define CALL_MAX_US         200   //longest playVoice() call on a full FIFO
+#define BURST_FRAMES        20    //commands sent without polling,more than the FIFO holds
+
+static const BMV31K304Timing timing = BMV31K304_TIMING_DEFAULT;
+static std::vector<uint8_t>  edgeLevel;
+static std::vector<uint64_t> edgeNs;
+static unsigned failures = 0;
+
+static void onData(uint8_t level, uint64_t timeNs)
+{
+  edgeLevel.push_back(level);
+  edgeNs.push_back(timeNs);
+}
+
+/*************************************************************************
+Description:Send the test commands
+parameter:  *voice:player
+            mode:0:blocking;1:100us timer;2:late loop()
+Return:     void
+Others:
+*************************************************************************/
+static void sendCommands(BMV31K304 *voice, uint8_t mode)
+{
+  static const uint8_t volume[] = {3, 11, 0};
+  static const uint8_t clip[] = {0, 5, 127, 128, 200, 255};
+  uint8_t i;
+  voice->setCmdMode((0 == mode) ? BMV31K304_CMD_BLOCKING : BMV31K304_CMD_ASYNC);
+  for(i = 0; i < sizeof(clip); i++)
+  {
+    voice->setVolume(volume[i % sizeof(volume)]);
+    voice->playVoice(clip[i]);
+    voice->playSentence(0x55 ^ clip[i]);
+    voice->playStop();
+    while(false == voice->isIdle())
+    {
+      if(1 == mode)
+      {
+        delayMicroseconds(100);
+      }
+      else if(2 == mode)
+      {
+        delayMicroseconds(rand() % (LATE_MAX_US + 1));
+      }
+      voice->poll();
+    }
+  }
+  delay(20);
+}
+
+/*************************************************************************
+Description:Check one segment
+parameter:  name:run name
+            widthNs:measured
+            nominal:width in us
+            late:extra width allowed in us,0:exact
+Return:     void
+Others:
+*************************************************************************/
+static void checkWidth(const char *name, uint64_t widthNs, uint16_t nominal, uint32_t late)
+{
+  uint64_t lo = ((uint64_t)nominal - (late ? CATCH_UP_US : 0)) * 1000ULL;
+  uint64_t hi = ((uint64_t)nominal + late + EDGE_TOLERANCE_US) * 1000ULL;
+  if((widthNs < lo) || (widthNs > hi))
+  {
+    if(failures++ < 10)
+    {
+      printf("%s:segment %.1fus,expected %lu~%luus\n", name, widthNs / 1000.0, (unsigned long)(lo / 1000), (unsigned long)(hi / 1000));
+    }
+  }
+}
+
+/*************************************************************************
+Description:Check the edges of one run against the decoded frames
+parameter:  name:run name
+            first,count:command() frames of the run
+            late:extra width allowed per segment in us
+Return:     void
+Others:     A byte is a falling edge(start),16 bit halves LSB first and
+            a stop signal that lasts at least until the next start.
+*************************************************************************/
+static void checkRun(const char *name, uint16_t first, uint16_t count, uint32_t late)
+{
+  uint16_t frame;
+  uint8_t cmd, data, bytes, b, bit, value;
+  uint64_t timeUs;
+  size_t e = 0;
+  for(frame = first; frame < first + count; frame++)
+  {
+    BMV31K304Sim::command(frame, &cmd, &data, &timeUs);
+    bytes = (0xff == data) ? 1 : 2;
+    for(b = 0; b < bytes; b++)
+    {
+      value = (0 == b) ? cmd : data;
+      while((e < edgeLevel.size()) && (edgeLevel[e] != LOW))
+      {
+        e++;
+      }
+      if(e + 17 >= edgeLevel.size())
+      {
+        printf("%s:frame %u:edges missing\n", name, frame - first);
+        failures++;
+        return;
+      }
+      checkWidth(name, edgeNs[e + 1] - edgeNs[e], timing.start, late);
+      for(bit = 0; bit < 8; bit++)
+      {
+        checkWidth(name, edgeNs[e + 2 + 2 * bit] - edgeNs[e + 1 + 2 * bit], ((value >> bit) & 0x01) ? timing.longCell : timing.shortCell, late);
+        checkWidth(name, edgeNs[e + 3 + 2 * bit] - edgeNs[e + 2 + 2 * bit], ((value >> bit) & 0x01) ? timing.shortCell : timing.longCell, late);
+      }
+      if((0 == b) && (2 == bytes) && (e + 18 < edgeLevel.size()))
+      {
+        checkWidth(name, edgeNs[e + 18] - edgeNs[e + 17], timing.stop, late);//stop between the two bytes
+      }
+      e += 17;
+    }
+  }
+}
+
+/*************************************************************************
+Description:Overrun the command FIFO in BMV31K304_CMD_ASYNC mode
+parameter:  *voice:player
+Return:     void
+Others:     Every call must return at once,the frames that do not fit
+            are counted by getDroppedFrames() and the rest are sent.
+*************************************************************************/
+static void checkFull(BMV31K304 *voice)
+{
+  uint16_t first, count;
+  uint32_t dropped;
+  uint64_t t, worstNs = 0;
+  uint8_t i;
+  voice->setCmdMode(BMV31K304_CMD_ASYNC);
+  first = BMV31K304Sim::commandCount();
+  dropped = voice->getDroppedFrames();
+  for(i = 0; i < BURST_FRAMES; i++)
+  {
+    t = BMV31K304Sim::nanos();
+    voice->playVoice(i);
+    t = BMV31K304Sim::nanos() - t;
+    worstNs = (t > worstNs) ? t : worstNs;
+  }
+  voice->flush();
+  delay(20);
+  dropped = voice->getDroppedFrames() - dropped;
+  count = BMV31K304Sim::commandCount() - first;
+  if((worstNs > CALL_MAX_US * 1000ULL) || (0 == dropped) || (count + dropped != BURST_FRAMES))
+  {
+    failures++;
+  }
+  printf("full:%u frames sent,%lu dropped,playVoice() took %.1fus\n", count, (unsigned long)dropped, worstNs / 1000.0);
+}
+
+int main(void)
+{
+  static const char *name[] = {"blocking", "timer", "loop"};
+  uint16_t first, count, reference = 0, i;
+  uint8_t mode, cmd, data, refCmd, refData;
+  uint64_t timeUs;
+
+  BMV31K304Sim::setClip(2000, 1000);
+  BMV31K304Sim::setDataHandler(onData);
+  BMV31K304 voice(29, &SPI1, 22);
+  voice.begin();
+  voice.setCmdCoalesce(false);
+  srand(1);
+  for(mode = 0; mode < 3; mode++)
+  {
+    edgeLevel.clear();
+    edgeNs.clear();
+    first = BMV31K304Sim::commandCount();
+    sendCommands(&voice, mode);
+    count = BMV31K304Sim::commandCount() - first;
+    if(0 == mode)
+    {
+      reference = count;
+    }
+    else if(count != reference)
+    {
+      printf("%s:%u frames decoded,expected %u\n", name[mode], count, reference);
+      failures++;
+      continue;
+    }
+    for(i = 0; (i < count) && (mode != 0); i++)
+    {
+      BMV31K304Sim::command(i, &refCmd, &refData, &timeUs);
+      BMV31K304Sim::command(first + i, &cmd, &data, &timeUs);
+      if((cmd != refCmd) || (data != refData))
+      {
+        printf("%s:frame %u decoded %02x %02x,expected %02x %02x\n", name[mode], i, cmd, data, refCmd, refData);
+        failures++;
+      }
+    }
+    checkRun(name[mode], first, count, (2 == mode) ? LATE_MAX_US : ((1 == mode) ? 100 : 0));
+    printf("%s:%u frames,%u edges checked\n", name[mode], count, (unsigned)edgeLevel.size());
+  }
+  checkFull(&voice);
+  printf("%s\n", failures ? "FAIL" : "PASS");
+  return failures ? 1 : 0;
+}
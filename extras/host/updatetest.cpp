@@ -0,0 +1,235 @@
+/*********************************************************************************************
+File:             updatetest.cpp
+Author:           BEST MODULES CORP.
+Description:      Host test of the voice source update on the Linux HAL:plays the uploader
+                  side of a Widget(executeUpdate(0)) and a Workshop(executeUpdate(1)) update
+                  through BMV31K304Sim::serialInput(),one frame per reply,and checks the
+                  replies and the simulated flash(image written,rest erased).
+                  A third Widget update adds noise:a damaged first frame,stray bytes
+                  between frames and damaged data frames must each get one NACK and
+                  the update must go on with the next good frame.
+                  Build: g++ -O2 -Isrc -o bmv31k304-updatetest extras/host/updatetest.cpp
+                             src/BMV31K304.cpp src/BMV31K304_HAL_Linux.cpp
+                  Usage: bmv31k304-updatetest,exit status 0 when every check passes
+History：    V1.0.1   -- 2024-07-19
+**********************************************************************************************/
+#include "BMV31K304.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#define FRAME_DATA_MAX    59      //rxBuffer[64] of the sketch:3 header+59 data+CRC+tail
+#define FRAME_ACK         0x3e
+#define IMAGE_SIZE        20000
+#define FRAME_NACK        0xe3
+#define IMAGE_SIZE_NOISE  4000
+#define NOISE_EVERY       16      //data frames between two stray byte runs,a damaged frame halfway
+#define FLASH_SIZE        0x100000
+
+static std::vector<std::vector<uint8_t> > frames;
+static std::vector<uint8_t> replyLen;     //reply bytes expected for each frame
+static std::vector<uint8_t> replyCode;    //first reply byte expected for each frame
+static std::vector<uint8_t> reply;        //everything the device wrote
+static size_t sent = 0;                   //frames sent
+static size_t replied = 0;                //reply bytes of the frames sent so far
+static unsigned failures = 0;
+
+/*************************************************************************
+Description:CRC8 of LEN and payload
+parameter:  *ptr:data
+            len:bytes
+Return:     crc
+Others:     Polynomial 0x31,same as BMV31K304::checkCRC8()
+*************************************************************************/
+static uint8_t checkCRC8(const uint8_t *ptr, size_t len)
+{
+  uint8_t crc = 0x00, bit;
+  while(len--)
+  {
+    crc ^= *ptr++;
+    for(bit = 0; bit < 8; bit++)
+    {
+      crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x31) : (uint8_t)(crc << 1);
+    }
+  }
+  return crc;
+}
+
+/*************************************************************************
+Description:Queue a frame
+parameter:  header:0xAA control,0x55 data
+            *payload,len:content
+            answer:reply bytes expected
+            damage:false:good frame;true:flip the CRC,a NACK is expected
+Return:     void
+Others:
+*************************************************************************/
+static void addFrame(uint8_t header, const void *payload, uint8_t len, uint8_t answer, bool damage = false)
+{
+  std::vector<uint8_t> frame;
+  frame.push_back(header);
+  frame.push_back(0x23);
+  frame.push_back(len);
+  frame.insert(frame.end(), (const uint8_t *)payload, (const uint8_t *)payload + len);
+  frame.push_back(checkCRC8(frame.data() + 2, len + 1) ^ (damage ? 0x5a : 0x00));
+  frame.push_back(0x00);
+  frames.push_back(frame);
+  replyLen.push_back(damage ? 1 : answer);
+  replyCode.push_back(damage ? FRAME_NACK : FRAME_ACK);
+}
+
+/*************************************************************************
+Description:Queue bytes that are no frame
+parameter:  len:bytes
+Return:     void
+Others:     One NACK is expected.
+*************************************************************************/
+static void addNoise(uint8_t len)
+{
+  std::vector<uint8_t> noise(len);
+  uint8_t i;
+  for(i = 0; i < len; i++)
+  {
+    noise[i] = 0x10 + i;//never a frame header
+  }
+  frames.push_back(noise);
+  replyLen.push_back(1);
+  replyCode.push_back(FRAME_NACK);
+}
+
+/*************************************************************************
+Description:Send the next frame
+parameter:  void
+Return:     void
+Others:
+*************************************************************************/
+static void sendNext(void)
+{
+  if(sent < frames.size())
+  {
+    replied += replyLen[sent];
+    BMV31K304Sim::serialInput(frames[sent].data(), frames[sent].size());
+    sent++;
+  }
+}
+
+/*************************************************************************
+Description:Uploader side:the next frame goes out when the reply of the
+            previous one is complete
+parameter:  *buffer,size:bytes written by the device
+Return:     void
+Others:
+*************************************************************************/
+static void onReply(const uint8_t *buffer, size_t size)
+{
+  reply.insert(reply.end(), buffer, buffer + size);
+  if(reply.size() >= replied)
+  {
+    sendNext();
+  }
+}
+
+/*************************************************************************
+Description:Run one update
+parameter:  *voice:device
+            mode:0:Widget;1:Workshop
+            noise:damaged frames and stray bytes between the frames
+Return:     void
+Others:
+*************************************************************************/
+static void runUpdate(BMV31K304 *voice, uint8_t mode, bool noise)
+{
+  const char *name = noise ? "noise" : ((0 == mode) ? "widget" : "workshop");
+  std::vector<uint8_t> image(noise ? IMAGE_SIZE_NOISE : IMAGE_SIZE);
+  uint8_t *flash = BMV31K304Sim::flashData();
+  size_t i, pos, offset, len;
+  bool ok;
+
+  for(i = 0; i < image.size(); i++)
+  {
+    image[i] = rand();
+  }
+  memset(flash, 0x00, FLASH_SIZE);//old contents,the chip erase must clear them
+  frames.clear();
+  replyLen.clear();
+  replyCode.clear();
+  reply.clear();
+  sent = 0;
+  replied = 0;
+  if(noise)
+  {
+    addFrame(0xAA, "ACOM", 4, 1, true);//first frame of the session
+  }
+  addFrame(0xAA, "ACOM", 4, 1);
+  addFrame(0xAA, "COMSPI", 6, (0 == mode) ? 1 : 4);
+  addFrame(0xAA, "COMCE", 5, 1);
+  for(offset = 0; offset < image.size(); offset += FRAME_DATA_MAX)
+  {
+    len = (image.size() - offset < FRAME_DATA_MAX) ? image.size() - offset : FRAME_DATA_MAX;
+    if(noise && (0 == (offset / FRAME_DATA_MAX) % NOISE_EVERY))
+    {
+      addNoise(4 + (offset / FRAME_DATA_MAX) % 6);
+    }
+    else if(noise && (NOISE_EVERY / 2 == (offset / FRAME_DATA_MAX) % NOISE_EVERY))
+    {
+      addFrame(0x55, &image[offset], len, 1, true);//sent again below
+    }
+    addFrame(0x55, &image[offset], len, 1);
+  }
+  addFrame(0xAA, "COMORD", 6, 1);
+
+  voice->initAudioUpdate();
+  sendNext();
+  while(false == voice->isUpdateBegin())
+  {
+    delay(1);
+  }
+  ok = voice->executeUpdate(mode);
+  if((false == ok) || (sent != frames.size()) || (reply.size() != replied))
+  {
+    printf("%s:update %s,%lu/%lu frames,%lu/%lu reply bytes\n", name, ok ? "completed" : "failed",
+           (unsigned long)sent, (unsigned long)frames.size(), (unsigned long)reply.size(), (unsigned long)replied);
+    failures++;
+    return;
+  }
+  for(i = 0, pos = 0; i < frames.size(); pos += replyLen[i], i++)
+  {
+    if(reply[pos] != replyCode[i])
+    {
+      printf("%s:frame %lu answered %02x,expected %02x\n", name, (unsigned long)i, reply[pos], replyCode[i]);
+      failures++;
+    }
+  }
+  if((1 == mode) && ((reply[2] != 0xef) || (reply[3] != 0x40) || ((1UL << reply[4]) != FLASH_SIZE)))
+  {
+    printf("%s:COMSPI JEDEC ID %02x %02x %02x\n", name, reply[2], reply[3], reply[4]);
+    failures++;
+  }
+  if(memcmp(flash, image.data(), image.size()) != 0)
+  {
+    printf("%s:image not in the flash\n", name);
+    failures++;
+  }
+  for(i = image.size(); (i < FLASH_SIZE) && (0xff == flash[i]); i++);
+  if(i != FLASH_SIZE)
+  {
+    printf("%s:flash not erased at %06lx\n", name, (unsigned long)i);
+    failures++;
+  }
+  printf("%s:%lu frames,%lu bytes written\n", name, (unsigned long)frames.size(), (unsigned long)image.size());
+}
+
+int main(void)
+{
+  BMV31K304Sim::setFlashSize(FLASH_SIZE);
+  BMV31K304Sim::setFlashTiming(700, 45000, 500);
+  BMV31K304Sim::setSerialHandler(onReply);
+  BMV31K304 voice(29, &SPI1, 22);
+  voice.begin();
+  srand(1);
+  runUpdate(&voice, 0, false);
+  runUpdate(&voice, 1, false);
+  runUpdate(&voice, 0, true);
+  printf("%s\n", failures ? "FAIL" : "PASS");
+  return failures ? 1 : 0;
+}
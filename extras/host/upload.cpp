@@ -0,0 +1,1349 @@
+/*********************************************************************************************
+File:             upload.cpp
+Author:           BEST MODULES CORP.
+Description:      Linux uploader for the voice flash image.Talks to a sketch that runs
+                  executeUpdate() (e.g. voiceUpdateForWidget) over its SerialUSB port with
+                  the Widget/Workshop framing:
+                  control frame 0xAA 0x23 LEN payload CRC8 0x00(ACOM,COMSPI,COMCE,COMORD,Reset)
+                  data frame    0x55 0x23 LEN data    CRC8 0x00
+                  Every frame is answered with 0x3e(ACK) or 0xe3(NACK).Data frames are
+                  pipelined:up to <window> frames are sent ahead of their ACKs.
+                  A device that answers COMV2 takes v2 data frames instead:
+                  0x5A 0x23 LEN(2) OFFSET(4) data CRC32(4),little endian,up to the
+                  announced frame size;a NACKed v2 frame is sent again.
+                  With -d(delta) the device reports a CRC32 per 4KB sector(COMHS),and
+                  only the sectors that differ are erased(COMSE) and written.
+                  The written range is verified with one CRC32 computed on the device
+                  (COMCR);-r also reads it back(COMRD) into a file.
+                  v2 images are sent sparse:pages of 0xFF are skipped(the flash is
+                  erased) and runs of 0x00 are programmed by the device(COMFL).
+                  With -z the data frames are LZ compressed(0x5C 0x23 frames) when
+                  that makes them shorter.
+                  The device journals the progress(COMCP) every CHECKPOINT_FRAMES
+                  frames;after a broken link -c continues from its journal(COMJQ)
+                  instead of erasing the chip again.
+                  With -s the session counters of the device(COMST) give the progress,
+                  the time left and where the time went(flash,USB,link errors).
+                  Build: g++ -O2 -o bmv31k304-upload extras/host/upload.cpp
+                  Usage: bmv31k304-upload [-1|-d|-c] [-z] [-s] [-r file] [-m widget|workshop] [-b baud] [-w window] device image
+History：    V1.0.1   -- 2024-07-19
+**********************************************************************************************/
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <termios.h>
+#include <vector>
+
+#define FRAME_DATA_MAX    59      //rxBuffer[64] of the sketch:3 header+59 data+CRC+tail
+#define FRAME_ACK         0x3e
+#define FRAME_NACK        0xe3
+#define WINDOW_MAX        64
+#define REPLY_TIMEOUT_MS  1000
+#define ERASE_TIMEOUT_MS  60000   //COMCE returns after the chip erase
+#define PROBE_TIMEOUT_MS  50      //COMV2 is ignored by v1 sketches,which give up after 100ms
+#define FRAME_RETRIES     3       //resends of a NACKed v2 frame
+#define CAP_FRAME_V2      0x01    //COMV2 capabilities
+#define CAP_SECTOR        0x02
+#define CAP_READBACK      0x04
+#define CAP_FILL          0x08
+#define CAP_PACKED        0x10
+#define CAP_RESUME        0x20
+#define CAP_STATS         0x40
+#define CHECKPOINT_FRAMES 256     //frames between two COMCP journal entries
+#define SECTOR_SIZE       4096
+#define HASH_BATCH        64      //sectors per COMHS
+#define HASH_SECTOR_MS    50      //reply time allowed per hashed sector
+#define ERASE_SECTOR_MS   500     //reply time allowed per erased sector
+#define READ_KB_MS        20      //reply time allowed per KB read back(COMRD,COMCR)
+#define SPARSE_BLOCK      256     //unit of the 0xFF skip and the 0x00 fill,one flash page
+#define FILL_KB_MS        30      //reply time allowed per KB filled(COMFL)
+#define BLOCK_ERASED      0       //blockKind():all 0xFF
+#define BLOCK_ZERO        1       //all 0x00
+#define BLOCK_DATA        2
+#define BLOCK_NONE        3       //end of the range
+#define LZ_MATCH_MIN      3       //compressed frame tokens,see BMV31K304::unpackFrame()
+#define LZ_MATCH_MAX      130
+#define LZ_LITERAL_MAX    128
+#define LZ_HASH_SIZE      4096
+#define LZ_CHAIN          64      //match candidates tried per position
+#define STATS_FIELDS      12      //COMST reply:ACK and 12 counters of 4 bytes,see BMV31K304UpdateStats
+#define ST_RX_BYTES       0       //COMST counters
+#define ST_DATA_BYTES     1
+#define ST_FRAMES         2
+#define ST_CRC_NACKS      3
+#define ST_RESYNC_BYTES   4
+#define ST_PAGE_PROGRAMS  5
+#define ST_ERASE_MS       6
+#define ST_PROGRAM_US     7
+#define ST_WAIT_US        8
+#define ST_IDLE_US        9
+#define ST_ELAPSED_MS     10
+#define ST_BYTES_PER_SEC  11
+
+/*v2 data frame:image range,compressed form if packed is not empty*/
+typedef struct
+{
+  uint32_t offset;
+  uint16_t len;
+  std::vector<uint8_t> packed;
+}FrameV2;
+
+/*image range of a COMFL*/
+typedef struct
+{
+  uint32_t offset;
+  uint32_t len;
+}Extent;
+
+static const uint8_t crc_table[] =
+{
+    0x00, 0x31, 0x62, 0x53, 0xc4, 0xf5, 0xa6, 0x97, 0xb9, 0x88, 0xdb, 0xea, 0x7d, 0x4c, 0x1f, 0x2e,
+    0x43, 0x72, 0x21, 0x10, 0x87, 0xb6, 0xe5, 0xd4, 0xfa, 0xcb, 0x98, 0xa9, 0x3e, 0x0f, 0x5c, 0x6d,
+    0x86, 0xb7, 0xe4, 0xd5, 0x42, 0x73, 0x20, 0x11, 0x3f, 0x0e, 0x5d, 0x6c, 0xfb, 0xca, 0x99, 0xa8,
+    0xc5, 0xf4, 0xa7, 0x96, 0x01, 0x30, 0x63, 0x52, 0x7c, 0x4d, 0x1e, 0x2f, 0xb8, 0x89, 0xda, 0xeb,
+    0x3d, 0x0c, 0x5f, 0x6e, 0xf9, 0xc8, 0x9b, 0xaa, 0x84, 0xb5, 0xe6, 0xd7, 0x40, 0x71, 0x22, 0x13,
+    0x7e, 0x4f, 0x1c, 0x2d, 0xba, 0x8b, 0xd8, 0xe9, 0xc7, 0xf6, 0xa5, 0x94, 0x03, 0x32, 0x61, 0x50,
+    0xbb, 0x8a, 0xd9, 0xe8, 0x7f, 0x4e, 0x1d, 0x2c, 0x02, 0x33, 0x60, 0x51, 0xc6, 0xf7, 0xa4, 0x95,
+    0xf8, 0xc9, 0x9a, 0xab, 0x3c, 0x0d, 0x5e, 0x6f, 0x41, 0x70, 0x23, 0x12, 0x85, 0xb4, 0xe7, 0xd6,
+    0x7a, 0x4b, 0x18, 0x29, 0xbe, 0x8f, 0xdc, 0xed, 0xc3, 0xf2, 0xa1, 0x90, 0x07, 0x36, 0x65, 0x54,
+    0x39, 0x08, 0x5b, 0x6a, 0xfd, 0xcc, 0x9f, 0xae, 0x80, 0xb1, 0xe2, 0xd3, 0x44, 0x75, 0x26, 0x17,
+    0xfc, 0xcd, 0x9e, 0xaf, 0x38, 0x09, 0x5a, 0x6b, 0x45, 0x74, 0x27, 0x16, 0x81, 0xb0, 0xe3, 0xd2,
+    0xbf, 0x8e, 0xdd, 0xec, 0x7b, 0x4a, 0x19, 0x28, 0x06, 0x37, 0x64, 0x55, 0xc2, 0xf3, 0xa0, 0x91,
+    0x47, 0x76, 0x25, 0x14, 0x83, 0xb2, 0xe1, 0xd0, 0xfe, 0xcf, 0x9c, 0xad, 0x3a, 0x0b, 0x58, 0x69,
+    0x04, 0x35, 0x66, 0x57, 0xc0, 0xf1, 0xa2, 0x93, 0xbd, 0x8c, 0xdf, 0xee, 0x79, 0x48, 0x1b, 0x2a,
+    0xc1, 0xf0, 0xa3, 0x92, 0x05, 0x34, 0x67, 0x56, 0x78, 0x49, 0x1a, 0x2b, 0xbc, 0x8d, 0xde, 0xef,
+    0x82, 0xb3, 0xe0, 0xd1, 0x46, 0x77, 0x24, 0x15, 0x3b, 0x0a, 0x59, 0x68, 0xff, 0xce, 0x9d, 0xac
+};
+
+/*************************************************************************
+Description:CRC8 of LEN and payload
+parameter:  *ptr:data
+            len:bytes
+Return:     crc
+Others:     Same table as BMV31K304::checkCRC8()
+*************************************************************************/
+static uint8_t checkCRC8(const uint8_t *ptr, size_t len)
+{
+  uint8_t crc = 0x00;
+  while (len--)
+  {
+    crc = crc_table[crc ^ *ptr++];
+  }
+  return crc;
+}
+
+static const uint32_t crc32_table[16] =
+{
+    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+    0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+};
+
+/*************************************************************************
+Description:CRC32(IEEE 802.3)
+parameter:  crc:0 to start,or the result of the previous block
+            *ptr,len:data
+Return:     crc
+Others:     Same as BMV31K304::checkCRC32()
+*************************************************************************/
+static uint32_t checkCRC32(uint32_t crc, const uint8_t *ptr, size_t len)
+{
+  crc = ~crc;
+  while (len--)
+  {
+    crc = crc32_table[(crc ^ *ptr) & 0x0f] ^ (crc >> 4);
+    crc = crc32_table[(crc ^ (*ptr >> 4)) & 0x0f] ^ (crc >> 4);
+    ptr++;
+  }
+  return ~crc;
+}
+
+/*************************************************************************
+Description:Build a frame
+parameter:  header:0xAA control,0x55 data
+            *payload,len:content,len <= FRAME_DATA_MAX
+            *frame:receives the frame
+Return:     void
+Others:
+*************************************************************************/
+static void buildFrame(uint8_t header, const uint8_t *payload, uint8_t len, std::vector<uint8_t> *frame)
+{
+  frame->clear();
+  frame->push_back(header);
+  frame->push_back(0x23);
+  frame->push_back(len);
+  frame->insert(frame->end(), payload, payload + len);
+  frame->push_back(checkCRC8(frame->data() + 2, len + 1));
+  frame->push_back(0x00);//tail,read with the CRC by the sketch
+}
+
+/*************************************************************************
+Description:Build a v2 data frame
+parameter:  offset:flash address of the data
+            *payload,len:data
+            *frame:receives the frame
+Return:     void
+Others:
+*************************************************************************/
+static void buildFrameV2(uint32_t offset, const uint8_t *payload, uint16_t len, std::vector<uint8_t> *frame)
+{
+  uint32_t crc;
+  uint8_t i;
+  frame->clear();
+  frame->push_back(0x5A);
+  frame->push_back(0x23);
+  frame->push_back(len & 0xff);
+  frame->push_back(len >> 8);
+  for(i = 0; i < 4; i++)
+  {
+    frame->push_back((offset >> (8 * i)) & 0xff);
+  }
+  frame->insert(frame->end(), payload, payload + len);
+  crc = checkCRC32(0, frame->data() + 2, len + 6);
+  for(i = 0; i < 4; i++)
+  {
+    frame->push_back((crc >> (8 * i)) & 0xff);
+  }
+}
+
+/*************************************************************************
+Description:Build a compressed v2 data frame
+parameter:  *f:offset,decoded length and compressed data
+            *frame:receives the frame
+Return:     void
+Others:
+*************************************************************************/
+static void buildFramePacked(const FrameV2 &f, std::vector<uint8_t> *frame)
+{
+  uint32_t crc;
+  uint16_t len = f.packed.size();
+  uint8_t i;
+  frame->clear();
+  frame->push_back(0x5C);
+  frame->push_back(0x23);
+  frame->push_back(len & 0xff);
+  frame->push_back(len >> 8);
+  for(i = 0; i < 4; i++)
+  {
+    frame->push_back((f.offset >> (8 * i)) & 0xff);
+  }
+  frame->push_back(f.len & 0xff);
+  frame->push_back(f.len >> 8);
+  frame->insert(frame->end(), f.packed.begin(), f.packed.end());
+  crc = checkCRC32(0, frame->data() + 2, len + 8);
+  for(i = 0; i < 4; i++)
+  {
+    frame->push_back((crc >> (8 * i)) & 0xff);
+  }
+}
+
+/*************************************************************************
+Description:Monotonic time
+parameter:  void
+Return:     ms
+Others:
+*************************************************************************/
+static double nowMs(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/*************************************************************************
+Description:Open the serial device in raw mode
+parameter:  *path:e.g. /dev/ttyACM0
+            baud:line speed,ignored by USB CDC and ptys
+Return:     fd,-1 on error
+Others:
+*************************************************************************/
+static int serialOpen(const char *path, unsigned long baud)
+{
+  struct termios tio;
+  speed_t speed = B115200;
+  int fd = open(path, O_RDWR | O_NOCTTY);
+  if(fd < 0)
+  {
+    return -1;
+  }
+  if(0 == tcgetattr(fd, &tio))
+  {
+    cfmakeraw(&tio);
+    switch(baud)
+    {
+      case 9600:   speed = B9600;   break;
+      case 57600:  speed = B57600;  break;
+      case 230400: speed = B230400; break;
+      case 460800: speed = B460800; break;
+      case 921600: speed = B921600; break;
+      default:     speed = B115200; break;//the CDC port of the board ignores it
+    }
+    cfsetispeed(&tio, speed);
+    cfsetospeed(&tio, speed);
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
+    tcsetattr(fd, TCSANOW, &tio);
+    tcflush(fd, TCIOFLUSH);
+  }
+  return fd;
+}
+
+/*************************************************************************
+Description:Write all bytes
+parameter:  fd,*buf,len
+Return:     true:written
+Others:
+*************************************************************************/
+static bool serialWrite(int fd, const uint8_t *buf, size_t len)
+{
+  ssize_t n;
+  while(len > 0)
+  {
+    n = write(fd, buf, len);
+    if(n < 0)
+    {
+      if((EINTR == errno) || (EAGAIN == errno))
+      {
+        continue;
+      }
+      return false;
+    }
+    buf += n;
+    len -= n;
+  }
+  return true;
+}
+
+/*************************************************************************
+Description:Read bytes
+parameter:  fd,*buf,len
+            timeoutMs:time allowed for all bytes
+Return:     bytes read
+Others:
+*************************************************************************/
+static size_t serialRead(int fd, uint8_t *buf, size_t len, int timeoutMs)
+{
+  struct pollfd pfd;
+  size_t count = 0;
+  double deadline = nowMs() + timeoutMs;
+  ssize_t n;
+  int wait;
+  while(count < len)
+  {
+    wait = (int)(deadline - nowMs());
+    if(wait < 0)
+    {
+      break;
+    }
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if(poll(&pfd, 1, wait) <= 0)
+    {
+      continue;
+    }
+    n = read(fd, buf + count, len - count);
+    if(n > 0)
+    {
+      count += n;
+    }
+  }
+  return count;
+}
+
+/*************************************************************************
+Description:Send a control frame and check the reply
+parameter:  fd
+            *name:ACOM,COMSPI,COMCE,COMORD or Reset
+            *reply,replyLen:expected reply bytes,reply[0] must be ACK
+            timeoutMs
+Return:     true:acknowledged
+Others:
+*************************************************************************/
+static bool control(int fd, const char *name, uint8_t *reply, size_t replyLen, int timeoutMs)
+{
+  std::vector<uint8_t> frame;
+  buildFrame(0xAA, (const uint8_t *)name, strlen(name), &frame);
+  if(false == serialWrite(fd, frame.data(), frame.size()))
+  {
+    return false;
+  }
+  if(serialRead(fd, reply, replyLen, timeoutMs) != replyLen)
+  {
+    fprintf(stderr, "%s: no reply\n", name);
+    return false;
+  }
+  if(reply[0] != FRAME_ACK)
+  {
+    fprintf(stderr, "%s: NACK 0x%02x\n", name, reply[0]);
+    return false;
+  }
+  return true;
+}
+
+/*************************************************************************
+Description:Stream the image in data frames
+parameter:  fd
+            *image,size
+            window:frames sent ahead of their ACKs
+Return:     true:every frame acknowledged
+Others:     The sketch writes each frame behind the previous one,so a NACK
+            cannot be repaired in place:the update has to be restarted.
+*************************************************************************/
+static bool streamImage(int fd, const std::vector<uint8_t> &image, unsigned window)
+{
+  std::vector<uint8_t> frame;
+  size_t frames = (image.size() + FRAME_DATA_MAX - 1) / FRAME_DATA_MAX;
+  size_t sent = 0, acked = 0, offset, len;
+  unsigned percent = 101;
+  uint8_t reply;
+  while(acked < frames)
+  {
+    while((sent < frames) && (sent - acked < window))
+    {
+      offset = sent * FRAME_DATA_MAX;
+      len = image.size() - offset;
+      if(len > FRAME_DATA_MAX)
+      {
+        len = FRAME_DATA_MAX;
+      }
+      buildFrame(0x55, image.data() + offset, len, &frame);
+      if(false == serialWrite(fd, frame.data(), frame.size()))
+      {
+        fprintf(stderr, "write: %s\n", strerror(errno));
+        return false;
+      }
+      sent++;
+    }
+    if(serialRead(fd, &reply, 1, REPLY_TIMEOUT_MS) != 1)
+    {
+      fprintf(stderr, "\nframe %zu: no reply\n", acked);
+      return false;
+    }
+    if(reply != FRAME_ACK)
+    {
+      fprintf(stderr, "\nframe %zu: NACK 0x%02x,restart the update\n", acked, reply);
+      return false;
+    }
+    acked++;
+    if(acked * 100 / frames != percent)
+    {
+      percent = acked * 100 / frames;
+      fprintf(stderr, "\r%3u%%", percent);
+    }
+  }
+  fprintf(stderr, "\n");
+  return true;
+}
+
+/*************************************************************************
+Description:Split image ranges into v2 data frames
+parameter:  offset,len:range of the image
+            frameSize:data bytes per frame,announced by COMV2
+            *frames:frames appended here
+Return:     void
+Others:
+*************************************************************************/
+static void addFrames(uint32_t offset, uint32_t len, uint16_t frameSize, std::vector<FrameV2> *frames)
+{
+  FrameV2 frame;
+  while(len > 0)
+  {
+    frame.offset = offset;
+    frame.len = (len > frameSize) ? frameSize : len;
+    frames->push_back(frame);
+    offset += frame.len;
+    len -= frame.len;
+  }
+}
+
+/*************************************************************************
+Description:Kind of an image block
+parameter:  *p,len:block
+            fill:the device takes COMFL
+Return:     BLOCK_ERASED,BLOCK_ZERO or BLOCK_DATA
+Others:
+*************************************************************************/
+static uint8_t blockKind(const uint8_t *p, uint32_t len, bool fill)
+{
+  uint32_t i;
+  for(i = 0; (i < len) && (0xff == p[i]); i++);
+  if(i == len)
+  {
+    return BLOCK_ERASED;
+  }
+  for(i = 0; fill && (i < len) && (0x00 == p[i]); i++);
+  return (fill && (i == len)) ? BLOCK_ZERO : BLOCK_DATA;
+}
+
+/*************************************************************************
+Description:Split an image range into data frames,skipped 0xFF pages and
+            0x00 fills
+parameter:  *image
+            offset,len:range of the image,offset page aligned
+            frameSize:data bytes per frame,announced by COMV2
+            fill:the device takes COMFL
+            *frames,*fills:appended here
+Return:     bytes skipped
+Others:
+*************************************************************************/
+static uint32_t addExtents(const std::vector<uint8_t> &image, uint32_t offset, uint32_t len, uint16_t frameSize,
+                           bool fill, std::vector<FrameV2> *frames, std::vector<Extent> *fills)
+{
+  uint32_t end = offset + len, start = offset, n, skipped = 0;
+  uint8_t kind, runKind = BLOCK_DATA;
+  Extent extent;
+  while(start < end)
+  {
+    n = ((end - offset) < SPARSE_BLOCK) ? (end - offset) : SPARSE_BLOCK;
+    kind = (n > 0) ? blockKind(image.data() + offset, n, fill) : BLOCK_NONE;
+    if(offset == start)
+    {
+      runKind = kind;
+    }
+    else if(kind != runKind)
+    {
+      if(BLOCK_ERASED == runKind)
+      {
+        skipped += offset - start;
+      }
+      else if(BLOCK_ZERO == runKind)
+      {
+        extent.offset = start;
+        extent.len = offset - start;
+        fills->push_back(extent);
+      }
+      else
+      {
+        addFrames(start, offset - start, frameSize, frames);
+      }
+      start = offset;
+      runKind = kind;
+    }
+    offset += n;
+  }
+  return skipped;
+}
+
+/*************************************************************************
+Description:Append literal tokens
+parameter:  *in,len:literal bytes
+            *out:compressed data
+Return:     void
+Others:
+*************************************************************************/
+static void lzLiterals(const uint8_t *in, size_t len, std::vector<uint8_t> *out)
+{
+  size_t n;
+  while(len > 0)
+  {
+    n = (len > LZ_LITERAL_MAX) ? LZ_LITERAL_MAX : len;
+    out->push_back(n - 1);
+    out->insert(out->end(), in, in + n);
+    in += n;
+    len -= n;
+  }
+}
+
+/*************************************************************************
+Description:Compress as much of a range as fits in one frame
+parameter:  *in,len:data,the decoded frame
+            maxOut:frame size
+            *out:compressed data
+Return:     bytes of in that were compressed
+Others:     Greedy LZ77 with hash chains,matches only reach back inside
+            the frame so the device decodes every frame on its own.
+*************************************************************************/
+static size_t lzPack(const uint8_t *in, size_t len, size_t maxOut, std::vector<uint8_t> *out)
+{
+  std::vector<int> head(LZ_HASH_SIZE, -1), prev(len, -1);
+  size_t pos = 0, literal = 0, best, dist = 0, n, limit;
+  unsigned hash, chain;
+  int cand;
+  out->clear();
+  while(pos < len)
+  {
+    best = 0;
+    hash = 0;
+    if(pos + LZ_MATCH_MIN <= len)
+    {
+      hash = ((in[pos] << 8) ^ (in[pos + 1] << 4) ^ in[pos + 2]) % LZ_HASH_SIZE;
+      limit = ((len - pos) < LZ_MATCH_MAX) ? (len - pos) : LZ_MATCH_MAX;
+      for(cand = head[hash], chain = 0; (cand >= 0) && (chain < LZ_CHAIN); cand = prev[cand], chain++)
+      {
+        for(n = 0; (n < limit) && (in[cand + n] == in[pos + n]); n++);
+        if(n > best)
+        {
+          best = n;
+          dist = pos - cand;
+        }
+      }
+    }
+    if(best >= LZ_MATCH_MIN)
+    {
+      n = pos - literal;
+      if(out->size() + n + (n + LZ_LITERAL_MAX - 1) / LZ_LITERAL_MAX + 3 > maxOut)
+      {
+        break;
+      }
+      lzLiterals(in + literal, n, out);
+      out->push_back(0x80 | (best - LZ_MATCH_MIN));
+      out->push_back(dist & 0xff);
+      out->push_back(dist >> 8);
+      for(n = pos + best; pos < n; pos++)
+      {
+        if(pos + LZ_MATCH_MIN <= len)
+        {
+          hash = ((in[pos] << 8) ^ (in[pos + 1] << 4) ^ in[pos + 2]) % LZ_HASH_SIZE;
+          prev[pos] = head[hash];
+          head[hash] = pos;
+        }
+      }
+      literal = pos;
+    }
+    else
+    {
+      n = pos + 1 - literal;
+      if(out->size() + n + (n + LZ_LITERAL_MAX - 1) / LZ_LITERAL_MAX > maxOut)
+      {
+        break;
+      }
+      if(pos + LZ_MATCH_MIN <= len)
+      {
+        prev[pos] = head[hash];
+        head[hash] = pos;
+      }
+      pos++;
+    }
+  }
+  lzLiterals(in + literal, pos - literal, out);
+  return pos;
+}
+
+/*************************************************************************
+Description:Replace the data frames by compressed frames where that is shorter
+parameter:  *image
+            *frames:frames of the image,in image order
+            frameSize:compressed bytes per frame,announced by COMV2
+            unpackSize:decoded bytes per frame,announced by COMLZ
+Return:     void
+Others:     Frames that follow each other are compressed as one range.
+*************************************************************************/
+static void packFrames(const std::vector<uint8_t> &image, std::vector<FrameV2> *frames, uint16_t frameSize, uint16_t unpackSize)
+{
+  std::vector<FrameV2> result;
+  FrameV2 frame;
+  uint32_t offset, end;
+  size_t i = 0, n, raw;
+  while(i < frames->size())
+  {
+    offset = (*frames)[i].offset;
+    for(end = offset; (i < frames->size()) && ((*frames)[i].offset == end); i++)
+    {
+      end += (*frames)[i].len;
+    }
+    while(offset < end)
+    {
+      raw = ((end - offset) < unpackSize) ? (end - offset) : unpackSize;
+      frame.offset = offset;
+      n = lzPack(image.data() + offset, raw, frameSize, &frame.packed);
+      if(frame.packed.size() + 2 < n)
+      {
+        frame.len = n;
+      }
+      else
+      {
+        frame.len = ((end - offset) < frameSize) ? (end - offset) : frameSize;
+        frame.packed.clear();
+      }
+      result.push_back(frame);
+      offset += frame.len;
+    }
+  }
+  frames->swap(result);
+}
+
+/*************************************************************************
+Description:Journal the progress of the update on the device
+parameter:  fd
+            id:image id
+            addr:the image is complete below this address
+Return:     true:acknowledged,the data below addr is programmed
+Others:
+*************************************************************************/
+static bool checkpoint(int fd, uint32_t id, uint32_t addr)
+{
+  std::vector<uint8_t> frame;
+  uint8_t payload[13], reply;
+  uint8_t i;
+  memcpy(payload, "COMCP", 5);
+  for(i = 0; i < 4; i++)
+  {
+    payload[5 + i] = (id >> (8 * i)) & 0xff;
+    payload[9 + i] = (addr >> (8 * i)) & 0xff;
+  }
+  buildFrame(0xAA, payload, sizeof(payload), &frame);
+  if((false == serialWrite(fd, frame.data(), frame.size()))
+  || (serialRead(fd, &reply, 1, REPLY_TIMEOUT_MS) != 1) || (reply != FRAME_ACK))
+  {
+    fprintf(stderr, "\nCOMCP 0x%x: failed\n", addr);
+    return false;
+  }
+  return true;
+}
+
+/*************************************************************************
+Description:Continue the update at the journaled address
+parameter:  fd
+            addr:first byte still to send
+Return:     true:acknowledged
+Others:
+*************************************************************************/
+static bool resumeAt(int fd, uint32_t addr)
+{
+  std::vector<uint8_t> frame;
+  uint8_t payload[9], reply;
+  uint8_t i;
+  memcpy(payload, "COMRS", 5);
+  for(i = 0; i < 4; i++)
+  {
+    payload[5 + i] = (addr >> (8 * i)) & 0xff;
+  }
+  buildFrame(0xAA, payload, sizeof(payload), &frame);
+  if((false == serialWrite(fd, frame.data(), frame.size()))
+  || (serialRead(fd, &reply, 1, REPLY_TIMEOUT_MS) != 1) || (reply != FRAME_ACK))
+  {
+    fprintf(stderr, "COMRS 0x%x: failed\n", addr);
+    return false;
+  }
+  return true;
+}
+
+/*************************************************************************
+Description:Read the session counters of the device
+parameter:  fd
+            *stats:receives STATS_FIELDS counters(ST_xxx)
+Return:     true:acknowledged
+Others:
+*************************************************************************/
+static bool queryStats(int fd, uint32_t *stats)
+{
+  uint8_t reply[1 + 4 * STATS_FIELDS];
+  uint8_t i;
+  if(false == control(fd, "COMST", reply, sizeof(reply), REPLY_TIMEOUT_MS))
+  {
+    return false;
+  }
+  for(i = 0; i < STATS_FIELDS; i++)
+  {
+    stats[i] = reply[1 + 4 * i] | (reply[2 + 4 * i] << 8) | (reply[3 + 4 * i] << 16) | ((uint32_t)reply[4 + 4 * i] << 24);
+  }
+  return true;
+}
+
+/*************************************************************************
+Description:Print where the time of the session went
+parameter:  *stats:counters from queryStats()
+Return:     void
+Others:
+*************************************************************************/
+static void printStats(const uint32_t *stats)
+{
+  printf("device:%u bytes received,%u frames,%u CRC NACKs,%u bytes resynced\n",
+         stats[ST_RX_BYTES], stats[ST_FRAMES], stats[ST_CRC_NACKS], stats[ST_RESYNC_BYTES]);
+  printf("device:%u ms:erase %u ms,%u page programs %u ms,flash wait %u ms,USB idle %u ms,data %.1f KB/s\n",
+         stats[ST_ELAPSED_MS], stats[ST_ERASE_MS], stats[ST_PAGE_PROGRAMS], stats[ST_PROGRAM_US] / 1000,
+         stats[ST_WAIT_US] / 1000, stats[ST_IDLE_US] / 1000, stats[ST_BYTES_PER_SEC] / 1024.0);
+}
+
+/*************************************************************************
+Description:Stream v2 data frames
+parameter:  fd
+            *image:data of the frames
+            *frames:offset and length of every frame
+            window:frames sent ahead of their ACKs
+            journal:image id for COMCP,0:no journal
+            report:print the device rate and the time left at every COMCP
+Return:     true:every frame acknowledged
+Others:     Every frame carries its offset,so a NACKed frame is simply
+            sent again while the frames behind it stay valid.
+            The pipeline is drained every CHECKPOINT_FRAMES frames,then
+            COMCP records the offset of the next frame.
+*************************************************************************/
+static bool streamImageV2(int fd, const std::vector<uint8_t> &image, const std::vector<FrameV2> &frames, unsigned window, uint32_t journal, bool report)
+{
+  std::vector<uint8_t> frame;
+  std::vector<size_t> inFlight, resend;
+  std::vector<uint8_t> retries;
+  size_t next = 0, acked = 0, index;
+  size_t barrier = journal ? CHECKPOINT_FRAMES : frames.size();
+  unsigned percent = 101;
+  uint32_t first[STATS_FIELDS], stats[STATS_FIELDS];
+  double rate;
+  uint8_t reply;
+  retries.assign(frames.size(), 0);
+  if(report && (false == queryStats(fd, first)))
+  {
+    return false;
+  }
+  while(acked < frames.size())
+  {
+    while((inFlight.size() < window) && (!resend.empty() || ((next < frames.size()) && (next < barrier))))
+    {
+      if(!resend.empty())
+      {
+        index = resend.front();
+        resend.erase(resend.begin());
+      }
+      else
+      {
+        index = next++;
+      }
+      if(frames[index].packed.empty())
+      {
+        buildFrameV2(frames[index].offset, image.data() + frames[index].offset, frames[index].len, &frame);
+      }
+      else
+      {
+        buildFramePacked(frames[index], &frame);
+      }
+      if(false == serialWrite(fd, frame.data(), frame.size()))
+      {
+        fprintf(stderr, "write: %s\n", strerror(errno));
+        return false;
+      }
+      inFlight.push_back(index);
+    }
+    if(inFlight.empty())
+    {
+      //every frame below the barrier is acknowledged
+      if(false == checkpoint(fd, journal, frames[next].offset))
+      {
+        return false;
+      }
+      if(report)
+      {
+        if(false == queryStats(fd, stats))
+        {
+          return false;
+        }
+        //rate of the device since the stream started,the erase before it left out
+        rate = (stats[ST_ELAPSED_MS] > first[ST_ELAPSED_MS]) ?
+               (double)(stats[ST_DATA_BYTES] - first[ST_DATA_BYTES]) / (stats[ST_ELAPSED_MS] - first[ST_ELAPSED_MS]) : 0.0;
+        fprintf(stderr, "\r%3u%% %6.1f KB/s,%u NACKs,%4.0f s left ", percent, rate * 1000.0 / 1024.0, stats[ST_CRC_NACKS],
+                (rate > 0.0) ? (image.size() - frames[next].offset) / rate / 1000.0 : 0.0);
+      }
+      barrier += CHECKPOINT_FRAMES;
+      continue;
+    }
+    if(serialRead(fd, &reply, 1, REPLY_TIMEOUT_MS) != 1)
+    {
+      fprintf(stderr, "\nframe %zu: no reply\n", inFlight.front());
+      return false;
+    }
+    index = inFlight.front();
+    inFlight.erase(inFlight.begin());
+    if(reply != FRAME_ACK)
+    {
+      if(++retries[index] > FRAME_RETRIES)
+      {
+        fprintf(stderr, "\nframe %zu: NACK 0x%02x after %d retries\n", index, reply, FRAME_RETRIES);
+        return false;
+      }
+      resend.push_back(index);
+      continue;
+    }
+    acked++;
+    if(acked * 100 / frames.size() != percent)
+    {
+      percent = acked * 100 / frames.size();
+      fprintf(stderr, "\r%3u%%", percent);
+    }
+  }
+  fprintf(stderr, "\n");
+  return (0 == journal) || checkpoint(fd, journal, image.size());
+}
+
+/*************************************************************************
+Description:Send a v2 sector command
+parameter:  fd
+            *name:COMHS or COMSE
+            first,count:4KB sectors
+            *reply,replyLen:expected reply bytes,reply[0] must be ACK
+            timeoutMs
+Return:     true:acknowledged
+Others:
+*************************************************************************/
+static bool sectorCommand(int fd, const char *name, uint16_t first, uint16_t count, uint8_t *reply, size_t replyLen, int timeoutMs)
+{
+  std::vector<uint8_t> frame;
+  uint8_t payload[9];
+  memcpy(payload, name, 5);
+  payload[5] = first & 0xff;
+  payload[6] = first >> 8;
+  payload[7] = count & 0xff;
+  payload[8] = count >> 8;
+  buildFrame(0xAA, payload, sizeof(payload), &frame);
+  if((false == serialWrite(fd, frame.data(), frame.size()))
+  || (serialRead(fd, reply, replyLen, timeoutMs) != replyLen))
+  {
+    fprintf(stderr, "%s %u+%u: no reply\n", name, first, count);
+    return false;
+  }
+  if(reply[0] != FRAME_ACK)
+  {
+    fprintf(stderr, "%s %u+%u: NACK 0x%02x\n", name, first, count, reply[0]);
+    return false;
+  }
+  return true;
+}
+
+/*************************************************************************
+Description:Find the sectors whose flash content differs from the image,
+            erase them and queue their frames
+parameter:  fd
+            *image:padded to whole sectors with 0xff
+            frameSize:data bytes per frame
+            fill:the device takes COMFL
+            *frames,*fills:frames and fills of the changed sectors
+            *skipped:receives the 0xFF bytes of the changed sectors
+Return:     true:done
+Others:     Runs of changed sectors are erased with one COMSE each.
+*************************************************************************/
+static bool deltaSectors(int fd, const std::vector<uint8_t> &image, uint16_t frameSize, bool fill,
+                         std::vector<FrameV2> *frames, std::vector<Extent> *fills, uint32_t *skipped)
+{
+  std::vector<uint8_t> reply(1 + 4 * HASH_BATCH);
+  std::vector<bool> changed;
+  uint16_t sectors = image.size() / SECTOR_SIZE;
+  uint16_t first, count, i, run, dirty = 0;
+  uint32_t crc;
+  for(first = 0; first < sectors; first += count)
+  {
+    count = ((sectors - first) > HASH_BATCH) ? HASH_BATCH : (sectors - first);
+    if(false == sectorCommand(fd, "COMHS", first, count, reply.data(), 1 + 4 * count, REPLY_TIMEOUT_MS + count * HASH_SECTOR_MS))
+    {
+      return false;
+    }
+    for(i = 0; i < count; i++)
+    {
+      crc = reply[1 + 4 * i] | (reply[2 + 4 * i] << 8) | (reply[3 + 4 * i] << 16) | ((uint32_t)reply[4 + 4 * i] << 24);
+      changed.push_back(crc != checkCRC32(0, image.data() + (uint32_t)(first + i) * SECTOR_SIZE, SECTOR_SIZE));
+    }
+  }
+  for(first = 0; first < sectors; first += run)
+  {
+    for(run = 0; ((first + run) < sectors) && (changed[first] == changed[first + run]); run++);
+    if(changed[first])
+    {
+      if(false == sectorCommand(fd, "COMSE", first, run, reply.data(), 1, REPLY_TIMEOUT_MS + run * ERASE_SECTOR_MS))
+      {
+        return false;
+      }
+      *skipped += addExtents(image, (uint32_t)first * SECTOR_SIZE, (uint32_t)run * SECTOR_SIZE, frameSize, fill, frames, fills);
+      dirty += run;
+    }
+  }
+  printf("%u of %u sectors changed\n", dirty, sectors);
+  return true;
+}
+
+/*************************************************************************
+Description:Send a v2 flash range command
+parameter:  fd
+            *name:COMRD or COMCR
+            addr,len:flash range
+            *reply,replyLen:expected reply bytes,reply[0] must be ACK
+Return:     true:acknowledged
+Others:     The time allowed grows with the range.
+*************************************************************************/
+static bool rangeCommand(int fd, const char *name, uint32_t addr, uint32_t len, uint8_t *reply, size_t replyLen)
+{
+  std::vector<uint8_t> frame;
+  uint8_t payload[13];
+  uint8_t i;
+  memcpy(payload, name, 5);
+  for(i = 0; i < 4; i++)
+  {
+    payload[5 + i] = (addr >> (8 * i)) & 0xff;
+    payload[9 + i] = (len >> (8 * i)) & 0xff;
+  }
+  buildFrame(0xAA, payload, sizeof(payload), &frame);
+  if((false == serialWrite(fd, frame.data(), frame.size()))
+  || (serialRead(fd, reply, replyLen, REPLY_TIMEOUT_MS + (len / 1024 + 1) * READ_KB_MS) != replyLen))
+  {
+    fprintf(stderr, "%s 0x%x+%u: no reply\n", name, addr, len);
+    return false;
+  }
+  if(reply[0] != FRAME_ACK)
+  {
+    fprintf(stderr, "%s 0x%x+%u: NACK 0x%02x\n", name, addr, len, reply[0]);
+    return false;
+  }
+  return true;
+}
+
+/*************************************************************************
+Description:Let the device program runs of 0x00
+parameter:  fd,*fills
+Return:     true:every COMFL acknowledged
+Others:
+*************************************************************************/
+static bool fillExtents(int fd, const std::vector<Extent> &fills)
+{
+  std::vector<uint8_t> frame;
+  uint8_t payload[14], reply;
+  uint8_t i;
+  size_t k;
+  for(k = 0; k < fills.size(); k++)
+  {
+    memcpy(payload, "COMFL", 5);
+    for(i = 0; i < 4; i++)
+    {
+      payload[5 + i] = (fills[k].offset >> (8 * i)) & 0xff;
+      payload[9 + i] = (fills[k].len >> (8 * i)) & 0xff;
+    }
+    payload[13] = 0x00;
+    buildFrame(0xAA, payload, sizeof(payload), &frame);
+    if((false == serialWrite(fd, frame.data(), frame.size()))
+    || (serialRead(fd, &reply, 1, REPLY_TIMEOUT_MS + (fills[k].len / 1024 + 1) * FILL_KB_MS) != 1)
+    || (reply != FRAME_ACK))
+    {
+      fprintf(stderr, "COMFL 0x%x+%u: failed\n", fills[k].offset, fills[k].len);
+      return false;
+    }
+  }
+  return true;
+}
+
+/*************************************************************************
+Description:Compare the CRC32 of the flash range computed by the device
+            with the image
+parameter:  fd,*image
+Return:     true:equal
+Others:
+*************************************************************************/
+static bool verifyImage(int fd, const std::vector<uint8_t> &image)
+{
+  uint8_t reply[5];
+  uint32_t crc, expect = checkCRC32(0, image.data(), image.size());
+  if(false == rangeCommand(fd, "COMCR", 0, image.size(), reply, sizeof(reply)))
+  {
+    return false;
+  }
+  crc = reply[1] | (reply[2] << 8) | (reply[3] << 16) | ((uint32_t)reply[4] << 24);
+  if(crc != expect)
+  {
+    fprintf(stderr, "verify failed:flash CRC32 %08x,image %08x\n", crc, expect);
+    return false;
+  }
+  printf("verified,CRC32 %08x\n", crc);
+  return true;
+}
+
+/*************************************************************************
+Description:Read the flash back into a file
+parameter:  fd
+            len:bytes from address 0
+            *path:output file
+Return:     true:read and its CRC32 matched
+Others:
+*************************************************************************/
+static bool readBack(int fd, uint32_t len, const char *path)
+{
+  std::vector<uint8_t> reply(1 + len + 4);
+  uint32_t crc;
+  FILE *fp;
+  if(false == rangeCommand(fd, "COMRD", 0, len, reply.data(), reply.size()))
+  {
+    return false;
+  }
+  crc = reply[1 + len] | (reply[2 + len] << 8) | (reply[3 + len] << 16) | ((uint32_t)reply[4 + len] << 24);
+  if(crc != checkCRC32(0, reply.data() + 1, len))
+  {
+    fprintf(stderr, "COMRD: CRC32 error\n");
+    return false;
+  }
+  fp = fopen(path, "wb");
+  if(NULL == fp)
+  {
+    perror(path);
+    return false;
+  }
+  fwrite(reply.data() + 1, 1, len, fp);
+  fclose(fp);
+  printf("%u bytes read back to %s\n", len, path);
+  return true;
+}
+
+static void usage(void)
+{
+  fprintf(stderr, "usage: bmv31k304-upload [-1|-d|-c] [-z] [-s] [-r file] [-m widget|workshop] [-b baud] [-w window] device image\n"
+                  "  -1  v1 data frames only,do not probe with COMV2\n"
+                  "  -d  delta update:write only the 4KB sectors that differ,no chip erase\n"
+                  "  -c  continue an interrupted update of the same image\n"
+                  "  -z  compress the data frames\n"
+                  "  -s  show the device rate and time left,then where the time went\n"
+                  "  -r  read the written range back into a file\n"
+                  "  -m  mode passed to executeUpdate():widget(0,default) or workshop(1)\n"
+                  "  -b  baud rate,default 256000(ignored by USB CDC)\n"
+                  "  -w  data frames in flight,1~%d,default 8\n", WINDOW_MAX);
+}
+
+int main(int argc, char **argv)
+{
+  std::vector<uint8_t> image;
+  std::vector<FrameV2> frames;
+  std::vector<Extent> fills;
+  uint32_t skipped = 0, filled, journal = 0, addr;
+  uint8_t reply[9];
+  uint8_t capability = 0;
+  bool delta = false;
+  const char *readPath = NULL;
+  unsigned long baud = 256000;
+  unsigned window = 8;
+  uint16_t frameSize = 0;
+  bool workshop = false;
+  bool probe = true;
+  bool fill;
+  bool pack = false;
+  bool resume = false;
+  bool resumed = false;
+  bool report = false;
+  bool ok;
+  uint32_t stats[STATS_FIELDS];
+  double t0, t1, t2;
+  FILE *fp;
+  int fd, opt, c;
+  size_t i;
+
+  while((opt = getopt(argc, argv, "1dczsr:m:b:w:")) != -1)
+  {
+    switch(opt)
+    {
+      case '1':
+        probe = false;
+        break;
+      case 'd':
+        delta = true;
+        break;
+      case 'c':
+        resume = true;
+        break;
+      case 'z':
+        pack = true;
+        break;
+      case 's':
+        report = true;
+        break;
+      case 'r':
+        readPath = optarg;
+        break;
+      case 'm':
+        workshop = (0 == strcmp(optarg, "workshop")) || (0 == strcmp(optarg, "1"));
+        break;
+      case 'b':
+        baud = strtoul(optarg, NULL, 0);
+        break;
+      case 'w':
+        window = strtoul(optarg, NULL, 0);
+        break;
+      default:
+        usage();
+        return 2;
+    }
+  }
+  if((argc - optind != 2) || (window < 1) || (window > WINDOW_MAX) || ((delta || resume || pack || report || readPath) && !probe) || (delta && resume))
+  {
+    usage();
+    return 2;
+  }
+  fp = fopen(argv[optind + 1], "rb");
+  if(NULL == fp)
+  {
+    perror(argv[optind + 1]);
+    return 1;
+  }
+  while((c = fgetc(fp)) != EOF)
+  {
+    image.push_back((uint8_t)c);
+  }
+  fclose(fp);
+  fd = serialOpen(argv[optind], baud);
+  if(fd < 0)
+  {
+    perror(argv[optind]);
+    return 1;
+  }
+
+  t0 = nowMs();
+  if(false == control(fd, "ACOM", reply, 1, REPLY_TIMEOUT_MS))
+  {
+    return 1;
+  }
+  if(probe)
+  {
+    std::vector<uint8_t> frame;
+    buildFrame(0xAA, (const uint8_t *)"COMV2", 5, &frame);
+    serialWrite(fd, frame.data(), frame.size());
+    if((5 == serialRead(fd, reply, 5, PROBE_TIMEOUT_MS)) && (FRAME_ACK == reply[0]) && (reply[1] >= 2))
+    {
+      frameSize = reply[2] | (reply[3] << 8);
+      capability = reply[4];
+      printf("protocol v%u,frame %u bytes,capabilities 0x%02x\n", reply[1], frameSize, reply[4]);
+    }
+  }
+  if(false == control(fd, "COMSPI", reply, workshop ? 4 : 1, REPLY_TIMEOUT_MS))
+  {
+    return 1;
+  }
+  if(workshop)
+  {
+    printf("flash JEDEC ID %02x %02x %02x\n", reply[1], reply[2], reply[3]);
+  }
+  fill = (capability & CAP_FILL) != 0;
+  if(delta)
+  {
+    if(0 == (capability & CAP_SECTOR))
+    {
+      fprintf(stderr, "the device has no sector update(-d)\n");
+      return 1;
+    }
+    image.resize((image.size() + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE, 0xff);
+    if(false == deltaSectors(fd, image, frameSize, fill, &frames, &fills, &skipped))
+    {
+      return 1;
+    }
+  }
+  else
+  {
+    if(frameSize > 0)
+    {
+      skipped = addExtents(image, 0, image.size(), frameSize, fill, &frames, &fills);
+    }
+    if(capability & CAP_RESUME)
+    {
+      journal = checkCRC32(0, image.data(), image.size()) | 1;//0 is no journal
+    }
+    if(resume)
+    {
+      if((0 == journal) || (false == control(fd, "COMJQ", reply, 9, REPLY_TIMEOUT_MS)))
+      {
+        fprintf(stderr, "the device has no journal(-c)\n");
+        return 1;
+      }
+      if(journal == (reply[1] | (reply[2] << 8) | (reply[3] << 16) | ((uint32_t)reply[4] << 24)))
+      {
+        resumed = true;
+        addr = reply[5] | (reply[6] << 8) | (reply[7] << 16) | ((uint32_t)reply[8] << 24);
+        addr -= addr % SPARSE_BLOCK;//COMRS takes page starts,the image end is not one
+        for(i = 0; (i < frames.size()) && (frames[i].offset + frames[i].len <= addr); i++);
+        frames.erase(frames.begin(), frames.begin() + i);
+        fills.clear();//done before the first COMCP
+        skipped = 0;
+        printf("continuing at 0x%x\n", addr);
+        if(false == resumeAt(fd, addr))
+        {
+          return 1;
+        }
+      }
+      else
+      {
+        printf("no journal of this image on the device,full update\n");
+      }
+    }
+    if((false == resumed) && (false == control(fd, "COMCE", reply, 1, ERASE_TIMEOUT_MS)))
+    {
+      return 1;
+    }
+  }
+  if(report && (0 == (capability & CAP_STATS)))
+  {
+    fprintf(stderr, "the device has no session counters(-s)\n");
+    return 1;
+  }
+  if(pack)
+  {
+    if((0 == (capability & CAP_PACKED)) || (false == control(fd, "COMLZ", reply, 3, REPLY_TIMEOUT_MS)))
+    {
+      fprintf(stderr, "the device has no compressed frames(-z)\n");
+      return 1;
+    }
+    packFrames(image, &frames, frameSize, reply[1] | (reply[2] << 8));
+  }
+  t1 = nowMs();
+  for(filled = 0, i = 0; i < fills.size(); i++)
+  {
+    filled += fills[i].len;
+  }
+  if(skipped + filled > 0)
+  {
+    printf("sparse:%u bytes of 0xFF skipped,%u bytes of 0x00 filled\n", skipped, filled);
+  }
+  if(false == fillExtents(fd, fills))
+  {
+    return 1;
+  }
+  if(journal && !resumed && (false == checkpoint(fd, journal, 0)))
+  {
+    return 1;
+  }
+  if(frameSize > 0)
+  {
+    ok = streamImageV2(fd, image, frames, window, journal, report);
+  }
+  else
+  {
+    ok = streamImage(fd, image, window);
+  }
+  if(false == ok)
+  {
+    return 1;
+  }
+  t2 = nowMs();
+  if(report)
+  {
+    if(false == queryStats(fd, stats))
+    {
+      return 1;
+    }
+    printStats(stats);
+  }
+  if(capability & CAP_READBACK)
+  {
+    if(false == verifyImage(fd, image))
+    {
+      return 1;
+    }
+    if((readPath != NULL) && (false == readBack(fd, image.size(), readPath)))
+    {
+      return 1;
+    }
+  }
+  else if(readPath != NULL)
+  {
+    fprintf(stderr, "the device has no readback(-r)\n");
+    return 1;
+  }
+  if(false == control(fd, "COMORD", reply, 1, REPLY_TIMEOUT_MS))
+  {
+    return 1;
+  }
+  for(c = 0, i = 0; i < frames.size(); i++)
+  {
+    c += frames[i].packed.empty() ? frames[i].len : frames[i].packed.size();
+  }
+  if(0 == frameSize)
+  {
+    c = image.size();//v1
+  }
+  printf("%zu bytes in %.0f ms(%s %.0f ms),%d bytes sent,data %.1f KB/s,window %u\n",
+         image.size(), nowMs() - t0, delta ? "compare/erase" : (resumed ? "resume" : "erase"), t1 - t0, c,
+         (t2 > t1) ? (c / (t2 - t1) * 1000.0 / 1024.0) : 0.0, window);
+  close(fd);
+  return 0;
+}
@@ -0,0 +1,244 @@
+/*********************************************************************************************
+File:             wavetest.cpp
+Author:           BEST MODULES CORP.
+Description:      Host test of the waveform backend on the Linux HAL.
+                  1.The sample buffers poll() hands to a BMV31K304WaveOut are decoded back
+                    into edges and every edge is checked against the V1.0.1 bit timing
+                    (lead-in/start/stop 5000us,bit cells 1200/400us) to half a sample,at
+                    several sample rates.
+                  2.BMV31K304SPIWave sends the same commands with a non-blocking SPI
+                    transfer:the calls must return at once,isBusy() must follow the
+                    transfer and the simulated decoder must see every frame.
+                  Build: g++ -O2 -Isrc -o bmv31k304-wavetest extras/host/wavetest.cpp
+                             src/BMV31K304.cpp src/BMV31K304_HAL_Linux.cpp
+                  Usage: bmv31k304-wavetest,exit status 0 when every check passes
+History：    V1.0.1   -- 2024-07-19
+**********************************************************************************************/
+#include "BMV31K304.h"
+#include <stdio.h>
+#include <vector>
+
+#define CALL_MAX_US   200   //longest playVoice() call in BMV31K304_CMD_ASYNC mode
+
+static const BMV31K304Timing timing = BMV31K304_TIMING_DEFAULT;
+static unsigned failures = 0;
+
+/*Wave output that keeps every buffer it is given*/
+class CaptureWave : public BMV31K304WaveOut
+{
+public:
+  CaptureWave(uint32_t rate)
+  {
+    _rate = rate;
+  }
+  uint32_t sampleRate(void)
+  {
+    return _rate;
+  }
+  uint8_t *buffer(uint16_t *size)
+  {
+    *size = sizeof(_samples);
+    return _samples;
+  }
+  bool write(uint16_t length)
+  {
+    frames.push_back(std::vector<uint8_t>(_samples, _samples + length));
+    return true;
+  }
+  bool isBusy(void)
+  {
+    return false;
+  }
+  std::vector<std::vector<uint8_t> > frames;
+private:
+  uint32_t _rate;
+  uint8_t _samples[BMV31K304_WAVE_BUFFER_SIZE];
+};
+
+/*************************************************************************
+Description:Send the test commands
+parameter:  *voice:player
+            *cmd,*data:receive the expected frames
+Return:     number of frames
+Others:
+*************************************************************************/
+static uint8_t sendCommands(BMV31K304 *voice, uint8_t *cmd, uint8_t *data)
+{
+  static const uint8_t clip[] = {0, 5, 127, 128, 200, 255};
+  uint8_t i, n = 0;
+  for(i = 0; i < sizeof(clip); i++)
+  {
+    voice->setVolume(i);
+    cmd[n] = 0xe1 + i;
+    data[n++] = 0xff;
+    voice->playVoice(clip[i]);
+    cmd[n] = (clip[i] < 128) ? 0xfa : 0xfb;
+    data[n++] = clip[i] % 128;
+    voice->playSentence(0x55 ^ clip[i]);
+    cmd[n] = 0x55 ^ clip[i];
+    data[n++] = 0xff;
+    voice->flush();//stay within the command FIFO
+  }
+  return n;
+}
+
+/*************************************************************************
+Description:Get the nominal edges of a frame
+parameter:  cmd,data:frame
+            *edges:receive the edge times in us from the frame start
+Return:     void
+Others:     Lead-in high,then per byte a low start,8 bits LSB first
+            (bit1:long high+short low,bit0:short high+long low) and a
+            high stop.
+*************************************************************************/
+static void frameEdges(uint8_t cmd, uint8_t data, std::vector<uint32_t> *edges)
+{
+  uint32_t t = timing.leadIn;
+  uint8_t b, bit, value;
+  edges->clear();
+  for(b = 0; b < ((0xff == data) ? 1 : 2); b++)
+  {
+    value = (0 == b) ? cmd : data;
+    edges->push_back(t);
+    t += timing.start;
+    for(bit = 0; bit < 8; bit++)
+    {
+      edges->push_back(t);
+      t += ((value >> bit) & 0x01) ? timing.longCell : timing.shortCell;
+      edges->push_back(t);
+      t += ((value >> bit) & 0x01) ? timing.shortCell : timing.longCell;
+    }
+    edges->push_back(t);
+    t += timing.stop;
+  }
+}
+
+/*************************************************************************
+Description:Check the sample buffers of one sample rate
+parameter:  rate:samples per second
+Return:     void
+Others:
+*************************************************************************/
+static void checkEncoder(uint32_t rate)
+{
+  CaptureWave wave(rate);
+  BMV31K304 voice(29, &SPI1, 22, &wave);
+  std::vector<uint32_t> edges;
+  uint8_t cmd[32], data[32], n, f, level, prev;
+  uint32_t i, e, samples;
+  uint64_t errNs, worstNs = 0;
+  voice.begin();
+  voice.setCmdCoalesce(false);
+  n = sendCommands(&voice, cmd, data);
+  if(wave.frames.size() != n)
+  {
+    printf("encoder %luHz:%u buffers,expected %u\n", (unsigned long)rate, (unsigned)wave.frames.size(), n);
+    failures++;
+    return;
+  }
+  for(f = 0; f < n; f++)
+  {
+    frameEdges(cmd[f], data[f], &edges);
+    samples = wave.frames[f].size() * 8;
+    prev = HIGH;
+    e = 0;
+    for(i = 0; i < samples; i++)
+    {
+      level = (wave.frames[f][i >> 3] >> (7 - (i & 0x07))) & 0x01;
+      if(level == prev)
+      {
+        continue;
+      }
+      prev = level;
+      if(e >= edges.size())
+      {
+        e++;
+        break;
+      }
+      errNs = (uint64_t)i * 1000000000ULL / rate;
+      errNs = (errNs > edges[e] * 1000ULL) ? errNs - edges[e] * 1000ULL : edges[e] * 1000ULL - errNs;
+      worstNs = (errNs > worstNs) ? errNs : worstNs;
+      e++;
+    }
+    if((e != edges.size()) || (HIGH != prev))
+    {
+      printf("encoder %luHz:frame %u has %lu edges,expected %u\n", (unsigned long)rate, f, (unsigned long)e, (unsigned)edges.size());
+      failures++;
+    }
+  }
+  if(worstNs * rate > 500000000ULL)
+  {
+    printf("encoder %luHz:edge %.1fus off,more than half a sample\n", (unsigned long)rate, worstNs / 1000.0);
+    failures++;
+  }
+  printf("encoder %luHz:%u frames,worst edge %.1fus off\n", (unsigned long)rate, n, worstNs / 1000.0);
+}
+
+/*************************************************************************
+Description:Send frames through BMV31K304SPIWave on the simulated SPI
+parameter:  void
+Return:     void
+Others:
+*************************************************************************/
+static void checkSPIWave(void)
+{
+  BMV31K304SPIWave wave(&SPI2, 10000);
+  BMV31K304 voice(29, &SPI1, 22, &wave);
+  uint8_t cmd[32], data[32], n, i, got, gotData;
+  uint16_t first;
+  uint64_t t, timeUs;
+  bool busySeen;
+  voice.begin();
+  voice.setCmdCoalesce(false);
+  voice.setCmdMode(BMV31K304_CMD_ASYNC);
+  first = BMV31K304Sim::commandCount();
+  t = BMV31K304Sim::nanos();
+  voice.playVoice(9);
+  t = BMV31K304Sim::nanos() - t;
+  busySeen = wave.isBusy();
+  if((t > CALL_MAX_US * 1000ULL) || (false == busySeen))
+  {
+    printf("spiwave:playVoice() took %.1fus,transfer %s\n", t / 1000.0, busySeen ? "running" : "not running");
+    failures++;
+  }
+  voice.flush();
+  if(wave.isBusy())
+  {
+    printf("spiwave:busy after flush()\n");
+    failures++;
+  }
+  delay(20);
+  n = sendCommands(&voice, cmd, data);
+  voice.flush();
+  delay(20);
+  if((uint16_t)(BMV31K304Sim::commandCount() - first) != 1 + n)
+  {
+    printf("spiwave:%u frames decoded,expected %u\n", BMV31K304Sim::commandCount() - first, 1 + n);
+    failures++;
+    return;
+  }
+  for(i = 0; i < n; i++)
+  {
+    BMV31K304Sim::command(first + 1 + i, &got, &gotData, &timeUs);
+    if((got != cmd[i]) || (gotData != data[i]))
+    {
+      printf("spiwave:frame %u decoded %02x %02x,expected %02x %02x\n", i, got, gotData, cmd[i], data[i]);
+      failures++;
+    }
+  }
+  printf("spiwave:%u frames,playVoice() took %.1fus\n", 1 + n, t / 1000.0);
+}
+
+int main(void)
+{
+  static const uint32_t rate[] = {5000, 10000, 12000, 20000};
+  uint8_t i;
+  BMV31K304Sim::setClip(2000, 1000);
+  for(i = 0; i < sizeof(rate) / sizeof(rate[0]); i++)
+  {
+    checkEncoder(rate[i]);
+  }
+  checkSPIWave();
+  printf("%s\n", failures ? "FAIL" : "PASS");
+  return failures ? 1 : 0;
+}
@@ -10,15 +10,81 @@ History：    V1.0.1   -- 2024-07-19
 #define CONTINUE_PLAY   0XF2	//Continue playing the paused voice and sentence command
 #define LOOP_PLAY    	0XF4	//Loop playback for the current voice and sentence command
 #define STOP_PLAY     	0XF8	//Stop playing the current voice and sentence command
+#define VOLUME_MIN_CMD  0XE1	//Volume selection command range
+#define VOLUME_MAX_CMD  0XEC
+
+#define CMD_BYTE_PHASES 18    //start + 8*(high,low) + stop
+#define CMD_WAVE_PHASE  0xff  //frame is clocked out by the waveform peripheral
+#define CMD_LATE_US     50    //a segment may end this late before the next one is timed from now
+
+#define PLAY_START_TIMEOUT  500 //ms from the end of a frame to the busy line going low
+#define STATS_MAGIC0        0x53  //'S' 'T',start of the dumpStats() record
+#define STATS_MAGIC1        0x54
+#define STATS_VERSION       1
+#define STATS_NONE          0xff  //_statPending:no frame waiting for the busy line
+#define STATS_END           0x01  //_statFlags:last edge of the pending frame known
+#define STATS_BUSY          0x02  //_statFlags:busy line low since the pending frame started
+#define UPDATE_VERSION        2     //answer to COMV2
+#define UPDATE_CAP_FRAME_V2   0x01  //5A 23 data frames:16-bit length,flash offset,CRC32
+#define UPDATE_CAP_SECTOR     0x02  //COMHS sector CRC32s and COMSE sector erase
+#define UPDATE_CAP_READBACK   0x04  //COMRD flash readback and COMCR range CRC32
+#define UPDATE_CAP_FILL       0x08  //COMFL fill of a flash range with one byte value
+#define UPDATE_CAP_PACKED     0x10  //5C 23 compressed data frames,COMLZ gives the decoded size
+#define UPDATE_CAP_RESUME     0x20  //COMCP/COMJQ progress journal and COMRS resume
+#define UPDATE_CAP_STATS      0x40  //COMST session counters
+#define UPDATE_STATS_FIELDS   12    //counters of the COMST reply
+#if BMV31K304_UNPACK_SIZE > 0
+#define UPDATE_CAPABILITY     (UPDATE_CAP_FRAME_V2 | UPDATE_CAP_SECTOR | UPDATE_CAP_READBACK | UPDATE_CAP_FILL | UPDATE_CAP_PACKED | UPDATE_CAP_RESUME | UPDATE_CAP_STATS)
+#else
+#define UPDATE_CAPABILITY     (UPDATE_CAP_FRAME_V2 | UPDATE_CAP_SECTOR | UPDATE_CAP_READBACK | UPDATE_CAP_FILL | UPDATE_CAP_RESUME | UPDATE_CAP_STATS)
+#endif
+#define SECTOR_ERASE_TIMEOUT  2000  //ms,64KB block erase is 2s max on common SPI NOR(no SFDP)
+#define UPDATE_IDLE_TIMEOUT   100 //ms without data before updatePoll() gives up
+#define PAGE_PROGRAM_TIMEOUT  20  //ms,page program time is 3ms max on common SPI NOR(no SFDP)
+#define FLASH_CLOCK_MAX       50000000  //Hz,1-1-1 fast read(0x0B) of SPI NOR with SFDP
+#define FLASH_CLOCK_MAX_LEGACY 20000000 //Hz,flash without SFDP
+#define FLASH_POLL_MIN        50    //us,shortest interval of the flash status reads
+#define FLASH_POLL_MAX        2000  //us,longest interval of the flash status reads
+#define FLASH_POLL_SHIFT      3     //the interval is 1/8 of the time the operation has taken so far
+#define CALIBRATE_TRIES     3   //plays per timing step of calibrateTiming()
+#define CALIBRATE_STEP      10  //percent per timing step of calibrateTiming()
+
+static const BMV31K304Timing defaultTiming = BMV31K304_TIMING;
+
+enum
+{
+  PLAYLIST_IDLE = 0,  //no item started
+  PLAYLIST_SEND,      //queue the command of the current item
+  PLAYLIST_SENDING,   //command frame on the line
+  PLAYLIST_STARTING,  //waiting for the busy line to go low
+  PLAYLIST_PLAYING,   //waiting for the busy line to go high
+  PLAYLIST_GAP        //silence before the next item
+};
 
-#define SPI_FLASH_PAGESIZE 256
+enum
+{
+  FLASH_OP_IDLE = 0,  //no flash operation in flight
+  FLASH_OP_PROGRAM,   //page program,frames are handled meanwhile
+  FLASH_OP_ERASE      //sector/chip erase,the host waits for its ACK
+};
 
 #define CE         0x60  // Chip Erase instruction 
+#define SE         0x20  // Sector Erase instruction(4KB)
+#define BE         0xD8  // Block Erase instruction(64KB)
 #define PP         0x02  // Page Program instruction 
 #define READ       0x03  // Read from Memory instruction  
+#define FAST_READ  0x0B  // Fast Read instruction(8 dummy clocks)
 #define WREN       0x06  // Write enable instruction 
 #define RDSR       0x05  // Read Status Register instruction 
 #define	SFDP	     0x5a	 // Read SFDP.
+#define EN4B       0xB7  // Enter 4-byte address mode
+#define FAST_READ4 0x0C  // Fast Read with 4-byte address
+#define PP4        0x12  // Page Program with 4-byte address
+
+#define SFDP_HEADERS_MAX  8     //parameter headers looked at
+#define SFDP_BASIC_ID     0xff00 //JESD216 basic flash parameter table
+#define SFDP_4BAIT_ID     0xff84 //4-byte address instruction table
+#define SFDP_DWORD(t, n)  ((t)[4 * (n) - 4] | ((uint32_t)(t)[4 * (n) - 3] << 8) | ((uint32_t)(t)[4 * (n) - 2] << 16) | ((uint32_t)(t)[4 * (n) - 1] << 24))
 
 #define WIP_FLAG   0x01  // Write In Progress (WIP) flag 
 #define WEL_FLAG   0x02 // Write Enable Latch
@@ -46,19 +112,82 @@ static const uint8_t crc_table[] =
     0x82, 0xb3, 0xe0, 0xd1, 0x46, 0x77, 0x24, 0x15, 0x3b, 0x0a, 0x59, 0x68, 0xff, 0xce, 0x9d, 0xac
 };
 
+static const uint32_t crc32_table[16] =
+{
+    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+    0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+};
+
+BMV31K304 *BMV31K304::_busyInstance = NULL;
+
 /************************************************************************* 
 Description:  Constructor
 parameter:    cs1_ledPin:Chip selection pin/LED control pin, default to 29
               *spiClass:SPI communication interface, default to SPI1
               powerPin:Power pin, default to 22 pins        
+              *waveOut:waveform peripheral for the one-wire commands,
+                       default NULL(bit-banged on the DATA pin)
 Return:         
 Others:         
 *************************************************************************/
-BMV31K304::BMV31K304(uint8_t cs1_ledPin,SPIClass *spiClass,uint8_t powerPin)
+BMV31K304::BMV31K304(uint8_t cs1_ledPin,SPIClass *spiClass,uint8_t powerPin,BMV31K304WaveOut *waveOut)
 {
 	_flashAddr = 0;
+  _pageFill = 0;
+  _pageIndex = 0;
+  _flashOp = FLASH_OP_IDLE;
+  _pageError = false;
+  _pagePrograms = 0;
+  memset(_erasedStart, 0, sizeof(_erasedStart));
+  memset(_erasedEnd, 0, sizeof(_erasedEnd));//nothing known erased
+  _erasedNext = 0;
+  memset(&_updateStats, 0, sizeof(_updateStats));
+  _updateStartMs = 0;
+  _updateEndMs = 0;
+  _rxIdle = false;
+  _updateV2 = false;
+  _journalId = 0;
+  _journalAddr = 0;
+  defaultFlashInfo(0);
+  _flashClock = BMV31K304_FLASH_CLOCK;
+  _policy = &updatePolicy[0];
+  _updateState = BMV31K304_UPDATE_IDLE;
+  _updateTracking = false;
+  rxBuffer = _rxData;
+  _rxStart = 0;
+  _rxEnd = 0;
+  _rxSync = false;
+  _rxStamp = 0;
+  _cmdHead = 0;
+  _cmdTail = 0;
+  _txLock = 0;
+  _cmdMode = BMV31K304_CMD_BLOCKING;
+  _timing = defaultTiming;
+  _txPhase = 0;
+  _txIdleValid = false;
+  _playSent = false;
+  _playSentUs = 0;
+  _waveOut = waveOut;
+  _cmdCoalesce = true;
+  _cmdSent = 0;
+  _cmdSaved = 0;
+  _cmdDropped = 0;
+  clearShadow();
+#if BMV31K304_CMD_STATS
+  clearStats();
+#endif
+  _busyTracking = false;
+  _busyDebounce = 0;
+  _busyLevel = HIGH;
+  _busyFinished = false;
+  _busyEdgeUs = 0;
+  _busyStartUs = 0;
+  _busyEndUs = 0;
+  _playStartedCallback = NULL;
+  _playFinishedCallback = NULL;
 
   _sel = cs1_ledPin; 
+  _selOut.attach(_sel);
   _power = powerPin;
   if(spiClass != NULL)
   {
@@ -84,6 +213,7 @@ BMV31K304::BMV31K304(uint8_t cs1_ledPin,SPIClass *spiClass,uint8_t powerPin)
       _data = 7;
     }
   }
+  setPins(_data, _icpck, _icpda);
 }
 
 /************************************************************************* 
@@ -103,8 +233,15 @@ void BMV31K304::begin(void)
   pinMode(_data, OUTPUT);//DATA
   digitalWrite(_data, HIGH);
   pinMode(_icpck, INPUT);
+  clearShadow();
+  if((_waveOut != NULL) && ((false == waveFits()) || (false == _waveOut->begin())))
+  {
+    _waveOut = NULL;//no usable peripheral,poll() bit-bangs the frames
+  }
      
   delay(1000);//There's a delay here to get the BMV31K302SPI ready
+  _txIdleSince = micros();
+  _txIdleValid = true;
 }
 
 /************************************************************************* 
@@ -210,6 +347,11 @@ Others:
 *************************************************************************/
 bool BMV31K304::isPlaying(void)
 {
+  if(_busyTracking)
+  {
+    busyCheck();
+    return (LOW == _busyLevel);
+  }
 	if(0 == digitalRead(_icpck))
 	{
 		return true;
@@ -232,649 +374,1961 @@ void BMV31K304::setLED(uint8_t status)
 }
 
 /************************************************************************* 
-Description:Update your audio source with Ardunio
-parameter:  baudrate：Updated baud rate       
-Return:     void        
+Description:Select how playback commands are sent
+parameter:  mode:BMV31K304_CMD_BLOCKING:wait until the command is sent
+                 BMV31K304_CMD_ASYNC:queue the command and return at once,
+                 poll() must be called to send it
+Return:     void
 Others:         
 *************************************************************************/
-void BMV31K304::initAudioUpdate(unsigned long baudrate)
+void BMV31K304::setCmdMode(uint8_t mode)
 {
-  pinMode(_data, OUTPUT);
-  digitalWrite(_data, HIGH);
-	SerialUSB.begin(baudrate);
+  flush();
+  _cmdMode = mode;
 }
 
 /************************************************************************* 
-Description:Get the update sound source signal
-parameter:  void      
-Return:     true：execute update; false：not execute update
+Description:Enable or disable command coalescing
+parameter:  enable:true:drop commands with no effect and merge superseded
+                   queued commands(default);false:send every command
+Return:     void
 Others:         
 *************************************************************************/
-bool BMV31K304::isUpdateBegin(void)
+void BMV31K304::setCmdCoalesce(bool enable)
 {
-  if (SerialUSB.available())
-  {
-    return true;
-  }
-  else
-  {
-    return false;
-  }        
+  _cmdCoalesce = enable;
+  clearShadow();
 }
 
 /************************************************************************* 
-Description:Update the audio source
-parameter:  mode:0:BMduino Voice Widget  1:Holtek Voice MCU Workshop     
-Return:     true:Update completed; false:Update failed 
+Description:Get the number of command frames queued for the line
+parameter:  void
+Return:     frames
 Others:         
 *************************************************************************/
-bool BMV31K304::executeUpdate(uint8_t mode)
+uint32_t BMV31K304::getSentFrames(void)
 {
-  if(mode == 0)
-  {
-    return executeUpdateWidget();
-  }
-  else if(mode == 1)
-  {
-    return executeUpdateWorkshop();
-  }
-  return false;
+  return _cmdSent;
 }
 
 /************************************************************************* 
-Description:Update the audio source for BMduino voice Widget
-parameter:  void      
-Return:     true:Update completed; false:Update failed 
+Description:Get the number of command frames saved by coalescing
+parameter:  void
+Return:     frames
 Others:         
 *************************************************************************/
-bool BMV31K304::executeUpdateWidget(void)
+uint32_t BMV31K304::getSavedFrames(void)
 {
-    static int8_t dataLength = 0;
-    uint32_t delayCount = 0;
-    _EraseCnt=0;
-    while(1)
-    {
-        if(SerialUSB.available())
-        {
-            delayCount = 0;
-            SerialUSB.readBytes(rxBuffer, 3);   
-            if ((0xAA == rxBuffer[0]) && (0x23 == rxBuffer[1]))
-            {
-                dataLength = rxBuffer[2];
-                SerialUSB.readBytes(rxBuffer + 3, dataLength + 2);                 
-                if (rxBuffer[dataLength + 3] == checkCRC8(rxBuffer + 2, dataLength + 1))
-                {
-                    if (6 == dataLength)
-                    {
-                        dataLength =0;
-                         delayCount =0;
-                        if ((rxBuffer[3] == 'C') && (rxBuffer[4] == 'O') && (rxBuffer[5] == 'M')
-                        && (rxBuffer[6] == 'S') && (rxBuffer[7] == 'P') && (rxBuffer[8] == 'I'))
-                        {
-                            if (false == switchSPIMode())
-                            {
-                                
-                                //SerialUSB.write(0xe3);
-                                deviceIDBuf[0]=0xe3;
-                               // SerialUSB.write(deviceIDBuf, 4);                                
-                                SerialUSB.write(deviceIDBuf, 1); 
-                                digitalWrite(_power, LOW);
-                                delay(500);
-                                digitalWrite(_power, HIGH);    
-
-                                _flashAddr = 0;
-                                pinMode(_data, OUTPUT);
-                                digitalWrite(_data, HIGH);
-                               // pinMode(STATUS_PIN, INPUT);
-                                pinMode(_icpda, OUTPUT);
-                                digitalWrite(_icpda, HIGH);
-                                pinMode(_icpck, INPUT);
-                            }
-                            else
-                            {
-                                //SerialUSB.write(0x3e);//ACK
-                                deviceIDBuf[0]=0x3e;
-                                SerialUSB.write(deviceIDBuf, 1);   
-                               // SerialUSB.write(deviceIDBuf, 6);                                
-                            }
-                            
-                        }
-                        else if ((rxBuffer[3] == 'C') && (rxBuffer[4] == 'O') && (rxBuffer[5] == 'M')
-                        && (rxBuffer[6] == 'O') && (rxBuffer[7] == 'R') && (rxBuffer[8] == 'D'))
-                        {
-                            SerialUSB.write(0x3e);//ACK
-
-//                          reset();
-//                          pinMode(_power, OUTPUT);
-//                          digitalWrite(_power, LOW);	
-//
-//  	                      pinMode(_data, OUTPUT);//_data
-//	                 	      digitalWrite(_data, HIGH);
-// 	                        pinMode(_icpck, INPUT);
-//  	                      pinMode(STATUS_PIN, INPUT);
-//                          delay(10);
-//                          return 1;
-
-
-//                          digitalWrite(_power, LOW); 
-//                          delay(500);
-//                          digitalWrite(_power, HIGH);             
-                            _flashAddr = 0;
-                            _spi->end();
-                            pinMode(_power, OUTPUT);
-                            pinMode(_data, OUTPUT);
-                            pinMode(_icpda, OUTPUT);
-                            pinMode(_icpck, OUTPUT);
-                            pinMode(_sel, OUTPUT);
-                            digitalWrite(_power, LOW);  
-                            digitalWrite(_data, LOW);
-                            digitalWrite(_icpda, LOW);
-                            digitalWrite(_icpck, LOW);
-                            digitalWrite(_sel, LOW);
-                            delay(500);
-                            pinMode(_power, OUTPUT);
-                            digitalWrite(_power, HIGH);  
-                            pinMode(_data, OUTPUT);
-                            digitalWrite(_data, HIGH);
-                            //pinMode(STATUS_PIN, INPUT);
-                            pinMode(_icpda, OUTPUT);
-                            digitalWrite(_icpda, HIGH);
-                            pinMode(_icpck, INPUT);
-                            delay(10);
-                            return true;
-                        }
-                    }
-                    else if (5 == dataLength)
-                    {
-                        dataLength =0;
-                         delayCount =0;
-                        if ((rxBuffer[3] == 'C') && (rxBuffer[4] == 'O') && (rxBuffer[5] == 'M')
-                        && (rxBuffer[6] == 'C') && (rxBuffer[7] == 'E'))
-                        {
-                          _EraseCnt++;
-                          if(_EraseCnt<2)
-                          {
-                            SPIFlashChipErase();
-                           // SerialUSB.write(0x3e);//ACK
-                          }
-                          else {_EraseCnt=0;}
-
-                            delayCount = 0;
-                            SerialUSB.write(0x3e);//ACK
-                        }
-					    else 
-                        if ((rxBuffer[3] == 'R') && (rxBuffer[4] == 'e') && (rxBuffer[5] == 's')
-                        && (rxBuffer[6] == 'e') && (rxBuffer[7] == 't'))
-                        {
-							          SerialUSB.write(0x3e);//ACK
-
-
-                     reset();
-                     pinMode(_power, OUTPUT);
-                     digitalWrite(_power, LOW);	
-	                  //pinMode(LED_PIN, OUTPUT);
-		                //digitalWrite(LED_PIN, HIGH);
-  	                pinMode(_data, OUTPUT);//_data
-	                 	digitalWrite(_data, HIGH);
- 	                  pinMode(_icpck, INPUT);
-  	               // pinMode(STATUS_PIN, INPUT);
-
-                        }
-                    }
-                    else if (4 == dataLength)
-                    {
-                        dataLength =0;
-                        delayCount =0;
-                        if ((rxBuffer[3] == 'A') && (rxBuffer[4] == 'C') && (rxBuffer[5] == 'O')
-                        && (rxBuffer[6] == 'M'))
-                        {
-                            SerialUSB.write(0x3e);//ACK
-                        }
-                        else
-                            SerialUSB.write(0xe3);//NACK
-
-                    }                               
-                }
-                else
-                {
-                    dataLength =0;
-                    SerialUSB.write(0xe3);//NACK
-                }
-
-            }
-            else
-            {
-                recAudioData();
-            }
-        }                 
-        delayCount++;
-        delayMicroseconds(50);//waiting for receive data 
-        if(delayCount>=2000)
-        {
-            delayCount=0;
-            return false;//timeout is 50us*2000=100ms,nothing for receive
-        }
-    }
+  return _cmdSaved;
 }
 
 /************************************************************************* 
-Description:Update the audio source for Holtek Voice MCU Workshop
-parameter:  void   
-Return:     true:Update completed; false:Update failed 
-Others:         
+Description:Get the number of command frames dropped on a full FIFO
+parameter:  void
+Return:     frames
+Others:     Only BMV31K304_CMD_ASYNC mode drops,pace the commands with
+            isIdle() or raise BMV31K304_CMD_QUEUE_SIZE when it grows.
 *************************************************************************/
-bool BMV31K304::executeUpdateWorkshop(void)
+uint32_t BMV31K304::getDroppedFrames(void)
 {
-    static int8_t dataLength = 0;
-    uint32_t delayCount = 0;
-    _EraseCnt=0;
-    while(1)
-    {
-        if(SerialUSB.available())
-        {
-            delayCount = 0;
-            SerialUSB.readBytes(rxBuffer, 3);   
-            if ((0xAA == rxBuffer[0]) && (0x23 == rxBuffer[1]))
-            {
-                dataLength = rxBuffer[2];
-                SerialUSB.readBytes(rxBuffer + 3, dataLength + 2);                 
-                if (rxBuffer[dataLength + 3] == checkCRC8(rxBuffer + 2, dataLength + 1))
-                {
-                    if (6 == dataLength)
-                    {
-                        dataLength =0;
-                         delayCount =0;
-                        if ((rxBuffer[3] == 'C') && (rxBuffer[4] == 'O') && (rxBuffer[5] == 'M')
-                        && (rxBuffer[6] == 'S') && (rxBuffer[7] == 'P') && (rxBuffer[8] == 'I'))
-                        {
-                            if (false == switchSPIMode())
-                            {
-                                
-                                //SerialUSB.write(0xe3);
-                                deviceIDBuf[0]=0xe3;
-                                SerialUSB.write(deviceIDBuf, 4);                                
-                                digitalWrite(_power, LOW);
-                                delay(500);
-                                digitalWrite(_power, HIGH);    
-
-                                _flashAddr = 0;
-                                pinMode(_data, OUTPUT);
-                                digitalWrite(_data, HIGH);
-                               // pinMode(STATUS_PIN, INPUT);
-                                pinMode(_icpda, OUTPUT);
-                                digitalWrite(_icpda, HIGH);
-                                pinMode(_icpck, INPUT);
-                            }
-                            else
-                            {
-                                //SerialUSB.write(0x3e);//ACK
-                                deviceIDBuf[0]=0x3e;
-                                SerialUSB.write(deviceIDBuf, 4);                                
-                            }
-                            
-                        }
-                        else if ((rxBuffer[3] == 'C') && (rxBuffer[4] == 'O') && (rxBuffer[5] == 'M')
-                        && (rxBuffer[6] == 'O') && (rxBuffer[7] == 'R') && (rxBuffer[8] == 'D'))
-                        {
-                            SerialUSB.write(0x3e);//ACK
-
-                            digitalWrite(_power, LOW);
-                            delay(500);
-                            digitalWrite(_power, HIGH);                
-                            _flashAddr = 0;
-                            _spi->end();
-                            pinMode(_data, OUTPUT);
-                            digitalWrite(_data, HIGH);
-                           // pinMode(STATUS_PIN, INPUT);
-                            pinMode(_icpda, OUTPUT);
-                            digitalWrite(_icpda, HIGH);
-                            pinMode(_icpck, INPUT);
-                            delay(10);
-                            return true;
-                        }
-                    }
-                    else if (5 == dataLength)
-                    {
-                        dataLength =0;
-                         delayCount =0;
-                        if ((rxBuffer[3] == 'C') && (rxBuffer[4] == 'O') && (rxBuffer[5] == 'M')
-                        && (rxBuffer[6] == 'C') && (rxBuffer[7] == 'E'))
-                        {
-                          _EraseCnt++;
-                          if(_EraseCnt<2)
-                          {
-                            SPIFlashChipErase();
-                          }
-                          else {_EraseCnt=0;}
-
-                            delayCount = 0;
-                            SerialUSB.write(0x3e);//ACK
-                        }
-              else 
-                        if ((rxBuffer[3] == 'R') && (rxBuffer[4] == 'e') && (rxBuffer[5] == 's')
-                        && (rxBuffer[6] == 'e') && (rxBuffer[7] == 't'))
-                        {
-                        SerialUSB.write(0x3e);//ACK
-
-
-                     reset();
-                     pinMode(_power, OUTPUT);
-                     digitalWrite(_power, LOW);  
-                    //pinMode(LED_PIN, OUTPUT);
-                    //digitalWrite(LED_PIN, HIGH);
-                    pinMode(_data, OUTPUT);//DATA
-                    digitalWrite(_data, HIGH);
-                    pinMode(_icpck, INPUT);
-                  //  pinMode(STATUS_PIN, INPUT);
-                        }
-                    }
-                    else if (4 == dataLength)
-                    {
-                        dataLength =0;
-                        delayCount =0;
-                        if ((rxBuffer[3] == 'A') && (rxBuffer[4] == 'C') && (rxBuffer[5] == 'O')
-                        && (rxBuffer[6] == 'M'))
-                        {
-                            SerialUSB.write(0x3e);//ACK
-                        }
-                        else
-                            SerialUSB.write(0xe3);//NACK
-
-                    }                               
-                }
-                else
-                {
-                    dataLength =0;
-                    SerialUSB.write(0xe3);//NACK
-                }
-
-            }
-            else
-            {
-                recAudioData();
-            }
-        }
-                          
-        delayCount++;
-        delayMicroseconds(50);//waiting for receive data 
-        if(delayCount>=2000)
-        {
-            delayCount=0;
-            return false;//timeout is 50us*2000=100ms,nothing for receive
-        }
-    }
+  return _cmdDropped;
 }
 
 /************************************************************************* 
-Description:Reset 
-parameter:  void                
-Return:     void    
-Others:         
+Description:Track the busy line with a pin change interrupt
+parameter:  debounceUs:edges closer than this to the previous edge are
+                       ignored and settled by poll()/isPlaying(),0:off
+Return:     void
+Others:     One object at a time can use the interrupt.
+            isPlaying() then returns the latched state.
 *************************************************************************/
-void BMV31K304::reset(void)
+void BMV31K304::enableBusyInterrupt(uint16_t debounceUs)
 {
-  digitalWrite(_power, LOW);
-  delay(500);
-  digitalWrite(_power, HIGH);
+  _busyDebounce = debounceUs;
+  _busyLevel = digitalRead(_icpck);
+  _busyEdgeUs = micros();
+  _busyInstance = this;
+  _busyTracking = true;
+  attachInterrupt(digitalPinToInterrupt(_icpck), busyISR, CHANGE);
 }
 
 /************************************************************************* 
-Description:Set the power up or down of the BMV31K304
-parameter:  tatus: 0:power down; 1:power up
-Return:     void        
+Description:Stop tracking the busy line
+parameter:  void
+Return:     void
 Others:         
 *************************************************************************/
-void BMV31K304::setPower(uint8_t status)
+void BMV31K304::disableBusyInterrupt(void)
 {
-  digitalWrite(_power, status);
+  if(_busyTracking)
+  {
+    detachInterrupt(digitalPinToInterrupt(_icpck));
+    _busyTracking = false;
+    if(this == _busyInstance)
+    {
+      _busyInstance = NULL;
+    }
+  }
 }
 
 /************************************************************************* 
-Description:check IC
-parameter:  void             
-Return:     0:fail 1:succes       
-Others:         
+Description:Set the function called when a voice/sentence starts playing
+parameter:  callback:function,NULL:none
+Return:     void
+Others:     Called from the busy line interrupt,keep it short.
 *************************************************************************/
-uint8_t  BMV31K304::CheckIC(void)
+void BMV31K304::onPlaybackStarted(void (*callback)(void))
 {
-  uint16_t i;
-  pinMode(_power, OUTPUT);
-  pinMode(_sel, INPUT_PULLDOWN);
-  pinMode(_data, INPUT_PULLDOWN);
-  pinMode(_icpck, INPUT_PULLDOWN);
-  pinMode(_icpda, INPUT_PULLDOWN);   
+  _playStartedCallback = callback;
+}
 
+/************************************************************************* 
+Description:Set the function called when a voice/sentence has finished
+parameter:  callback:function,NULL:none
+Return:     void
+Others:     Called from the busy line interrupt,keep it short.
+*************************************************************************/
+void BMV31K304::onPlaybackFinished(void (*callback)(void))
+{
+  _playFinishedCallback = callback;
+}
 
-  //digitalWrite(_power, LOW);  
-  //reset();
-  digitalWrite(_power, HIGH);
-  delay(500);
-  digitalWrite(_power, LOW);
-  delay(50);
-  //pinMode(_icpda, INPUT);
-  //digitalWrite(_icpda, HIGH);
-  //for(i=0;i<254;i++);
-  //delay(10);
-  if(( digitalRead(_sel)==0)&&( digitalRead(_data)==0) )
+/************************************************************************* 
+Description:Wait until the queued commands are sent and playback ends
+parameter:  timeout:ms,0:wait forever
+Return:     true:idle; false:timeout
+Others:     The command transmitter keeps running while waiting.
+            The module pulls the busy line low some time after a play
+            command,so after such a frame it first waits up to
+            PLAY_START_TIMEOUT for playback to start.
+*************************************************************************/
+bool BMV31K304::waitIdle(uint32_t timeout)
+{
+  uint32_t start = millis();
+  while((false == isIdle()) || playStarting() || isPlaying())
   {
-    i=1;
-    reset();
-    pinMode(_sel, OUTPUT);
-    pinMode(_data, OUTPUT);
-    pinMode(_icpck, OUTPUT);
-    pinMode(_icpda, INPUT);         
-    return i;
+    poll();
+    yield();
+    if((timeout != 0) && ((uint32_t)(millis() - start) >= timeout))
+    {
+      return false;
+    }
   }
-//    if( digitalRead(_icpck)==0) i= 0;
-//    else{
-//      i= 1;
-//      reset();
-//      pinMode(_sel, OUTPUT);
-//      pinMode(_data, OUTPUT);
-//      pinMode(_icpck, OUTPUT);
-//      pinMode(_icpda, INPUT);   
-//      return i;
-//    } 
-  i= 1; 
-      
-  if(( digitalRead(_sel)==1)&&( digitalRead(_data)==1)&&( digitalRead(_icpck)==1) ) i= 0;
-  reset();
-  pinMode(_sel, OUTPUT);
-  pinMode(_data, OUTPUT);
-  pinMode(_icpck, OUTPUT);
-  pinMode(_icpda, INPUT);         
-  return i;
+  return true;
 }
 
 /************************************************************************* 
-Description:Switch SPI Mode
-parameter:  void      
-Return:     true:Switch successfully
-            false:Fail to switch
-Others:         
+Description:Check whether a sent play command is still to start playback
+parameter:  void
+Return:     true:the busy line should go low soon
+Others:     Gives up PLAY_START_TIMEOUT after the end of the frame.
 *************************************************************************/
-bool BMV31K304::switchSPIMode(void)
+bool BMV31K304::playStarting(void)
 {
-  static uint8_t correctFlag = 0;
-  static uint8_t retransmissionTimes = 0;
-  for(correctFlag=0;correctFlag<8;correctFlag++) rxBuffer[correctFlag]=0;
-  if (false == programEntry(0x02))
+  if(_playSent && (false == isPlaying()) && ((uint32_t)(micros() - _playSentUs) < PLAY_START_TIMEOUT * 1000UL))
   {
-    return false;
+    return true;
   }
-  correctFlag=0;
-  sendAddr(0x0020);
-  sendData(0x0000);
-  sendData(0x0000);
-  sendData(0x0007);
-  sendData(0x0000);    
+  _playSent = false;
+  return false;
+}
+
+/************************************************************************* 
+Description:Get and clear the playback finished flag
+parameter:  void
+Return:     true:a voice/sentence has finished since the last call
+Others:     Latched by the busy line interrupt,so short clips between
+            two calls are not missed.
+*************************************************************************/
+bool BMV31K304::isFinished(void)
+{
+  bool finished;
+  busyCheck();
+  noInterrupts();
+  finished = _busyFinished;
+  _busyFinished = false;
+  interrupts();
+  return finished;
+}
 
+/************************************************************************* 
+Description:Get the time the last voice/sentence started playing
+parameter:  void
+Return:     micros() of the busy line falling edge
+Others:         
+*************************************************************************/
+uint32_t BMV31K304::getPlayStartTime(void)
+{
+  return _busyStartUs;
+}
 
-//////////////////////////////
+/************************************************************************* 
+Description:Get the time the last voice/sentence finished
+parameter:  void
+Return:     micros() of the busy line rising edge
+Others:         
+*************************************************************************/
+uint32_t BMV31K304::getPlayEndTime(void)
+{
+  return _busyEndUs;
+}
 
-  _spi->begin();
-  pinMode(_sel, OUTPUT);
-  digitalWrite(_sel, HIGH);
-  delay(10);
-  SPIFlashRead0x9F(deviceSFDPBuf,3);
-  deviceIDBuf[1]=deviceSFDPBuf[0];
-  deviceIDBuf[2]=deviceSFDPBuf[1];
-  deviceIDBuf[3]=deviceSFDPBuf[2];
-  return true;
-  do{     
-    SPIFlashReadSFDP(deviceSFDPBuf,0,4);
-    //SPIFlashRead0x90(deviceSFDPBuf,2);
-    rxBuffer[1]=deviceSFDPBuf[0];
-    rxBuffer[2]=deviceSFDPBuf[1];
-    rxBuffer[3]=deviceSFDPBuf[2];
-    rxBuffer[4]=deviceSFDPBuf[3];
-    if ((0x53 == deviceSFDPBuf[0]) && (0x46 == deviceSFDPBuf[1]) 
-      && (0x44 == deviceSFDPBuf[2]) && (0x50 == deviceSFDPBuf[3]))      
-    {
-      correctFlag = 1;
-    }
-    retransmissionTimes++;
-    if (3 == retransmissionTimes)
-    {
-      retransmissionTimes = 0;
-      return false;
-    }
-  }while(0 == correctFlag);
-  correctFlag = 0;
-  retransmissionTimes = 0;
+#if BMV31K304_CMD_STATS
+/************************************************************************* 
+Description:Get the latency statistics of a command type
+parameter:  type:BMV31K304_STAT_VOICE~BMV31K304_STAT_OTHER
+            stage:BMV31K304_STAT_QUEUE,BMV31K304_STAT_WIRE,
+                  BMV31K304_STAT_BUSY or BMV31K304_STAT_TOTAL
+            *stat:receives the statistics
+Return:     true:done; false:type or stage out of range
+Others:     Only with BMV31K304_CMD_STATS set to 1.The BUSY and TOTAL
+            stages need enableBusyInterrupt() and are kept for the
+            voice,sentence and continue commands,whose frames start
+            playback.
+*************************************************************************/
+bool BMV31K304::getStats(uint8_t type, uint8_t stage, BMV31K304Latency *stat)
+{
+  if((type >= BMV31K304_STAT_TYPES) || (stage >= BMV31K304_STAT_STAGES))
+  {
+    return false;
+  }
+  noInterrupts();//busyISR() records the BUSY and TOTAL stages
+  *stat = _stats[type][stage];
+  interrupts();
+  stat->mean = (stat->count != 0) ? (uint32_t)(stat->sum / stat->count) : 0;
   return true;
 }
 
 /************************************************************************* 
-Description:Sends playback control commands
-parameter:  cmd：playback control commands
-            data : 0x00~0x7f is select the voice 0~127 to play if cmd is 0xfa
-            0x00~0x7f is select the voice 128~255 to play if cmd is 0xfb       
-Return:     void      
+Description:Clear the latency statistics
+parameter:  void
+Return:     void
 Others:         
 *************************************************************************/
-void BMV31K304::writeCmd(uint8_t cmd, uint8_t data)
+void BMV31K304::clearStats(void)
 {
-  delayMicroseconds(5000);
-  uint8_t i, temp;
-  temp = 0x01;
-    
-  if(0xff != data)
-  {
-        //start signal
-    digitalWrite(_data, LOW);
-    delay(5);
+  noInterrupts();
+  memset(_stats, 0, sizeof(_stats));
+  _statPending = STATS_NONE;
+  interrupts();
+}
 
-    for (i = 0; i < 8; i ++)
+/************************************************************************* 
+Description:Send the latency statistics to SerialUSB
+parameter:  void
+Return:     void
+Others:     53 54 VERSION TYPES STAGES BINS MASK(TYPES*STAGES bits)
+            then for each bit set(type*STAGES+stage,LSB first):
+            count(4) min(4) max(4) sum(8) hist(2*BINS),then the CRC32
+            of all bytes before it,little endian.Types and stages that
+            counted nothing are left out.
+*************************************************************************/
+void BMV31K304::dumpStats(void)
+{
+  BMV31K304Latency cell;
+  uint8_t buf[20 + 2 * BMV31K304_STATS_BINS];
+  uint8_t mask[(BMV31K304_STAT_TYPES * BMV31K304_STAT_STAGES + 7) / 8];
+  uint8_t type, stage, i, n;
+  uint32_t crc;
+  memset(mask, 0, sizeof(mask));
+  for(type = 0; type < BMV31K304_STAT_TYPES; type++)
+  {
+    for(stage = 0; stage < BMV31K304_STAT_STAGES; stage++)
     {
-      if (1 == (cmd & temp))
-      {
-        // out bit high
-        digitalWrite(_data, HIGH);
-        delayMicroseconds(1200);
-        digitalWrite(_data, LOW);
-        delayMicroseconds(400);
-      }
-      else
+      i = type * BMV31K304_STAT_STAGES + stage;
+      if(_stats[type][stage].count != 0)
       {
-        // out bit low
-        digitalWrite(_data, HIGH);
-        delayMicroseconds(400);
-        digitalWrite(_data, LOW);
-        delayMicroseconds(1200);
+        mask[i >> 3] |= 1 << (i & 0x07);
       }
-            cmd >>= 1;
     }
-    digitalWrite(_data, HIGH);
-    delay(5);
-    //start signal
-    digitalWrite(_data, LOW);
-    delay(5);
-
-    for (i = 0; i < 8; i ++)
+  }
+  buf[0] = STATS_MAGIC0;
+  buf[1] = STATS_MAGIC1;
+  buf[2] = STATS_VERSION;
+  buf[3] = BMV31K304_STAT_TYPES;
+  buf[4] = BMV31K304_STAT_STAGES;
+  buf[5] = BMV31K304_STATS_BINS;
+  crc = checkCRC32(0, buf, 6);
+  crc = checkCRC32(crc, mask, sizeof(mask));
+  SerialUSB.write(buf, 6);
+  SerialUSB.write(mask, sizeof(mask));
+  for(type = 0; type < BMV31K304_STAT_TYPES; type++)
+  {
+    for(stage = 0; stage < BMV31K304_STAT_STAGES; stage++)
     {
-      if (1 == (data & temp))
+      i = type * BMV31K304_STAT_STAGES + stage;
+      if(0 == (mask[i >> 3] & (1 << (i & 0x07))))
       {
-        // out bit high
-        digitalWrite(_data, HIGH);
-        delayMicroseconds(1200);
-        digitalWrite(_data, LOW);
-        delayMicroseconds(400);
+        continue;
       }
-      else
+      noInterrupts();
+      cell = _stats[type][stage];
+      interrupts();
+      n = 0;
+      for(i = 0; i < 4; i++)
       {
-        // out bit low
-        digitalWrite(_data, HIGH);
-        delayMicroseconds(400);
-        digitalWrite(_data, LOW);
-        delayMicroseconds(1200);
+        buf[n + i] = cell.count >> (8 * i);
+        buf[n + 4 + i] = cell.min >> (8 * i);
+        buf[n + 8 + i] = cell.max >> (8 * i);
       }
-      data >>= 1;
-    }
-    digitalWrite(_data, HIGH);
-    delay(5);
-  }
-  else
-  {
-    //start signal
-    digitalWrite(_data, LOW);
-    delay(5);
-    for (i = 0; i < 8; i ++)
-    {
-      if (1 == (cmd & temp))
+      n += 12;
+      for(i = 0; i < 8; i++)
       {
-        // out bit high
-        digitalWrite(_data, HIGH);
-        delayMicroseconds(1200);
-        digitalWrite(_data, LOW);
-        delayMicroseconds(400);
+        buf[n++] = cell.sum >> (8 * i);
       }
-      else
+      for(i = 0; i < BMV31K304_STATS_BINS; i++)
       {
-        // out bit low
-        digitalWrite(_data, HIGH);
-        delayMicroseconds(400);
-        digitalWrite(_data, LOW);
-        delayMicroseconds(1200);
+        buf[n++] = cell.hist[i] & 0xff;
+        buf[n++] = cell.hist[i] >> 8;
       }
-      cmd >>= 1;
+      crc = checkCRC32(crc, buf, n);
+      SerialUSB.write(buf, n);
     }
-    digitalWrite(_data, HIGH);
-    delay(5);        
   }
+  for(i = 0; i < 4; i++)
+  {
+    buf[i] = crc >> (8 * i);
+  }
+  SerialUSB.write(buf, 4);
 }
 
 /************************************************************************* 
-Description:Enter update mode
-parameter:  mode:set mode     
-Return:     true:Enter mode successfully
-            false:Failed to enter mode
+Description:Get the statistics type of a command byte
+parameter:  cmd:command byte of a frame
+Return:     BMV31K304_STAT_VOICE~BMV31K304_STAT_OTHER
 Others:         
 *************************************************************************/
-bool BMV31K304::programEntry(uint16_t mode)
+uint8_t BMV31K304::statType(uint8_t cmd)
 {
-  static uint8_t retransmissionTimes = 0;
-	
-  digitalWrite(_power, LOW);
-  //pinMode(STATUS_PIN, OUTPUT);
-  //digitalWrite(STATUS_PIN, LOW);
-  pinMode(_data, OUTPUT);
-  digitalWrite(_data, LOW);
-  pinMode(_sel, OUTPUT);
-  digitalWrite(_sel, LOW);
-  pinMode(_icpck, OUTPUT);
-  digitalWrite(_icpck, LOW);
-  pinMode(_icpda, OUTPUT);
-  digitalWrite(_icpda, LOW);
-    
-  delay(10);
-  //pinMode(STATUS_PIN, OUTPUT);
-  //digitalWrite(STATUS_PIN, LOW);
-  pinMode(_icpck, OUTPUT);
-  digitalWrite(_icpck, LOW);
-  pinMode(_icpda, OUTPUT);
-  digitalWrite(_icpda, LOW);
-  delay(5);
+  if((0xfa == cmd) || (0xfb == cmd))
+  {
+    return BMV31K304_STAT_VOICE;
+  }
+  if(cmd < VOLUME_MIN_CMD)
+  {
+    return BMV31K304_STAT_SENTENCE;
+  }
+  if(cmd <= VOLUME_MAX_CMD)
+  {
+    return BMV31K304_STAT_VOLUME;
+  }
+  switch(cmd)
+  {
+    case STOP_PLAY:
+      return BMV31K304_STAT_STOP;
+    case PAUSE_PLAY:
+      return BMV31K304_STAT_PAUSE;
+    case CONTINUE_PLAY:
+      return BMV31K304_STAT_CONTINUE;
+    case LOOP_PLAY:
+      return BMV31K304_STAT_LOOP;
+    default:
+      return BMV31K304_STAT_OTHER;
+  }
+}
+
+/************************************************************************* 
+Description:Note the start of a frame on the line
+parameter:  cmd:command byte of the frame
+            slot:its index in _cmdQueue
+            startUs:micros() of the start
+Return:     void
+Others:     A frame that starts playback waits in _statPending for the
+            busy line from here on:the module acts on its last edge,
+            before poll() sees the end of the stop signal.A stop
+            cancels the wait.
+*************************************************************************/
+void BMV31K304::statStart(uint8_t cmd, uint8_t slot, uint32_t startUs)
+{
+  uint8_t type = statType(cmd);
+  _statWireUs = startUs;
+  if((BMV31K304_STAT_VOICE == type) || (BMV31K304_STAT_SENTENCE == type) || (BMV31K304_STAT_CONTINUE == type))
+  {
+    noInterrupts();
+    _statPending = type;
+    _statPendingCallUs = _statCallUs[slot];
+    _statFlags = 0;
+    interrupts();
+  }
+  else if(BMV31K304_STAT_STOP == type)
+  {
+    _statPending = STATS_NONE;
+  }
+}
+
+/************************************************************************* 
+Description:Record the queue and wire time of a frame that has been sent
+parameter:  cmd:command byte of the frame
+            slot:its index in _cmdQueue
+            endUs:micros() of the end of the stop signal
+Return:     void
+Others:     The wire time ends at the last edge of the frame,the stop
+            signal after it is idle line.
+*************************************************************************/
+void BMV31K304::statFrame(uint8_t cmd, uint8_t slot, uint32_t endUs)
+{
+  uint8_t type = statType(cmd);
+  endUs -= _timing.stop;
+  statRecord(type, BMV31K304_STAT_QUEUE, _statWireUs - _statCallUs[slot]);
+  statRecord(type, BMV31K304_STAT_WIRE, endUs - _statWireUs);
+  noInterrupts();
+  if((type == _statPending) && (0 == (_statFlags & STATS_END)))
+  {
+    _statPendingEndUs = endUs;
+    _statFlags |= STATS_END;
+    statBusy();
+  }
+  interrupts();
+}
+
+/************************************************************************* 
+Description:Record the busy stages of the pending frame once its last
+            edge and the busy line going low are both known
+parameter:  void
+Return:     void
+Others:     Called with interrupts off.
+*************************************************************************/
+void BMV31K304::statBusy(void)
+{
+  uint32_t busy;
+  if((STATS_NONE == _statPending) || ((STATS_END | STATS_BUSY) != _statFlags))
+  {
+    return;
+  }
+  busy = _statBusyUs - _statPendingEndUs;
+  if((int32_t)busy < 0)
+  {
+    busy = 0;//busy went low within the timing error of the last edge
+  }
+  if(busy < PLAY_START_TIMEOUT * 1000UL)
+  {
+    statRecord(_statPending, BMV31K304_STAT_BUSY, busy);
+    statRecord(_statPending, BMV31K304_STAT_TOTAL, _statBusyUs - _statPendingCallUs);
+  }
+  _statPending = STATS_NONE;
+}
+
+/************************************************************************* 
+Description:Add a time to the statistics
+parameter:  type:BMV31K304_STAT_xxx command type
+            stage:BMV31K304_STAT_xxx stage
+            us:time
+Return:     void
+Others:         
+*************************************************************************/
+void BMV31K304::statRecord(uint8_t type, uint8_t stage, uint32_t us)
+{
+  BMV31K304Latency *stat = &_stats[type][stage];
+  uint8_t bin;
+  if((0 == stat->count) || (us < stat->min))
+  {
+    stat->min = us;
+  }
+  if(us > stat->max)
+  {
+    stat->max = us;
+  }
+  stat->count++;
+  stat->sum += us;
+  for(bin = 0; (bin < BMV31K304_STATS_BINS - 1) && (us >= ((uint32_t)BMV31K304_STATS_BIN_US << bin)); bin++);
+  if(stat->hist[bin] != 0xffff)
+  {
+    stat->hist[bin]++;
+  }
+}
+#endif
+
+/************************************************************************* 
+Description:Set the one-wire command timing
+parameter:  *timing:widths in us,e.g. BMV31K304_TIMING_DEFAULT
+Return:     void
+Others:     Queued commands are sent with the old timing first.
+*************************************************************************/
+void BMV31K304::setTiming(const BMV31K304Timing *timing)
+{
+  flush();
+  _timing = *timing;
+  if((_waveOut != NULL) && (false == waveFits()))
+  {
+    _waveOut = NULL;//frames outgrew the sample buffer,take the pin back for bit-banging
+    pinMode(_data, OUTPUT);
+    writeData(HIGH);
+  }
+}
+
+/************************************************************************* 
+Description:Get the one-wire command timing
+parameter:  *timing:receives the widths in us
+Return:     void
+Others:         
+*************************************************************************/
+void BMV31K304::getTiming(BMV31K304Timing *timing)
+{
+  *timing = _timing;
+}
+
+/************************************************************************* 
+Description:Find the fastest one-wire timing the module decodes reliably
+parameter:  voice:voice played to check each step,use a short one and
+                  mute the module first if it must not be heard
+            minPercent:shortest timing tried,in percent of the default,
+                       at least CALIBRATE_STEP
+Return:     true:a faster timing was found and set
+            false:the default timing is kept
+Others:     The start/stop gaps are shortened first,then the bit cells,
+            in CALIBRATE_STEP steps.A step passes when every one of
+            CALIBRATE_TRIES plays makes the busy line go low and a stop
+            makes it go high again.The result keeps one step of margin.
+*************************************************************************/
+bool BMV31K304::calibrateTiming(uint8_t voice, uint8_t minPercent)
+{
+  BMV31K304Timing candidate;
+  BMV31K304Timing best = defaultTiming;
+  uint8_t group, percent, passed;
+  bool coalesce = _cmdCoalesce;
+  bool faster = false;
+  if(minPercent < CALIBRATE_STEP)
+  {
+    minPercent = CALIBRATE_STEP;//percent must not wrap below 0
+  }
+  _cmdCoalesce = false;//every test frame must reach the wire
+  for(group = 0; group < 2; group++)
+  {
+    passed = 100;
+    for(percent = 100 - CALIBRATE_STEP; percent >= minPercent; percent -= CALIBRATE_STEP)
+    {
+      candidate = best;
+      if(0 == group)
+      {
+        candidate.leadIn = (uint32_t)defaultTiming.leadIn * percent / 100;
+        candidate.start = (uint32_t)defaultTiming.start * percent / 100;
+        candidate.stop = (uint32_t)defaultTiming.stop * percent / 100;
+      }
+      else
+      {
+        candidate.longCell = (uint32_t)defaultTiming.longCell * percent / 100;
+        candidate.shortCell = (uint32_t)defaultTiming.shortCell * percent / 100;
+      }
+      if(false == checkTiming(&candidate, voice))
+      {
+        break;
+      }
+      passed = percent;
+    }
+    if(passed <= 100 - 2 * CALIBRATE_STEP)
+    {
+      percent = passed + CALIBRATE_STEP;//one step of margin
+      if(0 == group)
+      {
+        best.leadIn = (uint32_t)defaultTiming.leadIn * percent / 100;
+        best.start = (uint32_t)defaultTiming.start * percent / 100;
+        best.stop = (uint32_t)defaultTiming.stop * percent / 100;
+      }
+      else
+      {
+        best.longCell = (uint32_t)defaultTiming.longCell * percent / 100;
+        best.shortCell = (uint32_t)defaultTiming.shortCell * percent / 100;
+      }
+      faster = true;
+    }
+  }
+  setTiming(&best);
+  _cmdCoalesce = coalesce;
+  clearShadow();
+  return faster;
+}
+
+/************************************************************************* 
+Description:Get the time a command frame takes on the wire
+parameter:  cmd,data:same as writeCmd()
+Return:     us,including the lead-in
+Others:     Uses the current timing.
+*************************************************************************/
+uint32_t BMV31K304::getWireTime(uint8_t cmd, uint8_t data)
+{
+  uint8_t phase, level;
+  uint16_t width;
+  uint32_t total = 0;
+  for(phase = 1; cmdSegment(phase, cmd, data, &level, &width); phase++)
+  {
+    total += width;
+  }
+  return total;
+}
+
+/************************************************************************* 
+Description:Update your audio source with Ardunio
+parameter:  baudrate：Updated baud rate       
+Return:     void        
+Others:         
+*************************************************************************/
+void BMV31K304::initAudioUpdate(unsigned long baudrate)
+{
+  pinMode(_data, OUTPUT);
+  digitalWrite(_data, HIGH);
+	SerialUSB.begin(baudrate);
+}
+
+/************************************************************************* 
+Description:Get the update sound source signal
+parameter:  void      
+Return:     true：execute update; false：not execute update
+Others:         
+*************************************************************************/
+bool BMV31K304::isUpdateBegin(void)
+{
+  if (SerialUSB.available())
+  {
+    return true;
+  }
+  else
+  {
+    return false;
+  }        
+}
+
+/*Per-tool behaviour of the update,indexed by the mode of beginUpdate()*/
+const BMV31K304::UpdatePolicy BMV31K304::updatePolicy[] =
+{
+  {1, &BMV31K304::releaseWidget},  //0:BMduino Voice Widget,COMSPI answers ACK/NACK
+  {4, &BMV31K304::releaseWorkshop},//1:Holtek Voice MCU Workshop,COMSPI adds the JEDEC ID
+};
+
+/************************************************************************* 
+Description:Update the audio source
+parameter:  mode:0:BMduino Voice Widget  1:Holtek Voice MCU Workshop     
+Return:     true:Update completed; false:Update failed 
+Others:     Blocking wrapper of beginUpdate()/updatePoll().
+*************************************************************************/
+bool BMV31K304::executeUpdate(uint8_t mode)
+{
+  uint8_t state;
+  if(false == beginUpdate(mode))
+  {
+    return false;
+  }
+  while(BMV31K304_UPDATE_RUNNING == (state = updatePoll()))
+  {
+    if(0 == SerialUSB.available())
+    {
+      delayMicroseconds(50);//waiting for receive data
+    }
+  }
+  return (BMV31K304_UPDATE_DONE == state);
+}
+
+/************************************************************************* 
+Description:Start an update of the audio source,driven by updatePoll()
+parameter:  mode:0:BMduino Voice Widget  1:Holtek Voice MCU Workshop     
+Return:     true:started; false:unknown mode
+Others:     Playback commands must not be used until updatePoll() reports
+            BMV31K304_UPDATE_DONE or BMV31K304_UPDATE_FAILED.
+*************************************************************************/
+bool BMV31K304::beginUpdate(uint8_t mode)
+{
+  if(mode >= sizeof(updatePolicy) / sizeof(updatePolicy[0]))
+  {
+    return false;
+  }
+  _policy = &updatePolicy[mode];
+  _updateTracking = _busyTracking;
+  clearShadow();//the module is power cycled during the update
+  _txIdleValid = false;//and the DATA pin is driven by the ICP sequence
+  if(_updateTracking)
+  {
+    disableBusyInterrupt();//ICPCK is driven during the update
+  }
+  _flashAddr = 0;
+  _pageFill = 0;
+  _pageIndex = 0;
+  _flashOp = FLASH_OP_IDLE;
+  _pageError = false;
+  _pagePrograms = 0;
+  memset(_erasedStart, 0, sizeof(_erasedStart));
+  memset(_erasedEnd, 0, sizeof(_erasedEnd));//nothing known erased
+  _erasedNext = 0;
+  memset(&_updateStats, 0, sizeof(_updateStats));
+  _updateStartMs = millis();
+  _rxIdle = false;
+  _updateV2 = false;//until the host sends COMV2
+  _EraseCnt = 0;
+  _rxStart = 0;
+  _rxEnd = 0;
+  _rxSync = true;//a damaged first frame is NACKed too
+  _rxStamp = millis();
+  _updateState = BMV31K304_UPDATE_RUNNING;
+  return true;
+}
+
+/************************************************************************* 
+Description:Run the update started by beginUpdate()
+parameter:  void      
+Return:     BMV31K304_UPDATE_IDLE:no update started
+            BMV31K304_UPDATE_RUNNING:call again
+            BMV31K304_UPDATE_DONE:COMORD received,the module runs again
+            BMV31K304_UPDATE_FAILED:no data for UPDATE_IDLE_TIMEOUT ms
+                                    or a page failed to program
+Others:     Drains what SerialUSB has received into _rxData in one go,
+            then handles the complete frames in it,so it returns within
+            the time of those frames.Erases only start here:while one
+            runs,frames are collected in _rxData and handled after it.
+*************************************************************************/
+uint8_t BMV31K304::updatePoll(void)
+{
+  int available;
+  uint16_t n;
+  if(_updateState != BMV31K304_UPDATE_RUNNING)
+  {
+    return _updateState;
+  }
+  available = SerialUSB.available();
+  if(available > 0)
+  {
+    if((BMV31K304_RX_BUFFER_SIZE - _rxEnd < (uint16_t)available) && (_rxStart > 0))
+    {
+      memmove(_rxData, _rxData + _rxStart, _rxEnd - _rxStart);//only the unparsed rest
+      _rxEnd -= _rxStart;
+      _rxStart = 0;
+    }
+    n = BMV31K304_RX_BUFFER_SIZE - _rxEnd;
+    n = ((uint16_t)available < n) ? available : n;
+    n = SerialUSB.readBytes(_rxData + _rxEnd, n);
+    _rxEnd += n;
+    _updateStats.rxBytes += n;
+    _rxStamp = millis();
+    if(_rxIdle)
+    {
+      _rxIdle = false;
+      _updateStats.idleUs += micros() - _rxIdleUs;
+    }
+  }
+  if(flashPoll() && (FLASH_OP_ERASE == _flashOp))
+  {
+    _rxStamp = millis();//the host waits for the ACK at the end of the erase
+  }
+  while((BMV31K304_UPDATE_RUNNING == _updateState) && (_flashOp != FLASH_OP_ERASE) && recFrame())
+  {
+    _rxStamp = millis();//the frame may have kept the CPU for a while
+  }
+  if(_rxStart == _rxEnd)
+  {
+    _rxStart = _rxEnd = 0;
+  }
+  if((false == _rxIdle) && (_flashOp != FLASH_OP_ERASE))
+  {
+    _rxIdle = true;//every complete frame is handled,the rest is up to the host
+    _rxIdleUs = micros();
+  }
+  if((BMV31K304_UPDATE_RUNNING == _updateState) && (millis() - _rxStamp >= UPDATE_IDLE_TIMEOUT))
+  {
+    pageFlush();//keep what was received before the host stopped
+    flashWait();
+    endUpdate(BMV31K304_UPDATE_FAILED);
+  }
+  return _updateState;
+}
+
+/************************************************************************* 
+Description:Find and handle the next frame in _rxData
+parameter:  void      
+Return:     true:a frame was handled; false:more bytes are needed
+Others:     AA 23 LEN payload CRC8 TAIL:control frame
+            55 23 LEN data CRC8 TAIL:v1 data frame
+            5A 23/5C 23:v2 data frame,see recAudioFrame()
+            The frame is checked and handled where it was received.After
+            a damaged frame(bad CRC or length,or no frame where the next
+            one should start) one NACK is sent and the parser moves on
+            byte by byte to the next header that checks out.
+*************************************************************************/
+bool BMV31K304::recFrame(void)
+{
+  uint8_t *p;
+  uint16_t len, size;
+  uint32_t crc;
+  while(_rxEnd - _rxStart >= 4)
+  {
+    p = _rxData + _rxStart;
+    size = 0;
+    if(0x23 == p[1])
+    {
+      if((0xAA == p[0]) || (0x55 == p[0]))
+      {
+        size = p[2] + 5;
+      }
+      else if(((0x5A == p[0]) || ((0x5C == p[0]) && (UPDATE_CAPABILITY & UPDATE_CAP_PACKED))) && _updateV2)
+      {
+        len = p[2] | ((uint16_t)p[3] << 8);
+        size = (len <= BMV31K304_FRAME_SIZE_MAX) ? (len + ((0x5C == p[0]) ? 14 : 12)) : 0;
+      }
+    }
+    if((size > 0) && (size <= BMV31K304_RX_BUFFER_SIZE))
+    {
+      if(_rxEnd - _rxStart < size)
+      {
+        return false;//wait for the rest
+      }
+      if((0xAA == p[0]) || (0x55 == p[0]))
+      {
+        crc = (p[size - 2] == checkCRC8(p + 2, size - 4)) ? 0 : 1;
+      }
+      else
+      {
+        crc = checkCRC32(0, p + 2, size - 6);
+        crc ^= p[size - 4] | ((uint32_t)p[size - 3] << 8) | ((uint32_t)p[size - 2] << 16) | ((uint32_t)p[size - 1] << 24);
+      }
+      if(0 == crc)
+      {
+        _rxSync = true;
+        _rxStart += size;
+        _updateStats.frames++;
+        rxBuffer = p;
+        if(0xAA == p[0])
+        {
+          recControl();
+        }
+        else if(0x55 == p[0])
+        {
+          recAudioData();
+        }
+        else
+        {
+          recAudioFrame();
+        }
+        return true;
+      }
+    }
+    if(_rxSync)
+    {
+      _rxSync = false;
+      SerialUSB.write(0xe3);//NACK the damaged frame once
+      _updateStats.crcNacks++;
+    }
+    _rxStart++;
+    _updateStats.resyncBytes++;
+  }
+  return false;
+}
+
+/************************************************************************* 
+Description:Finish the update
+parameter:  state:BMV31K304_UPDATE_DONE or BMV31K304_UPDATE_FAILED
+Return:     void
+Others:         
+*************************************************************************/
+void BMV31K304::endUpdate(uint8_t state)
+{
+  _updateState = state;
+  _updateEndMs = millis();
+  if(_rxIdle)
+  {
+    _rxIdle = false;
+    _updateStats.idleUs += micros() - _rxIdleUs;
+  }
+  if(_updateTracking)
+  {
+    enableBusyInterrupt(_busyDebounce);
+  }
+}
+
+/************************************************************************* 
+Description:Handle a control frame
+parameter:  void      
+Return:     void
+Others:     rxBuffer points to the checked frame.The Widget and Workshop tools
+            only differ in the COMSPI reply and the release of the module
+            after COMORD,see updatePolicy.
+*************************************************************************/
+void BMV31K304::recControl(void)
+{
+  uint8_t len = rxBuffer[2];
+  if(recControlV2(len))
+  {
+    return;
+  }
+  if(isCommand("COMSPI", len))
+  {
+    if(false == switchSPIMode())
+    {
+      deviceIDBuf[0] = 0xe3;
+      SerialUSB.write(deviceIDBuf, _policy->spiReplyLen);
+      digitalWrite(_power, LOW);
+      delay(500);
+      digitalWrite(_power, HIGH);
+      _flashAddr = 0;
+      _pageFill = 0;
+      pinMode(_data, OUTPUT);
+      digitalWrite(_data, HIGH);
+      pinMode(_icpda, OUTPUT);
+      digitalWrite(_icpda, HIGH);
+      pinMode(_icpck, INPUT);
+    }
+    else
+    {
+      deviceIDBuf[0] = 0x3e;//ACK,Workshop also gets the JEDEC ID
+      SerialUSB.write(deviceIDBuf, _policy->spiReplyLen);
+    }
+  }
+  else if(isCommand("COMORD", len))
+  {
+    pageFlush();//program the last partial page before the ACK
+    flashWait();
+    SerialUSB.write(_pageError ? 0xe3 : 0x3e);//ACK,NACK if a page failed
+    (this->*_policy->release)();
+    _flashAddr = 0;
+    _pageFill = 0;
+    endUpdate(_pageError ? BMV31K304_UPDATE_FAILED : BMV31K304_UPDATE_DONE);
+  }
+  else if(isCommand("COMCE", len))
+  {
+    _EraseCnt++;
+    if(_EraseCnt < 2)
+    {
+      pageFlush();
+      flashWait();
+      SPIFlashChipErase();//ACK when it ends,see chipEraseDone()
+      _journalId = 0;//the journal described the erased image
+      _journalAddr = 0;
+    }
+    else
+    {
+      _EraseCnt = 0;
+      SerialUSB.write(0x3e);//ACK
+    }
+  }
+  else if(isCommand("COMV2", len))
+  {
+    sendCapability();//switch to v2 data frames
+  }
+  else if(isCommand("Reset", len))
+  {
+    SerialUSB.write(0x3e);//ACK
+    reset();
+    pinMode(_power, OUTPUT);
+    digitalWrite(_power, LOW);
+    pinMode(_data, OUTPUT);
+    digitalWrite(_data, HIGH);
+    pinMode(_icpck, INPUT);
+  }
+  else if(isCommand("ACOM", len))
+  {
+    SerialUSB.write(0x3e);//ACK
+  }
+  else if(4 == len)
+  {
+    SerialUSB.write(0xe3);//NACK
+  }
+}
+
+/************************************************************************* 
+Description:Compare the payload of a control frame with a command
+parameter:  *name:command
+            len:payload length
+Return:     true:equal
+Others:         
+*************************************************************************/
+bool BMV31K304::isCommand(const char *name, uint8_t len)
+{
+  return (strlen(name) == len) && (0 == memcmp(rxBuffer + 3, name, len));
+}
+
+/************************************************************************* 
+Description:Release the module after COMORD(BMduino Voice Widget)
+parameter:  void      
+Return:     void
+Others:     All lines low for a clean power cycle of the module.
+*************************************************************************/
+void BMV31K304::releaseWidget(void)
+{
+  _spi->end();
+  pinMode(_power, OUTPUT);
+  pinMode(_data, OUTPUT);
+  pinMode(_icpda, OUTPUT);
+  pinMode(_icpck, OUTPUT);
+  pinMode(_sel, OUTPUT);
+  digitalWrite(_power, LOW);
+  digitalWrite(_data, LOW);
+  digitalWrite(_icpda, LOW);
+  digitalWrite(_icpck, LOW);
+  digitalWrite(_sel, LOW);
+  delay(500);
+  pinMode(_power, OUTPUT);
+  digitalWrite(_power, HIGH);
+  pinMode(_data, OUTPUT);
+  digitalWrite(_data, HIGH);
+  pinMode(_icpda, OUTPUT);
+  digitalWrite(_icpda, HIGH);
+  pinMode(_icpck, INPUT);
+  delay(10);
+}
+
+/************************************************************************* 
+Description:Release the module after COMORD(Holtek Voice MCU Workshop)
+parameter:  void      
+Return:     void
+Others:         
+*************************************************************************/
+void BMV31K304::releaseWorkshop(void)
+{
+  digitalWrite(_power, LOW);
+  delay(500);
+  digitalWrite(_power, HIGH);
+  _spi->end();
+  pinMode(_data, OUTPUT);
+  digitalWrite(_data, HIGH);
+  pinMode(_icpda, OUTPUT);
+  digitalWrite(_icpda, HIGH);
+  pinMode(_icpck, INPUT);
+  delay(10);
+}
+
+/************************************************************************* 
+Description:Reset 
+parameter:  void                
+Return:     void    
+Others:         
+*************************************************************************/
+void BMV31K304::reset(void)
+{
+  digitalWrite(_power, LOW);
+  delay(500);
+  digitalWrite(_power, HIGH);
+  clearShadow();
+}
+
+/************************************************************************* 
+Description:Set the power up or down of the BMV31K304
+parameter:  tatus: 0:power down; 1:power up
+Return:     void        
+Others:         
+*************************************************************************/
+void BMV31K304::setPower(uint8_t status)
+{
+  digitalWrite(_power, status);
+}
+
+/************************************************************************* 
+Description:check IC
+parameter:  void             
+Return:     0:fail 1:succes       
+Others:         
+*************************************************************************/
+uint8_t  BMV31K304::CheckIC(void)
+{
+  uint16_t i;
+  pinMode(_power, OUTPUT);
+  pinMode(_sel, INPUT_PULLDOWN);
+  pinMode(_data, INPUT_PULLDOWN);
+  pinMode(_icpck, INPUT_PULLDOWN);
+  pinMode(_icpda, INPUT_PULLDOWN);   
+
+
+  //digitalWrite(_power, LOW);  
+  //reset();
+  digitalWrite(_power, HIGH);
+  delay(500);
+  digitalWrite(_power, LOW);
+  delay(50);
+  //pinMode(_icpda, INPUT);
+  //digitalWrite(_icpda, HIGH);
+  //for(i=0;i<254;i++);
+  //delay(10);
+  if(( digitalRead(_sel)==0)&&( digitalRead(_data)==0) )
+  {
+    i=1;
+    reset();
+    pinMode(_sel, OUTPUT);
+    pinMode(_data, OUTPUT);
+    pinMode(_icpck, OUTPUT);
+    pinMode(_icpda, INPUT);         
+    return i;
+  }
+//    if( digitalRead(_icpck)==0) i= 0;
+//    else{
+//      i= 1;
+//      reset();
+//      pinMode(_sel, OUTPUT);
+//      pinMode(_data, OUTPUT);
+//      pinMode(_icpck, OUTPUT);
+//      pinMode(_icpda, INPUT);   
+//      return i;
+//    } 
+  i= 1; 
+      
+  if(( digitalRead(_sel)==1)&&( digitalRead(_data)==1)&&( digitalRead(_icpck)==1) ) i= 0;
+  reset();
+  pinMode(_sel, OUTPUT);
+  pinMode(_data, OUTPUT);
+  pinMode(_icpck, OUTPUT);
+  pinMode(_icpda, INPUT);         
+  return i;
+}
+
+/************************************************************************* 
+Description:Switch SPI Mode
+parameter:  void      
+Return:     true:Switch successfully
+            false:Fail to switch
+Others:         
+*************************************************************************/
+bool BMV31K304::switchSPIMode(void)
+{
+  if (false == programEntry(0x02))
+  {
+    return false;
+  }
+  sendAddr(0x0020);
+  sendData(0x0000);
+  sendData(0x0000);
+  sendData(0x0007);
+  sendData(0x0000);    
+
+
+//////////////////////////////
+
+  _spi->begin();
+  pinMode(_sel, OUTPUT);
+  digitalWrite(_sel, HIGH);
+  delay(10);
+  SPIFlashRead0x9F(deviceSFDPBuf,3);
+  deviceIDBuf[1]=deviceSFDPBuf[0];
+  deviceIDBuf[2]=deviceSFDPBuf[1];
+  deviceIDBuf[3]=deviceSFDPBuf[2];
+  defaultFlashInfo(deviceSFDPBuf[2]);
+  readFlashInfo();//a flash without SFDP keeps the defaults
+  return true;
+}
+
+/************************************************************************* 
+Description:Set the flash parameters of common 3-byte SPI NOR
+parameter:  capacity:third byte of the JEDEC ID,log2 of the size
+Return:     void
+Others:     Used until COMSPI and for flashes without SFDP:256-byte
+            pages,4KB(0x20) and 64KB(0xD8) erase,FAST_READ.
+*************************************************************************/
+void BMV31K304::defaultFlashInfo(uint8_t capacity)
+{
+  uint8_t i;
+  _flash.size = ((capacity >= 0x10) && (capacity <= 0x18)) ? (1UL << capacity) : 0;
+  _flash.pageSize = (BMV31K304_FLASH_PAGE_SIZE < 256) ? BMV31K304_FLASH_PAGE_SIZE : 256;
+  _flash.addrBytes = 3;
+  _flash.readOp = FAST_READ;
+  _flash.readDummy = 1;
+  _flash.programOp = PP;
+  for(i = 0; i < BMV31K304_FLASH_ERASE_TYPES; i++)
+  {
+    _flash.eraseOp[i] = 0;
+    _flash.eraseShift[i] = 0;
+    _flash.eraseTimeout[i] = SECTOR_ERASE_TIMEOUT;
+  }
+  _flash.eraseOp[0] = SE;
+  _flash.eraseShift[0] = 12;
+  _flash.eraseOp[1] = BE;
+  _flash.eraseShift[1] = 16;
+  _flash.pageTimeout = PAGE_PROGRAM_TIMEOUT;
+  _flash.chipTimeout = 0;
+  _flash.maxClock = FLASH_CLOCK_MAX_LEGACY;
+  _flash.sfdp = false;
+}
+
+/************************************************************************* 
+Description:Read the flash parameters from its SFDP tables(JESD216)
+parameter:  void
+Return:     true:basic flash parameter table found
+            false:no SFDP,the parameters are not changed
+Others:     Basic table:density,address bytes,page size,erase types and
+            max times(typical x multiplier).The tables have no clock rate
+            for 1-1-1 reads,a flash with SFDP is run at up to 50MHz,the
+            0x0B limit of those parts.Only single line reads are
+            possible on the SPI port,so the read stays 1-1-1 fast read.
+            Above 16MB the flash is addressed with 4 bytes:with the 4-byte
+            instructions(0x0C/0x12/erase) if the 4-byte address table lists
+            them,else in 4-byte mode(0xB7).The mode ends with the power
+            cycle of the module after the update.Without either only the
+            first 16MB are used.
+*************************************************************************/
+bool BMV31K304::readFlashInfo(void)
+{
+  static const uint16_t eraseUnit[4] = {1, 16, 128, 1000};//ms
+  static const uint32_t chipUnit[4] = {16, 256, 4000, 64000};//ms
+  uint8_t header[8], table[64], eraseOp[BMV31K304_FLASH_ERASE_TYPES];
+  uint8_t i, j, n, shift, mult, basicLen = 0, addr4Len = 0;
+  uint32_t basic = 0, addr4 = 0, dw, enter4;
+  uint16_t id;
+  SPIFlashReadSFDP(header, 0, 8);
+  if((header[0] != 'S') || (header[1] != 'F') || (header[2] != 'D') || (header[3] != 'P'))
+  {
+    return false;
+  }
+  n = header[6] + 1;
+  n = (n < SFDP_HEADERS_MAX) ? n : SFDP_HEADERS_MAX;
+  for(i = 0; i < n; i++)
+  {
+    SPIFlashReadSFDP(header, 8 + 8 * i, 8);
+    id = header[0] | ((uint16_t)header[7] << 8);
+    if((SFDP_BASIC_ID == id) && (0 == basicLen))
+    {
+      basic = header[4] | ((uint32_t)header[5] << 8) | ((uint32_t)header[6] << 16);
+      basicLen = (header[3] < 16) ? header[3] : 16;
+    }
+    else if((SFDP_4BAIT_ID == id) && (0 == addr4Len))
+    {
+      addr4 = header[4] | ((uint32_t)header[5] << 8) | ((uint32_t)header[6] << 16);
+      addr4Len = header[3];
+    }
+  }
+  if(basicLen < 9)
+  {
+    return false;
+  }
+  memset(table, 0, sizeof(table));
+  SPIFlashReadSFDP(table, basic, 4 * basicLen);
+  _flash.sfdp = true;
+  _flash.maxClock = FLASH_CLOCK_MAX;
+  //DW2:density in bits
+  dw = SFDP_DWORD(table, 2);
+  if(dw & 0x80000000UL)
+  {
+    dw &= 0x7fffffffUL;
+    _flash.size = ((dw >= 3) && (dw < 35)) ? (1UL << (dw - 3)) : 0;
+  }
+  else
+  {
+    _flash.size = (dw >> 3) + 1;
+  }
+  //DW11:page size,page program and chip erase times
+  if(basicLen >= 11)
+  {
+    dw = SFDP_DWORD(table, 11);
+    mult = 2 * ((dw & 0x0f) + 1);
+    shift = (dw >> 4) & 0x0f;
+    _flash.pageSize = ((1UL << shift) < BMV31K304_FLASH_PAGE_SIZE) ? (1U << shift) : BMV31K304_FLASH_PAGE_SIZE;
+    _flash.pageTimeout = (((dw >> 8) & 0x1f) + 1) * ((dw & 0x2000) ? 64 : 8) * mult / 1000 + 2;
+    _flash.chipTimeout = (((dw >> 24) & 0x1f) + 1) * chipUnit[(dw >> 29) & 0x03] * mult;
+  }
+  else if(0 == (SFDP_DWORD(table, 1) & 0x04))
+  {
+    _flash.pageSize = 1;//write granularity of 1 byte
+  }
+  enter4 = (basicLen >= 16) ? (SFDP_DWORD(table, 16) >> 24) : 0;
+  //DW8/DW9:erase types,DW10:their times
+  mult = 2 * ((SFDP_DWORD(table, 10) & 0x0f) + 1);
+  for(i = 0; i < BMV31K304_FLASH_ERASE_TYPES; i++)
+  {
+    _flash.eraseShift[i] = table[28 + 2 * i];
+    eraseOp[i] = ((_flash.eraseShift[i] >= 12) && (_flash.eraseShift[i] < 32)) ? table[29 + 2 * i] : 0;//below 4KB of no use to the update
+    _flash.eraseTimeout[i] = SECTOR_ERASE_TIMEOUT;
+    if(basicLen >= 10)
+    {
+      dw = (SFDP_DWORD(table, 10) >> (4 + 7 * i)) & 0x7f;
+      _flash.eraseTimeout[i] = ((dw & 0x1f) + 1) * eraseUnit[dw >> 5] * mult + 1;
+    }
+  }
+  //DW1:address bytes
+  dw = (SFDP_DWORD(table, 1) >> 17) & 0x03;
+  if(0x02 == dw)
+  {
+    _flash.addrBytes = 4;//4-byte address only
+  }
+  else if(_flash.size > 0x1000000UL)
+  {
+    memset(table, 0, 8);
+    if(addr4Len >= 2)
+    {
+      SPIFlashReadSFDP(table, addr4, 8);
+    }
+    dw = SFDP_DWORD(table, 1);
+    if((dw & 0x02) && (dw & 0x40))//0x0C fast read and 0x12 page program
+    {
+      _flash.addrBytes = 4;
+      _flash.readOp = FAST_READ4;
+      _flash.programOp = PP4;
+      for(i = 0; i < BMV31K304_FLASH_ERASE_TYPES; i++)
+      {
+        eraseOp[i] = ((dw & (0x200UL << i)) && (table[4 + i] != 0xff)) ? (eraseOp[i] ? table[4 + i] : 0) : 0;
+      }
+    }
+    else if(enter4 & 0x03)
+    {
+      if(enter4 & 0x02)
+      {
+        SPIFlashWriteEnable();
+      }
+      SPIFlashSelect();
+      _spi->transfer(EN4B);
+      SPIFlashDeselect();
+      _flash.addrBytes = 4;
+    }
+    else
+    {
+      _flash.size = 0x1000000UL;//only the 3-byte range
+    }
+  }
+  //erase types from the smallest size up,the unused ones last
+  for(i = 0; i < BMV31K304_FLASH_ERASE_TYPES; i++)
+  {
+    _flash.eraseOp[i] = eraseOp[i];
+    if(0 == eraseOp[i])
+    {
+      _flash.eraseShift[i] = 0;
+      _flash.eraseTimeout[i] = 0;
+    }
+    for(j = i; (j > 0) && ((0 == _flash.eraseOp[j - 1]) || ((_flash.eraseOp[j] != 0) && (_flash.eraseShift[j - 1] > _flash.eraseShift[j]))); j--)
+    {
+      n = _flash.eraseOp[j];
+      _flash.eraseOp[j] = _flash.eraseOp[j - 1];
+      _flash.eraseOp[j - 1] = n;
+      n = _flash.eraseShift[j];
+      _flash.eraseShift[j] = _flash.eraseShift[j - 1];
+      _flash.eraseShift[j - 1] = n;
+      dw = _flash.eraseTimeout[j];
+      _flash.eraseTimeout[j] = _flash.eraseTimeout[j - 1];
+      _flash.eraseTimeout[j - 1] = dw;
+    }
+  }
+  return true;
+}
+
+/************************************************************************* 
+Description:Sends playback control commands
+parameter:  cmd：playback control commands
+            data : 0x00~0x7f is select the voice 0~127 to play if cmd is 0xfa
+            0x00~0x7f is select the voice 128~255 to play if cmd is 0xfb       
+Return:     void      
+Others:     The command is put into the command FIFO and sent by poll().
+            In BMV31K304_CMD_BLOCKING mode it returns after the frame is sent.
+            In BMV31K304_CMD_ASYNC mode a full FIFO drops the command,
+            see getDroppedFrames().
+*************************************************************************/
+void BMV31K304::writeCmd(uint8_t cmd, uint8_t data)
+{
+  uint8_t next;
+  bool absorbed = false;
+#if BMV31K304_CMD_STATS
+  uint32_t callUs = micros();
+#endif
+  if(_cmdCoalesce)
+  {
+    noInterrupts();//poll() may run from a timer interrupt
+    absorbed = coalesceCmd(cmd);
+    interrupts();
+  }
+  if(absorbed)
+  {
+    _cmdSaved++;
+    return;
+  }
+  next = (_cmdHead + 1) % BMV31K304_CMD_QUEUE_SIZE;
+  if(next == _cmdTail)//FIFO full,a frame may have just ended
+  {
+    poll();
+  }
+  while(next == _cmdTail)
+  {
+    if(BMV31K304_CMD_BLOCKING != _cmdMode)
+    {
+      _cmdDropped++;//waiting would block the caller for up to a frame
+      return;
+    }
+    poll();
+    yield();
+  }
+  _cmdQueue[_cmdHead] = cmd | ((uint16_t)data << 8);
+#if BMV31K304_CMD_STATS
+  _statCallUs[_cmdHead] = callUs;
+#endif
+  _cmdHead = next;
+  _cmdSent++;
+  if(BMV31K304_CMD_BLOCKING == _cmdMode)
+  {
+    flush();
+  }
+  else
+  {
+    poll();
+  }
+}
+
+/************************************************************************* 
+Description:Busy line interrupt
+parameter:  void
+Return:     void
+Others:         
+*************************************************************************/
+void BMV31K304::busyISR(void)
+{
+  BMV31K304 *dev = _busyInstance;
+  uint32_t now = micros();
+  uint32_t last;
+  if(NULL == dev)
+  {
+    return;
+  }
+  last = dev->_busyEdgeUs;
+  dev->_busyEdgeUs = now;
+  if((dev->_busyDebounce != 0) && ((uint32_t)(now - last) < dev->_busyDebounce))
+  {
+    return;//bounce,busyCheck() settles the final level
+  }
+  dev->busyEdge(digitalRead(dev->_icpck), now);
+}
+
+/************************************************************************* 
+Description:Latch a busy line level change
+parameter:  level:LOW:playing; HIGH:idle
+            timeUs:micros() of the change
+Return:     void
+Others:         
+*************************************************************************/
+void BMV31K304::busyEdge(uint8_t level, uint32_t timeUs)
+{
+  if(level == _busyLevel)
+  {
+    return;
+  }
+  _busyLevel = level;
+  if(LOW == level)
+  {
+    _busyStartUs = timeUs;
+    _playSent = false;
+#if BMV31K304_CMD_STATS
+    if((_statPending != STATS_NONE) && (0 == (_statFlags & STATS_BUSY)))
+    {
+      _statBusyUs = timeUs;
+      _statFlags |= STATS_BUSY;
+      statBusy();
+    }
+#endif
+    if(_playStartedCallback != NULL)
+    {
+      _playStartedCallback();
+    }
+  }
+  else
+  {
+    _busyEndUs = timeUs;
+    _busyFinished = true;
+    if(_playFinishedCallback != NULL)
+    {
+      _playFinishedCallback();
+    }
+  }
+}
+
+/************************************************************************* 
+Description:Settle the latched busy level after debounced edges
+parameter:  void
+Return:     void
+Others:         
+*************************************************************************/
+void BMV31K304::busyCheck(void)
+{
+  uint8_t level;
+  if((false == _busyTracking) || (0 == _busyDebounce))
+  {
+    return;
+  }
+  noInterrupts();
+  if((uint32_t)(micros() - _busyEdgeUs) >= _busyDebounce)
+  {
+    level = digitalRead(_icpck);
+    if(level != _busyLevel)
+    {
+      busyEdge(level, _busyEdgeUs);
+    }
+  }
+  interrupts();
+}
+
+/************************************************************************* 
+Description:Check that the module decodes commands with a timing
+parameter:  *timing:timing to check
+            voice:voice to play
+Return:     true:every try started and stopped the voice
+Others:     The default timing is restored if the check fails.
+*************************************************************************/
+bool BMV31K304::checkTiming(const BMV31K304Timing *timing, uint8_t voice)
+{
+  uint8_t i;
+  uint32_t start;
+  bool pass = true;
+  setTiming(timing);
+  for(i = 0; (i < CALIBRATE_TRIES) && pass; i++)
+  {
+    playVoice(voice);
+    flush();
+    start = millis();
+    while(false == isPlaying())
+    {
+      if((uint32_t)(millis() - start) >= PLAY_START_TIMEOUT)
+      {
+        pass = false;
+        break;
+      }
+    }
+    playStop();
+    flush();
+    start = millis();
+    while(isPlaying())
+    {
+      if((uint32_t)(millis() - start) >= PLAY_START_TIMEOUT)
+      {
+        pass = false;
+        break;
+      }
+    }
+  }
+  if(false == pass)
+  {
+    setTiming(&defaultTiming);
+    playStop();
+    flush();
+    delay(PLAY_START_TIMEOUT);
+  }
+  return pass;
+}
+
+/************************************************************************* 
+Description:Drop or merge a command that is superseded or has no effect
+parameter:  cmd:same as writeCmd(),the data byte does not matter
+Return:     true:the command needs no frame of its own
+            false:the command must be queued
+Others:     Only queued frames that are not on the line yet are changed.
+            The shadow keeps the device state as of the last queued frame.
+*************************************************************************/
+bool BMV31K304::coalesceCmd(uint8_t cmd)
+{
+  uint8_t first = _cmdTail;
+  uint8_t last, lastCmd;
+  bool absorbed = false;
+  if(_txPhase != 0)
+  {
+    first = (first + 1) % BMV31K304_CMD_QUEUE_SIZE;//frame already on the line
+  }
+  if((cmd >= VOLUME_MIN_CMD) && (cmd <= VOLUME_MAX_CMD))
+  {
+    if(cmd == _shadowVolume)
+    {
+      return true;
+    }
+    _shadowVolume = cmd;
+    if(first != _cmdHead)
+    {
+      last = (_cmdHead + BMV31K304_CMD_QUEUE_SIZE - 1) % BMV31K304_CMD_QUEUE_SIZE;
+      lastCmd = _cmdQueue[last] & 0xff;
+      if((lastCmd >= VOLUME_MIN_CMD) && (lastCmd <= VOLUME_MAX_CMD))
+      {
+        _cmdQueue[last] = cmd | 0xff00;//newer level replaces the queued one
+        return true;
+      }
+    }
+    return false;
+  }
+  switch(cmd)
+  {
+    case LOOP_PLAY:
+      if(1 == _shadowLoop)
+      {
+        return true;
+      }
+      _shadowLoop = 1;
+      return false;
+    case PAUSE_PLAY:
+      if(1 == _shadowPause)
+      {
+        return true;
+      }
+      _shadowPause = 1;
+      return false;
+    case CONTINUE_PLAY:
+      if(0 == _shadowPause)
+      {
+        return true;
+      }
+      _shadowPause = 0;
+      if(first != _cmdHead)
+      {
+        last = (_cmdHead + BMV31K304_CMD_QUEUE_SIZE - 1) % BMV31K304_CMD_QUEUE_SIZE;
+        if(PAUSE_PLAY == (_cmdQueue[last] & 0xff))//pause+continue cancel out
+        {
+          _cmdHead = last;
+          _cmdSaved++;
+          _cmdSent--;
+          return true;
+        }
+      }
+      return false;
+    default:
+      break;
+  }
+  if((cmd >= VOLUME_MIN_CMD) && (cmd != 0xfa) && (cmd != 0xfb) && (cmd != STOP_PLAY))
+  {
+    return false;//unknown command,keep it as it is
+  }
+  //a new voice/sentence or a stop supersedes queued playback control frames
+  while(first != _cmdHead)
+  {
+    last = (_cmdHead + BMV31K304_CMD_QUEUE_SIZE - 1) % BMV31K304_CMD_QUEUE_SIZE;
+    lastCmd = _cmdQueue[last] & 0xff;
+    if((lastCmd >= VOLUME_MIN_CMD) && (lastCmd != 0xfa) && (lastCmd != 0xfb) && (lastCmd != STOP_PLAY)
+      && (lastCmd != LOOP_PLAY) && (lastCmd != PAUSE_PLAY) && (lastCmd != CONTINUE_PLAY))
+    {
+      break;//volume or unknown command
+    }
+    if((STOP_PLAY == cmd) && (STOP_PLAY == lastCmd))
+    {
+      absorbed = true;
+      break;
+    }
+    _cmdHead = last;
+    _cmdSaved++;
+    _cmdSent--;
+  }
+  _shadowLoop = 0;
+  _shadowPause = 0;
+  return absorbed;
+}
+
+/************************************************************************* 
+Description:Forget the shadow of the device state
+parameter:  void
+Return:     void
+Others:     Called whenever the module is powered up or reset.
+*************************************************************************/
+void BMV31K304::clearShadow(void)
+{
+  _shadowVolume = 0xff;
+  _shadowLoop = 0xff;
+  _shadowPause = 0xff;
+}
+
+/************************************************************************* 
+Description:Get one segment of the one-wire command waveform
+parameter:  phase:1:lead-in; 2~19:cmd byte; 20~37:data byte
+            cmd,data:same as writeCmd()
+            *level:line level of the segment
+            *width:segment width in us
+Return:     true:segment valid; false:end of the frame
+Others:     a byte is a low start signal,8 bits LSB first
+            (bit1:long high+short low,bit0:short high+long low)
+            and a high stop signal,widths from _timing
+*************************************************************************/
+bool BMV31K304::cmdSegment(uint8_t phase, uint8_t cmd, uint8_t data, uint8_t *level, uint16_t *width)
+{
+  uint8_t bitIndex;
+  if(1 == phase)
+  {
+    *level = HIGH;
+    *width = _timing.leadIn;
+    return true;
+  }
+  phase -= 2;
+  if(phase >= CMD_BYTE_PHASES)
+  {
+    if(0xff == data)
+    {
+      return false;
+    }
+    phase -= CMD_BYTE_PHASES;
+    if(phase >= CMD_BYTE_PHASES)
+    {
+      return false;
+    }
+    cmd = data;
+  }
+  if(0 == phase)//start signal
+  {
+    *level = LOW;
+    *width = _timing.start;
+  }
+  else if((CMD_BYTE_PHASES - 1) == phase)//stop signal
+  {
+    *level = HIGH;
+    *width = _timing.stop;
+  }
+  else
+  {
+    bitIndex = (phase - 1) >> 1;
+    *level = (phase & 0x01) ? HIGH : LOW;
+    if(((cmd >> bitIndex) & 0x01) == (*level == HIGH))
+    {
+      *width = _timing.longCell;
+    }
+    else
+    {
+      *width = _timing.shortCell;
+    }
+  }
+  return true;
+}
+
+/************************************************************************* 
+Description:Run the command transmitter
+parameter:  void
+Return:     void
+Others:     Call it from loop() or from a periodic timer interrupt
+            (period <= 200us) when BMV31K304_CMD_ASYNC mode is used.
+            A late call stretches the segment on the wire,the next
+            segment then starts from now with its full width.Calls must
+            come less than longCell - shortCell(800us by default) apart,
+            or a stretched short cell reads as the other bit value.
+*************************************************************************/
+void BMV31K304::poll(void)
+{
+  uint8_t level;
+  uint16_t width;
+  uint16_t size;
+  uint32_t elapsed;
+  busyCheck();
+  if(_txLock)
+  {
+    return;
+  }
+  _txLock = 1;
+  while(1)
+  {
+    if(CMD_WAVE_PHASE == _txPhase)
+    {
+      if(_waveOut->isBusy())
+      {
+        break;
+      }
+#if BMV31K304_CMD_STATS
+      statFrame(_txCmd, _cmdTail, micros());
+#endif
+      frameSent(_txCmd, micros());
+      _cmdTail = (_cmdTail + 1) % BMV31K304_CMD_QUEUE_SIZE;
+      _txPhase = 0;
+    }
+    if(0 == _txPhase)
+    {
+      if(_cmdHead == _cmdTail)
+      {
+        break;
+      }
+      _txCmd = _cmdQueue[_cmdTail] & 0xff;
+      _txData = _cmdQueue[_cmdTail] >> 8;
+      _txStamp = micros();
+      _txWidth = 0;
+      _txPhase = 1;
+#if BMV31K304_CMD_STATS
+      statStart(_txCmd, _cmdTail, _txStamp);
+#endif
+      if(_waveOut != NULL)
+      {
+        if(_waveOut->isBusy())
+        {
+          _txPhase = 0;
+          break;
+        }
+        uint8_t *buf = _waveOut->buffer(&size);
+        size = encodeWave(_txCmd, _txData, _waveOut->sampleRate(), buf, size);
+        if((size != 0) && _waveOut->write(size))
+        {
+          _txPhase = CMD_WAVE_PHASE;
+          continue;
+        }
+        //the frame does not fit the peripheral,bit-bang it
+      }
+      if(_txIdleValid && ((uint32_t)(_txStamp - _txIdleSince) >= _timing.leadIn))
+      {
+        _txPhase = 2;//the line has been idle for the lead-in already
+      }
+    }
+    elapsed = micros() - _txStamp;
+    if(elapsed < _txWidth)
+    {
+      break;
+    }
+    if(elapsed - _txWidth > CMD_LATE_US)
+    {
+      _txStamp += elapsed;//too late to catch up:cells must not shrink
+    }
+    else
+    {
+      _txStamp += _txWidth;
+    }
+    if(cmdSegment(_txPhase, _txCmd, _txData, &level, &width))
+    {
+      if(_txPhase != 1)//the line keeps high during the lead-in
+      {
+        writeData(level);
+      }
+      _txWidth = width;
+      _txPhase++;
+    }
+    else
+    {
+#if BMV31K304_CMD_STATS
+      statFrame(_txCmd, _cmdTail, _txStamp);
+#endif
+      frameSent(_txCmd, _txStamp);
+      _cmdTail = (_cmdTail + 1) % BMV31K304_CMD_QUEUE_SIZE;
+      _txPhase = 0;
+      _txIdleSince = _txStamp;
+      _txIdleValid = true;
+      if((_cmdHead != _cmdTail) && (NULL == _waveOut))//back-to-back frame starts right after the stop signal
+      {
+        _txCmd = _cmdQueue[_cmdTail] & 0xff;
+        _txData = _cmdQueue[_cmdTail] >> 8;
+        _txWidth = 0;
+        _txPhase = 1;
+#if BMV31K304_CMD_STATS
+        statStart(_txCmd, _cmdTail, _txStamp);
+#endif
+      }
+    }
+  }
+  _txLock = 0;
+}
+
+/************************************************************************* 
+Description:Encode a command frame into one-wire waveform samples
+parameter:  cmd,data:same as writeCmd()
+            sampleRate:samples per second of the waveform peripheral
+            *buf:sample buffer,1 bit per sample,MSB first
+            size:size of buf in bytes
+Return:     number of bytes used,0:the frame does not fit buf
+Others:     The frame is built from cmdSegment(),so it matches the
+            bit-banged timing to one sample period.
+*************************************************************************/
+uint16_t BMV31K304::encodeWave(uint8_t cmd, uint8_t data, uint32_t sampleRate, uint8_t *buf, uint16_t size)
+{
+  uint8_t phase, level, fill;
+  uint16_t width;
+  uint32_t timeUs = 0;
+  uint32_t sample = 0;
+  uint32_t end;
+  for(phase = 1; cmdSegment(phase, cmd, data, &level, &width); phase++)
+  {
+    timeUs += width;
+    end = (uint32_t)(((uint64_t)timeUs * sampleRate + 500000) / 1000000);
+    if(((end + 7) >> 3) > size)
+    {
+      return 0;
+    }
+    fill = level ? 0xff : 0x00;
+    while((sample < end) && (sample & 0x07))
+    {
+      buf[sample >> 3] = (buf[sample >> 3] & ~(0x80 >> (sample & 0x07))) | (fill & (0x80 >> (sample & 0x07)));
+      sample++;
+    }
+    while((end - sample) >= 8)
+    {
+      buf[sample >> 3] = fill;
+      sample += 8;
+    }
+    while(sample < end)
+    {
+      buf[sample >> 3] = (buf[sample >> 3] & ~(0x80 >> (sample & 0x07))) | (fill & (0x80 >> (sample & 0x07)));
+      sample++;
+    }
+  }
+  while(sample & 0x07)//pad with the idle(high) level
+  {
+    buf[sample >> 3] |= 0x80 >> (sample & 0x07);
+    sample++;
+  }
+  return sample >> 3;
+}
+
+/************************************************************************* 
+Description:Note a frame that has left the line
+parameter:  cmd:command byte of the frame
+            endUs:micros() at its end
+Return:     void
+Others:     waitIdle() waits for the busy start after a voice,sentence
+            or continue;a stop or pause cancels that.
+*************************************************************************/
+void BMV31K304::frameSent(uint8_t cmd, uint32_t endUs)
+{
+  if((0xfa == cmd) || (0xfb == cmd) || (cmd < VOLUME_MIN_CMD) || (CONTINUE_PLAY == cmd))
+  {
+    _playSentUs = endUs;
+    _playSent = true;
+  }
+  else if((STOP_PLAY == cmd) || (PAUSE_PLAY == cmd))
+  {
+    _playSent = false;
+  }
+}
+
+/************************************************************************* 
+Description:Check that the longest frame fits the waveform buffer
+parameter:  void
+Return:     true:every frame can be sent by _waveOut
+Others:     Frames of one timing differ only in their byte count.
+*************************************************************************/
+bool BMV31K304::waveFits(void)
+{
+  uint16_t size;
+  uint8_t *buf = _waveOut->buffer(&size);
+  return 0 != encodeWave(0xfa, 0x00, _waveOut->sampleRate(), buf, size);
+}
+
+/************************************************************************* 
+Description:Get the command transmitter status
+parameter:  void
+Return:     true:FIFO empty and no frame on the line; false:busy
+Others:         
+*************************************************************************/
+bool BMV31K304::isIdle(void)
+{
+  if((_cmdHead == _cmdTail) && (0 == _txPhase))
+  {
+    return true;
+  }
+  else
+  {
+    return false;
+  }
+}
+
+/************************************************************************* 
+Description:Wait until all queued commands have been sent
+parameter:  void
+Return:     void
+Others:         
+*************************************************************************/
+void BMV31K304::flush(void)
+{
+  while(false == isIdle())
+  {
+    poll();
+    yield();//a DMA transfer of the waveform runs meanwhile
+  }
+}
+
+/************************************************************************* 
+Description:Enter update mode
+parameter:  mode:set mode     
+Return:     true:Enter mode successfully
+            false:Failed to enter mode
+Others:         
+*************************************************************************/
+bool BMV31K304::programEntry(uint16_t mode)
+{
+  static uint8_t retransmissionTimes = 0;
+	
+  digitalWrite(_power, LOW);
+  //pinMode(STATUS_PIN, OUTPUT);
+  //digitalWrite(STATUS_PIN, LOW);
+  pinMode(_data, OUTPUT);
+  digitalWrite(_data, LOW);
+  pinMode(_sel, OUTPUT);
+  digitalWrite(_sel, LOW);
+  pinMode(_icpck, OUTPUT);
+  digitalWrite(_icpck, LOW);
+  pinMode(_icpda, OUTPUT);
+  digitalWrite(_icpda, LOW);
+    
+  delay(10);
+  //pinMode(STATUS_PIN, OUTPUT);
+  //digitalWrite(STATUS_PIN, LOW);
+  pinMode(_icpck, OUTPUT);
+  digitalWrite(_icpck, LOW);
+  pinMode(_icpda, OUTPUT);
+  digitalWrite(_icpda, LOW);
+  delay(5);
   digitalWrite(_icpck, LOW);
   // pinMode(STATUS_PIN, INPUT);
   delay(1);
@@ -887,513 +2341,1525 @@ bool BMV31K304::programEntry(uint16_t mode)
     digitalWrite(_icpck, LOW);
     delayMicroseconds(160);//tready:150us~
 
-    /*MATCH*/
-    digitalWrite(_icpck, HIGH);
-    delayMicroseconds(84);//tmatch:60us~
-    /*Match Pattern and set mode:0100 1010 1xxx*/
-    matchPattern(mode);
-    retransmissionTimes++;
-    if(5 == retransmissionTimes)
+    /*MATCH*/
+    digitalWrite(_icpck, HIGH);
+    delayMicroseconds(84);//tmatch:60us~
+    /*Match Pattern and set mode:0100 1010 1xxx*/
+    matchPattern(mode);
+    retransmissionTimes++;
+    if(5 == retransmissionTimes)
+    {
+      retransmissionTimes = 0;
+      return false;
+    }
+  }while(mode != ack());
+  dummyClocks();
+  retransmissionTimes = 0;
+  return true;
+}
+
+/************************************************************************* 
+Description:Set the one-wire and ICP pins
+parameter:  dataPin,icpckPin,icpdaPin:MOSI/SCK/MISO of the SPI port
+Return:     void    
+Others:     Used by BMV31K304T,the constructor picks them from spiClass.
+*************************************************************************/
+void BMV31K304::setPins(uint8_t dataPin, uint8_t icpckPin, uint8_t icpdaPin)
+{
+  _data = dataPin;
+  _icpck = icpckPin;
+  _icpda = icpdaPin;
+  _dataOut.attach(_data);
+  _icp.ck.attach(_icpck);
+  _icp.da.attach(_icpda);
+}
+
+/************************************************************************* 
+Description:Drive the one-wire DATA line
+parameter:  level:HIGH or LOW
+Return:     void    
+Others:     Atomic against interrupts:poll() may drive DATA from a timer
+            interrupt.
+*************************************************************************/
+void BMV31K304::writeData(uint8_t level)
+{
+  _dataOut.writeAtomic(level);
+}
+
+/************************************************************************* 
+Description:Drive the chip select of the voice flash
+parameter:  level:HIGH or LOW
+Return:     void    
+Others:         
+*************************************************************************/
+void BMV31K304::writeSel(uint8_t level)
+{
+  _selOut.write(level);
+}
+
+/************************************************************************* 
+Description:ack of mode
+parameter:  void       
+Return:     mode data
+Others:         
+*************************************************************************/
+uint16_t BMV31K304::ack(void)
+{
+  return _icp.ack();
+}
+
+/************************************************************************* 
+Description:Send the dummy Clocks
+parameter:  void       
+Return:     void    
+Others:         
+*************************************************************************/
+void BMV31K304::dummyClocks(void)
+{
+  _icp.dummyClocks();
+}
+
+/************************************************************************* 
+Description:Pattern(mode) matching
+parameter:  mode:0x02       
+Return:     void       
+Others:         
+*************************************************************************/
+void BMV31K304::matchPattern(uint16_t mode)
+{
+  _icp.matchPattern(mode);
+}
+
+/************************************************************************* 
+Description:Send the address
+parameter:  addr;send addr       
+Return:     void    
+Others:         
+*************************************************************************/
+void BMV31K304::sendAddr(uint16_t addr)
+{
+  _icp.sendAddr(addr);
+}
+
+/************************************************************************* 
+Description:Send the data
+parameter:  data:Data sent to the BMV31K304 at a fixed address
+Return:     void    
+Others:         
+*************************************************************************/
+void BMV31K304::sendData(uint16_t data)
+{
+  _icp.sendData(data);
+}
+
+/************************************************************************* 
+Description:Read the data
+parameter:  void
+Return:     data:Data  
+Others:         
+*************************************************************************/
+uint16_t BMV31K304::readData(void)
+{
+  return _icp.readData();
+}
+
+/************************************************************************* 
+Description:Data check
+parameter:  *ptr:The array to check
+            len:Length of data to be check       
+Return:     1:correct
+            0:error
+Others:         
+*************************************************************************/
+uint8_t BMV31K304::checkCRC8(uint8_t *ptr, uint8_t len) 
+{
+  uint8_t  crc = 0x00;
+
+  while (len--)
+  {
+    crc = crc_table[crc ^ *ptr++];
+  }
+  return (crc);
+}
+
+/************************************************************************* 
+Description:Receive audio data update from upper computer into BMV31K304
+parameter:  void       
+Return:     void
+Others:     rxBuffer points to the checked 55 23 frame,the data goes to the
+            page buffer straight from there.
+*************************************************************************/
+void BMV31K304::recAudioData(void)
+{
+  if(_pageError)
+  {
+    SerialUSB.write(0xe3);//NACK:an earlier page failed to program
+  }
+  else
+  {
+    SerialUSB.write(0x3e);//ACK before the flash work,the host sends on meanwhile
+    pageAppend(rxBuffer + 3, rxBuffer[2]);
+  }
+}
+
+/************************************************************************* 
+Description:Receive a v2 data frame
+parameter:  void       
+Return:     void
+Others:     5A 23 LEN(2) OFFSET(4) data CRC32(4),little endian,the CRC32
+            covers LEN,OFFSET and data.
+            5C 23 LEN(2) OFFSET(4) RAWLEN(2) data CRC32(4) is the compressed
+            form,the CRC32 also covers RAWLEN;see unpackFrame().
+            rxBuffer points to the checked frame,the data goes to the page
+            buffer(or the decoder) straight from there.
+*************************************************************************/
+void BMV31K304::recAudioFrame(void)
+{
+  uint16_t len;
+  uint32_t offset;
+  bool packed = (0x5C == rxBuffer[0]);
+  const uint8_t *data = rxBuffer + (packed ? 10 : 8);
+  len = rxBuffer[2] | ((uint16_t)rxBuffer[3] << 8);
+  offset = rxBuffer[4] | ((uint32_t)rxBuffer[5] << 8) | ((uint32_t)rxBuffer[6] << 16) | ((uint32_t)rxBuffer[7] << 24);
+  if(_pageError)
+  {
+    SerialUSB.write(0xe3);//NACK:an earlier page failed to program
+    return;
+  }
+#if BMV31K304_UNPACK_SIZE > 0
+  if(packed)
+  {
+    uint16_t rawLen = rxBuffer[8] | ((uint16_t)rxBuffer[9] << 8);
+    if(false == unpackFrame(data, len, rawLen))
+    {
+      SerialUSB.write(0xe3);//NACK,corrupt or too large for _unpackBuffer
+      return;
+    }
+    data = _unpackBuffer;
+    len = rawLen;
+  }
+#endif
+  SerialUSB.write(0x3e);//ACK
+  if(offset != _flashAddr)
+  {
+    pageFlush();
+    _flashAddr = offset;
+  }
+  pageAppend(data, len);
+}
+
+#if BMV31K304_UNPACK_SIZE > 0
+/************************************************************************* 
+Description:Decode a compressed v2 frame into _unpackBuffer
+parameter:  *pBuffer,len:compressed data
+            rawLen:decoded bytes announced by the host
+Return:     true:decoded exactly rawLen bytes
+Others:     Byte oriented LZ77,every frame decodes on its own:
+            0x00~0x7F:n+1 literal bytes follow
+            0x80~0xFF:copy (n&0x7F)+3 bytes from DIST(2) bytes back in
+                      the decoded frame,DIST 1 repeats the last byte
+*************************************************************************/
+bool BMV31K304::unpackFrame(const uint8_t *pBuffer, uint16_t len, uint16_t rawLen)
+{
+  uint16_t out = 0, n, dist;
+  uint8_t token;
+  if(rawLen > BMV31K304_UNPACK_SIZE)
+  {
+    return false;
+  }
+  while(len > 0)
+  {
+    token = *pBuffer++;
+    len--;
+    if(token < 0x80)
+    {
+      n = token + 1;
+      if((n > len) || (n > rawLen - out))
+      {
+        return false;
+      }
+      memcpy(_unpackBuffer + out, pBuffer, n);
+      pBuffer += n;
+      len -= n;
+      out += n;
+    }
+    else
+    {
+      n = (token & 0x7f) + 3;
+      if(len < 2)
+      {
+        return false;
+      }
+      dist = pBuffer[0] | ((uint16_t)pBuffer[1] << 8);
+      pBuffer += 2;
+      len -= 2;
+      if((0 == dist) || (dist > out) || (n > rawLen - out))
+      {
+        return false;
+      }
+      for(dist = out - dist; n > 0; n--)
+      {
+        _unpackBuffer[out++] = _unpackBuffer[dist++];
+      }
+    }
+  }
+  return out == rawLen;
+}
+#endif
+
+/************************************************************************* 
+Description:Answer COMV2 and switch to v2 data frames
+parameter:  void
+Return:     void
+Others:     reply:3E version maxLen(2) capabilities,little endian
+*************************************************************************/
+void BMV31K304::sendCapability(void)
+{
+  uint8_t reply[5];
+  _updateV2 = true;
+  reply[0] = 0x3e;//ACK
+  reply[1] = UPDATE_VERSION;
+  reply[2] = BMV31K304_FRAME_SIZE_MAX & 0xff;
+  reply[3] = BMV31K304_FRAME_SIZE_MAX >> 8;
+  reply[4] = UPDATE_CAPABILITY;
+  SerialUSB.write(reply, 5);
+}
+
+/************************************************************************* 
+Description:Answer COMST with the counters of the session
+parameter:  void
+Return:     void
+Others:     reply:3E and the fields of BMV31K304UpdateStats in their order,
+            4 bytes each,little endian.A new field must be listed here too.
+            The host derives the progress and the time left from dataBytes
+            and bytesPerSec.
+*************************************************************************/
+void BMV31K304::sendUpdateStats(void)
+{
+  BMV31K304UpdateStats stats;
+  uint32_t field[UPDATE_STATS_FIELDS];
+  uint8_t reply[1 + 4 * UPDATE_STATS_FIELDS];
+  uint8_t i, j;
+  getUpdateStats(&stats);
+  field[0] = stats.rxBytes;//ST_xxx order of upload.cpp
+  field[1] = stats.dataBytes;
+  field[2] = stats.frames;
+  field[3] = stats.crcNacks;
+  field[4] = stats.resyncBytes;
+  field[5] = stats.pagePrograms;
+  field[6] = stats.eraseMs;
+  field[7] = stats.programUs;
+  field[8] = stats.waitUs;
+  field[9] = stats.idleUs;
+  field[10] = stats.elapsedMs;
+  field[11] = stats.bytesPerSec;
+  reply[0] = 0x3e;//ACK
+  for(i = 0; i < UPDATE_STATS_FIELDS; i++)
+  {
+    for(j = 0; j < 4; j++)
+    {
+      reply[1 + 4 * i + j] = (field[i] >> (8 * j)) & 0xff;
+    }
+  }
+  SerialUSB.write(reply, sizeof(reply));
+}
+
+/************************************************************************* 
+Description:Handle the control frames of the v2 update protocol
+parameter:  len:payload length
+Return:     true:handled; false:not a v2 control frame
+Others:     COMHS first(2) count(2):ACK,then the CRC32 of each 4KB sector
+            COMSE first(2) count(2):erase the sectors,then ACK(eraseDone())
+            Sector and byte ranges beyond the flash are NACKed.
+            COMRD addr(4) len(4):ACK,the flash bytes,then their CRC32
+            COMCR addr(4) len(4):ACK,then the CRC32 of the flash range
+            COMFL addr(4) len(4) value:program the range with value,then ACK
+            COMLZ:ACK,then the largest decoded size of a 5C 23 frame(2)
+            COMCP id(4) addr(4):program what was received,then journal
+                   that the image id is complete below addr,or below the
+                   end of the received data when that is lower;ACK
+            COMJQ:ACK,then the journal id(4) addr(4)
+            COMST:ACK,then the session counters,see sendUpdateStats()
+            COMRS addr(4):continue v1 data frames at addr;ACK,NACK when
+                   addr lies beyond the flash or is not page aligned
+*************************************************************************/
+bool BMV31K304::recControlV2(uint8_t len)
+{
+  uint32_t addr, size, crc;
+  uint16_t first, count;
+  uint8_t reply[9];
+  if((false == _updateV2) || (len < 5) || (rxBuffer[3] != 'C') || (rxBuffer[4] != 'O') || (rxBuffer[5] != 'M'))
+  {
+    return false;
+  }
+  if((5 == len) && (UPDATE_CAPABILITY & UPDATE_CAP_PACKED) && (rxBuffer[6] == 'L') && (rxBuffer[7] == 'Z'))
+  {
+    reply[0] = 0x3e;//ACK
+    reply[1] = BMV31K304_UNPACK_SIZE & 0xff;
+    reply[2] = BMV31K304_UNPACK_SIZE >> 8;
+    SerialUSB.write(reply, 3);
+    return true;
+  }
+  if((5 == len) && (rxBuffer[6] == 'S') && (rxBuffer[7] == 'T'))
+  {
+    sendUpdateStats();
+    return true;
+  }
+  if((5 == len) && (rxBuffer[6] == 'J') && (rxBuffer[7] == 'Q'))
+  {
+    reply[0] = 0x3e;//ACK
+    for(count = 0; count < 4; count++)
+    {
+      reply[1 + count] = (_journalId >> (8 * count)) & 0xff;
+      reply[5 + count] = (_journalAddr >> (8 * count)) & 0xff;
+    }
+    SerialUSB.write(reply, 9);
+    return true;
+  }
+  if((9 == len) && (rxBuffer[6] == 'R') && (rxBuffer[7] == 'S'))
+  {
+    addr = rxBuffer[8] | ((uint32_t)rxBuffer[9] << 8) | ((uint32_t)rxBuffer[10] << 16) | ((uint32_t)rxBuffer[11] << 24);
+    if((false == flashRangeValid(addr, 0)) || (0 == _flash.pageSize) || (0 != addr % _flash.pageSize))
+    {
+      SerialUSB.write(0xe3);//NACK,beyond the flash or inside a page
+      return true;
+    }
+    pageFlush();
+    _flashAddr = addr;
+    SerialUSB.write(0x3e);//ACK
+    return true;
+  }
+  if(9 == len)
+  {
+    first = rxBuffer[8] | ((uint16_t)rxBuffer[9] << 8);
+    count = rxBuffer[10] | ((uint16_t)rxBuffer[11] << 8);
+    if(((rxBuffer[6] == 'H') && (rxBuffer[7] == 'S')) || ((rxBuffer[6] == 'S') && (rxBuffer[7] == 'E')))
+    {
+      if(false == flashRangeValid((uint32_t)first * BMV31K304_FLASH_SECTOR_SIZE, (uint32_t)count * BMV31K304_FLASH_SECTOR_SIZE))
+      {
+        SerialUSB.write(0xe3);//NACK,sectors beyond the flash
+        return true;
+      }
+    }
+    if((rxBuffer[6] == 'H') && (rxBuffer[7] == 'S'))
+    {
+      SerialUSB.write(0x3e);//ACK
+      sendSectorHash(first, count);
+      return true;
+    }
+    if((rxBuffer[6] == 'S') && (rxBuffer[7] == 'E'))
+    {
+      if(false == eraseSectors(first, count))
+      {
+        SerialUSB.write(0xe3);//NACK,no erase type fits the range
+      }
+      return true;
+    }
+  }
+  else if(13 == len)
+  {
+    addr = rxBuffer[8] | ((uint32_t)rxBuffer[9] << 8) | ((uint32_t)rxBuffer[10] << 16) | ((uint32_t)rxBuffer[11] << 24);
+    size = rxBuffer[12] | ((uint32_t)rxBuffer[13] << 8) | ((uint32_t)rxBuffer[14] << 16) | ((uint32_t)rxBuffer[15] << 24);
+    if(((rxBuffer[6] == 'R') && (rxBuffer[7] == 'D')) || ((rxBuffer[6] == 'C') && (rxBuffer[7] == 'R')))
+    {
+      if(false == flashRangeValid(addr, size))
+      {
+        SerialUSB.write(0xe3);//NACK,range beyond the flash
+        return true;
+      }
+      pageFlush();
+      flashWait();
+      SerialUSB.write(0x3e);//ACK
+      crc = readFlashRange(addr, size, rxBuffer[6] == 'R');
+      reply[0] = crc & 0xff;
+      reply[1] = (crc >> 8) & 0xff;
+      reply[2] = (crc >> 16) & 0xff;
+      reply[3] = crc >> 24;
+      SerialUSB.write(reply, 4);
+      return true;
+    }
+    if((rxBuffer[6] == 'C') && (rxBuffer[7] == 'P'))
+    {
+      pageFlush();
+      flashWait();
+      if(false == _pageError)
+      {
+        _journalId = addr;
+        _journalAddr = (size < _flashAddr) ? size : _flashAddr;//never beyond the programmed data
+      }
+      SerialUSB.write(_pageError ? 0xe3 : 0x3e);
+      return true;
+    }
+  }
+  else if((14 == len) && (rxBuffer[6] == 'F') && (rxBuffer[7] == 'L'))
+  {
+    addr = rxBuffer[8] | ((uint32_t)rxBuffer[9] << 8) | ((uint32_t)rxBuffer[10] << 16) | ((uint32_t)rxBuffer[11] << 24);
+    size = rxBuffer[12] | ((uint32_t)rxBuffer[13] << 8) | ((uint32_t)rxBuffer[14] << 16) | ((uint32_t)rxBuffer[15] << 24);
+    if(false == flashRangeValid(addr, size))
+    {
+      SerialUSB.write(0xe3);//NACK,range beyond the flash
+      return true;
+    }
+    fillFlashRange(addr, size, rxBuffer[16]);
+    SerialUSB.write(_pageError ? 0xe3 : 0x3e);
+    return true;
+  }
+  return false;
+}
+
+/************************************************************************* 
+Description:Send the CRC32 of flash sectors
+parameter:  first:first 4KB sector
+            count:sectors
+Return:     void
+Others:     4 bytes per sector,little endian.The host compares them with
+            its image and only sends the sectors that differ.
+*************************************************************************/
+void BMV31K304::sendSectorHash(uint16_t first, uint16_t count)
+{
+  uint32_t addr, crc;
+  uint8_t reply[4];
+  pageFlush();
+  flashWait();
+  addr = (uint32_t)first * BMV31K304_FLASH_SECTOR_SIZE;
+  while(count--)
+  {
+    crc = readFlashRange(addr, BMV31K304_FLASH_SECTOR_SIZE, false);
+    addr += BMV31K304_FLASH_SECTOR_SIZE;
+    reply[0] = crc & 0xff;
+    reply[1] = (crc >> 8) & 0xff;
+    reply[2] = (crc >> 16) & 0xff;
+    reply[3] = crc >> 24;
+    SerialUSB.write(reply, 4);
+  }
+}
+
+/************************************************************************* 
+Description:Check a flash range sent by the host
+parameter:  addr:first byte
+            size:bytes
+Return:     true:the range lies inside the detected flash
+Others:     Also false while the flash size is unknown.
+*************************************************************************/
+bool BMV31K304::flashRangeValid(uint32_t addr, uint32_t size)
+{
+  return (size <= _flash.size) && (addr <= _flash.size - size);
+}
+
+/************************************************************************* 
+Description:Read a flash range in frame sized blocks
+parameter:  addr:first byte
+            size:bytes
+            send:true:also send the bytes to SerialUSB
+Return:     CRC32 of the range
+Others:     
+*************************************************************************/
+uint32_t BMV31K304::readFlashRange(uint32_t addr, uint32_t size, bool send)
+{
+  uint32_t crc = 0;
+  uint16_t n;
+  while(size > 0)
+  {
+    n = (size < BMV31K304_FRAME_SIZE_MAX) ? size : BMV31K304_FRAME_SIZE_MAX;
+    SPIFlashRead(_frameBuffer, addr, n);
+    crc = checkCRC32(crc, _frameBuffer, n);
+    if(send)
+    {
+      SerialUSB.write(_frameBuffer, n);
+    }
+    addr += n;
+    size -= n;
+  }
+  return crc;
+}
+
+/************************************************************************* 
+Description:Program a flash range with one byte value
+parameter:  addr:first byte
+            size:bytes
+            value:byte value
+Return:     void
+Others:     Goes through the page buffer like received data,so 0xFF costs
+            no page program in a range erased during the session.
+*************************************************************************/
+void BMV31K304::fillFlashRange(uint32_t addr, uint32_t size, uint8_t value)
+{
+  uint16_t n;
+  pageFlush();
+  _flashAddr = addr;
+  memset(_frameBuffer, value, BMV31K304_FRAME_SIZE_MAX);
+  while((size > 0) && (false == _pageError))
+  {
+    n = (size < BMV31K304_FRAME_SIZE_MAX) ? size : BMV31K304_FRAME_SIZE_MAX;
+    pageAppend(_frameBuffer, n);
+    size -= n;
+  }
+  pageFlush();
+  flashWait();
+}
+
+/************************************************************************* 
+Description:Start erasing flash sectors
+parameter:  first:first 4KB sector
+            count:sectors
+Return:     true:started,eraseDone() sends the ACK/NACK at the end
+            false:the smallest erase type is larger than the range
+Others:     
+*************************************************************************/
+bool BMV31K304::eraseSectors(uint16_t first, uint16_t count)
+{
+  pageFlush();
+  flashWait();
+  _journalId = 0;
+  _journalAddr = 0;
+  _eraseAddr = (uint32_t)first * BMV31K304_FLASH_SECTOR_SIZE;
+  _eraseEnd = _eraseAddr + (uint32_t)count * BMV31K304_FLASH_SECTOR_SIZE;
+  _eraseStart = _eraseAddr;
+  if(_eraseAddr == _eraseEnd)
+  {
+    SerialUSB.write(0x3e);//ACK,nothing to erase
+    return true;
+  }
+  return eraseNext();
+}
+
+/************************************************************************* 
+Description:Start the next erase of the COMSE range
+parameter:  void
+Return:     true:started; false:no erase type fits
+Others:     Each step uses the largest erase type of the flash that is
+            aligned and fits in the rest of the range(e.g. 64KB,32KB,4KB).
+*************************************************************************/
+bool BMV31K304::eraseNext(void)
+{
+  uint32_t size = 0;
+  uint8_t i;
+  for(i = BMV31K304_FLASH_ERASE_TYPES; i > 0; i--)
+  {
+    size = 1UL << _flash.eraseShift[i - 1];
+    if((_flash.eraseOp[i - 1] != 0) && (0 == (_eraseAddr & (size - 1))) && (_eraseEnd - _eraseAddr >= size))
     {
-      retransmissionTimes = 0;
-      return false;
+      break;
     }
-  }while(mode != ack());
-  dummyClocks();
-  retransmissionTimes = 0;
+  }
+  if(0 == i)
+  {
+    return false;
+  }
+  SPIFlashErase(i - 1, _eraseAddr);
+  _eraseAddr += size;
   return true;
 }
 
 /************************************************************************* 
-Description:ack of mode
-parameter:  void       
-Return:     mode data
-Others:         
+Description:End of an erase of the COMSE range
+parameter:  ok:false:the flash was still busy after the erase timeout
+Return:     void
+Others:     Completion callback of flashPoll().
+*************************************************************************/
+void BMV31K304::eraseDone(bool ok)
+{
+  if(ok && (_eraseAddr < _eraseEnd))
+  {
+    ok = eraseNext();
+    if(ok)
+    {
+      return;
+    }
+  }
+  if(ok)
+  {
+    erasedAdd(_eraseStart, _eraseEnd);
+  }
+  SerialUSB.write(ok ? 0x3e : 0xe3);
+}
+
+/************************************************************************* 
+Description:End of the chip erase of COMCE
+parameter:  ok:false:the flash was still busy after the erase timeout
+Return:     void
+Others:     Completion callback of flashPoll().
+*************************************************************************/
+void BMV31K304::chipEraseDone(bool ok)
+{
+  if(ok)
+  {
+    erasedAdd(0, 0xffffffffUL);
+  }
+  SerialUSB.write(ok ? 0x3e : 0xe3);
+}
+
+/************************************************************************* 
+Description:End of a page program
+parameter:  ok:false:the flash was still busy after the program timeout
+Return:     void
+Others:     Completion callback of flashPoll().The failure is answered on
+            a later frame.
+*************************************************************************/
+void BMV31K304::pageDone(bool ok)
+{
+  if(false == ok)
+  {
+    _pageError = true;
+  }
+}
+
+/************************************************************************* 
+Description:Track a flash operation that was just started
+parameter:  op:FLASH_OP_PROGRAM or FLASH_OP_ERASE
+            timeout:ms,0:no limit
+            done:called by flashPoll() when the flash is ready again
+Return:     void
+Others:     
+*************************************************************************/
+void BMV31K304::flashStart(uint8_t op, uint32_t timeout, void (BMV31K304::*done)(bool ok))
+{
+  _flashOp = op;
+  _flashDone = done;
+  _flashStart = millis();
+  _flashTimeout = timeout;
+  _flashStartUs = micros();
+  _flashPollStamp = _flashStartUs;
+  _flashPollDelay = FLASH_POLL_MIN;
+}
+
+/************************************************************************* 
+Description:Check the flash operation in flight
+parameter:  now:read the status even if the poll interval still runs
+Return:     true:an operation is still in flight
+Others:     Returns at once while the poll interval runs.The interval
+            grows with the time the operation has taken(1/8 of it,from
+            FLASH_POLL_MIN to FLASH_POLL_MAX),so the end of a page program
+            is seen within 50us and a chip erase of seconds costs a read
+            every 2ms.At the end(or timeout) the completion callback is
+            called,it may start the next operation.
+*************************************************************************/
+bool BMV31K304::flashPoll(bool now)
+{
+  uint8_t status;
+  if(FLASH_OP_IDLE == _flashOp)
+  {
+    return false;
+  }
+  if((false == now) && ((uint32_t)(micros() - _flashPollStamp) < _flashPollDelay))
+  {
+    return true;
+  }
+  status = SPIFlashReadStatus();
+  _flashPollStamp = micros();
+  if((status & WIP_FLAG) && ((0 == _flashTimeout) || ((uint32_t)(millis() - _flashStart) < _flashTimeout)))
+  {
+    _flashPollDelay = (uint32_t)(_flashPollStamp - _flashStartUs) >> FLASH_POLL_SHIFT;
+    _flashPollDelay = (_flashPollDelay < FLASH_POLL_MIN) ? FLASH_POLL_MIN : ((_flashPollDelay > FLASH_POLL_MAX) ? FLASH_POLL_MAX : _flashPollDelay);
+    return true;
+  }
+  if(FLASH_OP_PROGRAM == _flashOp)
+  {
+    _updateStats.programUs += _flashPollStamp - _flashStartUs;
+  }
+  else
+  {
+    _updateStats.eraseMs += millis() - _flashStart;
+  }
+  _flashOp = FLASH_OP_IDLE;
+  (this->*_flashDone)(0 == (status & WIP_FLAG));
+  return (_flashOp != FLASH_OP_IDLE);
+}
+
+/************************************************************************* 
+Description:Wait until no flash operation is in flight
+parameter:  void
+Return:     void
+Others:     Also finishes a COMSE range that was started.Nothing else
+            runs meanwhile,so the status is read without the interval.
+*************************************************************************/
+void BMV31K304::flashWait(void)
+{
+  uint32_t start;
+  if(FLASH_OP_IDLE == _flashOp)
+  {
+    return;
+  }
+  start = micros();
+  while(flashPoll(true))
+  {
+    yield();
+  }
+  _updateStats.waitUs += micros() - start;
+}
+
+/************************************************************************* 
+Description:CRC32(IEEE 802.3,reflected 0xEDB88320)
+parameter:  crc:0 to start,or the result of the previous block
+            *ptr:The array to check
+            len:Length of data to be check
+Return:     crc
+Others:     Nibble table,2 lookups per byte.
+*************************************************************************/
+uint32_t BMV31K304::checkCRC32(uint32_t crc, const uint8_t *ptr, uint16_t len)
+{
+  crc = ~crc;
+  while (len--)
+  {
+    crc = crc32_table[(crc ^ *ptr) & 0x0f] ^ (crc >> 4);
+    crc = crc32_table[(crc ^ (*ptr >> 4)) & 0x0f] ^ (crc >> 4);
+    ptr++;
+  }
+  return ~crc;
+}
+
+/************************************************************************* 
+Description:Add received audio data to the page buffer
+parameter:  *pBuffer:data
+            len:bytes
+Return:     void
+Others:     A page is programmed once it is complete,so most frames cost
+            no flash cycle at all.
+*************************************************************************/
+void BMV31K304::pageAppend(const uint8_t *pBuffer, uint16_t len)
+{
+  uint16_t room, n;
+  _updateStats.dataBytes += len;
+  while(len > 0)
+  {
+    room = _flash.pageSize - (_flashAddr % _flash.pageSize);//bytes to the end of the page
+    n = (len < room) ? len : room;
+    memcpy(_pageBuffer[_pageIndex] + _pageFill, pBuffer, n);
+    _pageFill += n;
+    _flashAddr += n;
+    pBuffer += n;
+    len -= n;
+    if(n == room)
+    {
+      pageFlush();
+    }
+  }
+}
+
+/************************************************************************* 
+Description:Start programming the buffered part of the current page
+parameter:  void
+Return:     void
+Others:     The program runs in the flash while the next page is received
+            into the other buffer;only a second page finding the flash
+            still busy waits for it(back-pressure).A failure is latched in
+            _pageError and answered on a later frame.
+            A page of 0xFF only is dropped when COMCE or COMSE erased it in
+            this session,anything else is programmed.
+*************************************************************************/
+void BMV31K304::pageFlush(void)
+{
+  uint16_t i;
+  for(i = 0; (i < _pageFill) && (0xff == _pageBuffer[_pageIndex][i]); i++);
+  if((i == _pageFill) && erasedCheck(_flashAddr - _pageFill, _flashAddr))
+  {
+    _pageFill = 0;
+  }
+  if(_pageFill > 0)
+  {
+    erasedTrim(_flashAddr - _pageFill, _flashAddr);
+    flashWait();
+    SPIFlashWriteEnable();
+    if(0 == (SPIFlashReadStatus() & WEL_FLAG))
+    {
+      _pageError = true;//write protected or no flash
+    }
+    SPIFlashPageProgram(_pageBuffer[_pageIndex], _flashAddr - _pageFill, _pageFill);
+    flashStart(FLASH_OP_PROGRAM, _flash.pageTimeout, &BMV31K304::pageDone);
+    _pagePrograms++;
+    _pageIndex ^= 1;
+    _pageFill = 0;
+  }
+}
+
+/************************************************************************* 
+Description:Remember a flash range as erased
+parameter:  addr:first byte
+            end:byte after the range
+Return:     void
+Others:     Replaces the oldest range when all BMV31K304_ERASED_RANGES are
+            in use;a forgotten range only costs programs of 0xFF pages.
+*************************************************************************/
+void BMV31K304::erasedAdd(uint32_t addr, uint32_t end)
+{
+  _erasedStart[_erasedNext] = addr;
+  _erasedEnd[_erasedNext] = end;
+  _erasedNext = (_erasedNext + 1) % BMV31K304_ERASED_RANGES;
+}
+
+/************************************************************************* 
+Description:Check that a flash range is erased
+parameter:  addr:first byte
+            end:byte after the range
+Return:     true:inside a range erased in this session
+Others:     
+*************************************************************************/
+bool BMV31K304::erasedCheck(uint32_t addr, uint32_t end)
+{
+  uint8_t i;
+  for(i = 0; i < BMV31K304_ERASED_RANGES; i++)
+  {
+    if((_erasedStart[i] <= addr) && (end <= _erasedEnd[i]))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+/************************************************************************* 
+Description:Drop a programmed flash range from the erased ranges
+parameter:  addr:first byte
+            end:byte after the range
+Return:     void
+Others:     An erased range keeps only its part above the program,the
+            update writes upwards.
+*************************************************************************/
+void BMV31K304::erasedTrim(uint32_t addr, uint32_t end)
+{
+  uint8_t i;
+  for(i = 0; i < BMV31K304_ERASED_RANGES; i++)
+  {
+    if((_erasedStart[i] < end) && (addr < _erasedEnd[i]))
+    {
+      _erasedStart[i] = (end < _erasedEnd[i]) ? end : _erasedEnd[i];
+    }
+  }
+}
+
+/************************************************************************* 
+Description:Get the voice flash parameters
+parameter:  *info:receives the parameters
+Return:     void
+Others:     Read from the SFDP of the flash by COMSPI,the defaults of
+            common 3-byte SPI NOR before that or without SFDP.
+*************************************************************************/
+void BMV31K304::getFlashInfo(BMV31K304FlashInfo *info)
+{
+  *info = _flash;
+}
+
+/************************************************************************* 
+Description:Set the SPI clock of the voice flash during the update
+parameter:  clock:Hz,default BMV31K304_FLASH_CLOCK
+Return:     void
+Others:     Limited to maxClock of getFlashInfo().Lower it if long wires
+            to the module corrupt the readback.
+*************************************************************************/
+void BMV31K304::setFlashClock(uint32_t clock)
+{
+  _flashClock = clock;
+}
+
+/************************************************************************* 
+Description:Get the SPI clock of the voice flash
+parameter:  void
+Return:     Hz,the clock set,limited to what the flash is rated for
+Others:         
+*************************************************************************/
+uint32_t BMV31K304::getFlashClock(void)
+{
+  return (_flashClock < _flash.maxClock) ? _flashClock : _flash.maxClock;
+}
+
+/************************************************************************* 
+Description:Get the page programs of the last update
+parameter:  void
+Return:     number of page program cycles
+Others:         
+*************************************************************************/
+uint32_t BMV31K304::getPagePrograms(void)
+{
+  return _pagePrograms;
+}
+
+/************************************************************************* 
+Description:Get the counters of the update session
+parameter:  *stats:receives the counters
+Return:     void
+Others:     Of the running update,or of the last one once updatePoll()
+            has reported its end.Compare waitUs and eraseMs(flash),
+            idleUs(host/USB) and crcNacks/resyncBytes(link errors) to
+            see what limits the throughput.
+*************************************************************************/
+void BMV31K304::getUpdateStats(BMV31K304UpdateStats *stats)
+{
+  *stats = _updateStats;
+  stats->pagePrograms = _pagePrograms;
+  stats->elapsedMs = ((BMV31K304_UPDATE_RUNNING == _updateState) ? millis() : _updateEndMs) - _updateStartMs;
+  stats->bytesPerSec = (stats->elapsedMs != 0) ? (uint32_t)((uint64_t)stats->dataBytes * 1000 / stats->elapsedMs) : 0;
+}
+
+/************************************************************************* 
+Description:Start a transaction with the FLASH:SPI settings,chip select low
+parameter:  void      
+Return:     void    
+Others:     The clock is getFlashClock(),mode 0,MSB first.
+*************************************************************************/
+void BMV31K304::SPIFlashSelect(void)
+{
+  _spi->beginTransaction(SPISettings(getFlashClock(), MSBFIRST, SPI_MODE0));
+  writeSel(LOW);
+}
+
+/************************************************************************* 
+Description:End the transaction with the FLASH:chip select high
+parameter:  void      
+Return:     void    
+Others:         
+*************************************************************************/
+void BMV31K304::SPIFlashDeselect(void)
+{
+  writeSel(HIGH);
+  _spi->endTransaction();
+}
+
+/************************************************************************* 
+Description:Enables the write access to the FLASH.
+parameter:  void      
+Return:     void    
+Others:         
+*************************************************************************/
+void BMV31K304::SPIFlashWriteEnable(void)
+{
+  SPIFlashSelect();
+  /* Send instruction */
+  _spi->transfer(WREN);
+  SPIFlashDeselect();
+}
+
+/************************************************************************* 
+Description:Read the status register of the FLASH.
+parameter:  void
+Return:     status register
+Others:         
+*************************************************************************/
+uint8_t BMV31K304::SPIFlashReadStatus(void)
+{
+  uint8_t cmd[2] = {RDSR, DUMMY_BYTE};
+  SPIFlashSelect();
+  _spi->transfer(cmd, sizeof(cmd));
+  SPIFlashDeselect();
+  return cmd[1];
+}
+
+/************************************************************************* 
+Description:Start erasing the entire FLASH.
+parameter:  void      
+Return:     void    
+Others:     chipEraseDone() is called by flashPoll() at the end.
+*************************************************************************/
+void BMV31K304::SPIFlashChipErase(void)
+{
+  /* Send write enable instruction */
+  SPIFlashWriteEnable();
+  /* Bulk Erase */ 
+  SPIFlashSelect();
+  /* Send Chip Erase instruction  */
+  _spi->transfer(CE);
+  SPIFlashDeselect();
+  flashStart(FLASH_OP_ERASE, _flash.chipTimeout, &BMV31K304::chipEraseDone);
+}
+
+/************************************************************************* 
+Description:Start erasing a sector or block of the FLASH.
+parameter:  type:index of the erase type in _flash(e.g. 4KB or 64KB)
+            addr:address inside the sector/block
+Return:     void
+Others:     eraseDone() is called by flashPoll() at the end.
+*************************************************************************/
+void BMV31K304::SPIFlashErase(uint8_t type, uint32_t addr)
+{
+  uint8_t cmd[5], n;
+  n = SPIFlashCommand(cmd, _flash.eraseOp[type], addr);
+  /* Send write enable instruction */
+  SPIFlashWriteEnable();
+  SPIFlashSelect();
+  _spi->transfer(cmd, n);
+  SPIFlashDeselect();
+  flashStart(FLASH_OP_ERASE, _flash.eraseTimeout[type], &BMV31K304::eraseDone);
+}
+
+/************************************************************************* 
+Description:Put an instruction and its address into a command buffer
+parameter:  *cmd:receives the bytes,5 at most
+            instruction
+            addr:FLASH's internal address
+Return:     bytes in cmd
+Others:     3 or 4 address bytes,see _flash.addrBytes.
+*************************************************************************/
+uint8_t BMV31K304::SPIFlashCommand(uint8_t *cmd, uint8_t instruction, uint32_t addr)
+{
+  uint8_t n = 0;
+  cmd[n++] = instruction;
+  if(4 == _flash.addrBytes)
+  {
+    cmd[n++] = addr >> 24;
+  }
+  cmd[n++] = (addr >> 16) & 0xFF;
+  cmd[n++] = (addr >> 8) & 0xFF;
+  cmd[n++] = addr & 0xFF;
+  return n;
+}
+
+/************************************************************************* 
+Description:Reads a block of data from the FLASH.
+parameter:  pBuffer : pointer to the buffer that receives the data read from the FLASH.
+            ReadAddr : FLASH's internal address to read from.
+            NumByteToRead : number of bytes to read from the FLASH.        
+Return:     void        
+Others:     Fast read of _flash(FAST_READ with one dummy byte unless the
+            SFDP says otherwise),the data is clocked in with a single
+            buffer transfer instead of one call per byte.
+*************************************************************************/
+void BMV31K304::SPIFlashRead(uint8_t* pBuffer, uint32_t ReadAddr, uint16_t NumByteToRead)
+{
+  uint8_t cmd[8], n;
+  n = SPIFlashCommand(cmd, _flash.readOp, ReadAddr);
+  while((n < sizeof(cmd)) && (n < 1 + _flash.addrBytes + _flash.readDummy))
+  {
+    cmd[n++] = DUMMY_BYTE;
+  }
+  memset(pBuffer, DUMMY_BYTE, NumByteToRead);
+  SPIFlashSelect();
+  _spi->transfer(cmd, n);
+  _spi->transfer(pBuffer, NumByteToRead);
+  SPIFlashDeselect();
+}
+
+/************************************************************************* 
+Description:Send a Page Program instruction without waiting for its end.
+parameter:  pBuffer : data to be written to the FLASH.
+            writeAddr : FLASH's internal address to write to.
+            numByteToWrite : number of bytes,up to _flash.pageSize.
+Return:     void        
+Others:     Write access must be enabled first;the FLASH is busy(WIP)
+            when this returns.The page goes out in one buffer transfer,
+            which overwrites pBuffer with the bytes clocked in.
 *************************************************************************/
-uint16_t BMV31K304::ack(void)
+void BMV31K304::SPIFlashPageProgram(uint8_t* pBuffer, uint32_t writeAddr, uint16_t numByteToWrite)
 {
-  /*MSB*/
-  static uint8_t i;
-  uint16_t ackData = 0;
-  pinMode(_icpda, INPUT);
-  digitalWrite(_icpck, LOW);
-  for (i = 0; i < 3; i++)
-  {
-    digitalWrite(_icpck, HIGH);
-    digitalWrite(_icpck, LOW);
-    if (HIGH == digitalRead(_icpda))
-    {
-      ackData |= (0x04 >> i);
-    }
-    else
-    {
-      ackData &= ~(0x04 >> i);
-    }
-    delayMicroseconds(5);
-  } 
-  digitalWrite(_icpck, HIGH);
-  pinMode(_icpda, OUTPUT);
-  return ackData;
+  uint8_t cmd[5], n;
+  n = SPIFlashCommand(cmd, _flash.programOp, writeAddr);
+  SPIFlashSelect();
+  /* Send "Write to Memory " instruction and address */
+  _spi->transfer(cmd, n);
+  _spi->transfer(pBuffer, numByteToWrite);
+  SPIFlashDeselect();
 }
 
 /************************************************************************* 
-Description:Send the dummy Clocks
-parameter:  void       
-Return:     void    
+Description:Read SFDP.
+parameter:  pBuffer : pointer to the buffer that receives the data read from the FLASH.
+            ReadAddr : FLASH's internal address to read from.
+            NumByteToRead : number of bytes to read from the FLASH.        
+Return:     void        
 Others:         
 *************************************************************************/
-void BMV31K304::dummyClocks(void)
+void BMV31K304::SPIFlashReadSFDP(uint8_t* pBuffer, uint32_t ReadAddr, uint16_t NumByteToRead)
 {
-  static uint16_t i;
-  for (i = 0; i < 512; i++)
-  {
-    digitalWrite(_icpck, LOW);
-    delayMicroseconds(1);
-    digitalWrite(_icpck, HIGH);
-    delayMicroseconds(1);    
-  }
+  /* SFDP instruction,3 address bytes and 1 byte dummy clock */
+  uint8_t cmd[5] = {SFDP, (uint8_t)(ReadAddr >> 16), (uint8_t)(ReadAddr >> 8), (uint8_t)ReadAddr, DUMMY_BYTE};
+  memset(pBuffer, DUMMY_BYTE, NumByteToRead);
+  SPIFlashSelect();
+  _spi->transfer(cmd, sizeof(cmd));
+  _spi->transfer(pBuffer, NumByteToRead);
+  SPIFlashDeselect();
 }
 
 /************************************************************************* 
-Description:Send data bit in high
-parameter:  void   
-Return:     void    
+Description:Read 0x90
+parameter:  pBuffer : pointer to the buffer that receives the data read from the FLASH.
+            NumByteToRead : number of bytes to read from the FLASH.        
+Return:     void       
 Others:         
 *************************************************************************/
-void BMV31K304::programDataOut1(void)
+void BMV31K304::SPIFlashRead0x90(uint8_t* pBuffer,  uint16_t NumByteToRead)
 {
-  digitalWrite(_icpda, HIGH);
-  delayMicroseconds(1);
-  digitalWrite(_icpck, LOW);  
-  delayMicroseconds(1);//tckl:1~15us
-  digitalWrite(_icpck, HIGH);
+  /* Instruction and 3 dummy address bytes */
+  uint8_t cmd[4] = {0x90, DUMMY_BYTE, DUMMY_BYTE, DUMMY_BYTE};
+  delay(100);
+  memset(pBuffer, DUMMY_BYTE, NumByteToRead);
+  SPIFlashSelect();
+  _spi->transfer(cmd, sizeof(cmd));
+  _spi->transfer(pBuffer, NumByteToRead);
+  SPIFlashDeselect();
 }
 
 /************************************************************************* 
-Description:Send data bit in low
-parameter:  void       
-Return:     void    
+Description:Read 0x9f
+parameter:  pBuffer : pointer to the buffer that receives the data read from the FLASH.
+            NumByteToRead : number of bytes to read from the FLASH.        
+Return:     void        
 Others:         
 *************************************************************************/
-void BMV31K304::programDataOut0(void)
+void BMV31K304::SPIFlashRead0x9F(uint8_t* pBuffer,  uint16_t NumByteToRead)
 {
-  digitalWrite(_icpda, LOW);
-  delayMicroseconds(1);
-  digitalWrite(_icpck, LOW);
-  delayMicroseconds(1);//tckl:1~15us
-  digitalWrite(_icpck, HIGH);
+  delay(100);
+  memset(pBuffer, DUMMY_BYTE, NumByteToRead);
+  SPIFlashSelect();
+  _spi->transfer(0x9F);
+  _spi->transfer(pBuffer, NumByteToRead);
+  SPIFlashDeselect();
 }
 
 /************************************************************************* 
-Description:Send address bit in high
-parameter:  void    
-Return:     void    
-Others:         
+Description:  Constructor
+parameter:    *spiClass:SPI port whose MOSI line drives the BMV31K304 DATA pin
+              sampleRate:SPI clock,one sample per clock,should be a
+                         multiple of 5000(the 200us grid of the command timing)
+Return:         
+Others:       With the default 10000 a two byte frame needs 96 bytes.
 *************************************************************************/
-void BMV31K304::programAddrOut1(void)
+BMV31K304SPIWave::BMV31K304SPIWave(SPIClass *spiClass, uint32_t sampleRate)
 {
-  /*at entry mode :tckl+tckh < 15us*/
-  digitalWrite(_icpda, HIGH);
-  digitalWrite(_icpck, LOW);  
-  delayMicroseconds(1);//tckl:1~15us
-  digitalWrite(_icpck, HIGH);
-  delayMicroseconds(4);//tckh:1~15us
+  _spi = spiClass;
+  _sampleRate = sampleRate;
+  _busy = false;
 }
 
 /************************************************************************* 
-Description:Send address bit in low
-parameter:  void     
-Return:     void    
-Others:         
+Description:Take over the SPI port
+parameter:  void
+Return:     true:ready
+            false:no non-blocking transfer on this core,or the sample
+                  rate is below BMV31K304_SPI_CLOCK_MIN
+Others:     Called by BMV31K304::begin(),which bit-bangs the frames
+            when it fails.From here on MOSI drives the DATA pin.
 *************************************************************************/
-void BMV31K304::programAddrOut0(void)
+bool BMV31K304SPIWave::begin(void)
 {
-  digitalWrite(_icpda, LOW);
-  digitalWrite(_icpck, LOW);
-  delayMicroseconds(1);//tckl:1~15us
-  digitalWrite(_icpck, HIGH);
-  delayMicroseconds(4);//tckh:1~15us
+#if defined(SPI_HAS_TRANSFER_ASYNC)
+#if BMV31K304_SPI_CLOCK_MIN > 0
+  if(_sampleRate < BMV31K304_SPI_CLOCK_MIN)
+  {
+    return false;
+  }
+#endif
+  _event.setContext(this);
+  _event.attachImmediate(transferDone);
+  _spi->begin();
+  return true;
+#else
+  return false;
+#endif
 }
 
 /************************************************************************* 
-Description:Pattern(mode) matching
-parameter:  mode:0x02       
-Return:     void       
+Description:Get the sample rate
+parameter:  void
+Return:     samples per second
 Others:         
 *************************************************************************/
-void BMV31K304::matchPattern(uint16_t mode)
+uint32_t BMV31K304SPIWave::sampleRate(void)
 {
-  uint16_t i, temp, pattern, mData;
-  pattern = 0x4A8;//0100 1010 1000:low 3 bits are mode; high 9 bits are fixed
-  mData = (pattern | mode) << 4;
-	temp = 0x8000;//MSB
-
-	for (i = 0; i < 12; i++)
-	{
-		if(mData&temp)
-			programDataOut1();
-		else
-			programDataOut0();	
-		mData <<= 1;
-	}
-  digitalWrite(_icpda, HIGH);
+  return _sampleRate;
 }
 
 /************************************************************************* 
-Description:Send the address
-parameter:  addr;send addr       
-Return:     void    
+Description:Get the sample buffer
+parameter:  *size:size of the buffer in bytes
+Return:     sample buffer
 Others:         
 *************************************************************************/
-void BMV31K304::sendAddr(uint16_t addr)
+uint8_t *BMV31K304SPIWave::buffer(uint16_t *size)
 {
-  pinMode(_icpda, OUTPUT);
-  digitalWrite(_icpda, HIGH);
-    /*LSB*/
-	uint16_t i, temp;
-	temp = 0x0001;//LSB	
-	for (i = 0; i < 12; i++)
-	{
-		if (addr & temp)
-			programAddrOut1();
-		else
-			programAddrOut0();		
-		addr >>= 1;	
-	}
+  *size = BMV31K304_WAVE_BUFFER_SIZE;
+  return _samples;
 }
 
 /************************************************************************* 
-Description:Send the data
-parameter:  data:Data sent to the BMV31K304 at a fixed address
-Return:     void    
-Others:         
+Description:Clock the sample buffer out on MOSI
+parameter:  length:number of bytes to send
+Return:     true:started
+Others:     Returns at once,the transfer runs on DMA and isBusy() stays
+            true until its completion event.
 *************************************************************************/
-void BMV31K304::sendData(uint16_t data)
+bool BMV31K304SPIWave::write(uint16_t length)
 {
-  pinMode(_icpda, OUTPUT);
-	uint16_t i, temp;
-	temp = 0x0001;//LSB
+#if defined(SPI_HAS_TRANSFER_ASYNC)
+  _busy = true;
+  _spi->beginTransaction(SPISettings(_sampleRate, MSBFIRST, SPI_MODE0));
+  if(false == _spi->transfer(_samples, NULL, length, _event))
+  {
+    _spi->endTransaction();
+    _busy = false;
+    return false;
+  }
+  return true;
+#else
+  (void)length;
+  return false;
+#endif
+}
 
-	for (i = 0; i < 14; i++)
-	{
-		if (data & temp)
-			programDataOut1();
-		else
-			programDataOut0();	
-		data >>= 1;		
-	}
-  delayMicroseconds(1);
-  digitalWrite(_icpck, LOW);
-  delayMicroseconds(1);
-  digitalWrite(_icpck, HIGH);
-  delayMicroseconds(2000);
-	digitalWrite(_icpck, LOW);
-  delayMicroseconds(1);
-  digitalWrite(_icpck, HIGH);
-  delayMicroseconds(5);
+#if defined(SPI_HAS_TRANSFER_ASYNC)
+/************************************************************************* 
+Description:Completion event of the sample transfer
+parameter:  event:_event of the BMV31K304SPIWave
+Return:     void
+Others:     Runs in the DMA interrupt.
+*************************************************************************/
+void BMV31K304SPIWave::transferDone(EventResponderRef event)
+{
+  BMV31K304SPIWave *wave = (BMV31K304SPIWave *)event.getContext();
+  wave->_spi->endTransaction();
+  wave->_busy = false;
 }
+#endif
 
 /************************************************************************* 
-Description:Read the data
+Description:Get the output status
 parameter:  void
-Return:     data:Data  
+Return:     true:samples still being clocked out
 Others:         
 *************************************************************************/
-uint16_t BMV31K304::readData(void)
+bool BMV31K304SPIWave::isBusy(void)
 {
-    /*LSB*/
-	uint8_t i;
-  uint16_t rxData = 0;
-  pinMode(_icpda, INPUT);
-  digitalWrite(_icpck, LOW);    	
-  for (i = 0; i < 14; i++)
-  {
-    digitalWrite(_icpck, LOW);
-    if (HIGH == digitalRead(_icpda))
-    {
-      rxData |= (0x01 << i);
-    }
-    else
-    {
-      rxData &= ~(0x01 << i);
-    }
-    digitalWrite(_icpck, HIGH);
-    delayMicroseconds(2);
-  }
-  digitalWrite(_icpck, HIGH);//15th
-  delayMicroseconds(2);
-  digitalWrite(_icpck, LOW);
-  delayMicroseconds(1);
-  digitalWrite(_icpck, HIGH);//16th
-  delayMicroseconds(2000);
-  digitalWrite(_icpck, LOW);
-  delayMicroseconds(1);
-  digitalWrite(_icpck, HIGH);
-  return rxData;
+  return _busy;
 }
 
 /************************************************************************* 
-Description:Data check
-parameter:  *ptr:The array to check
-            len:Length of data to be check       
-Return:     1:correct
-            0:error
+Description:  Constructor
+parameter:    *player:BMV31K304 that plays the list
+Return:         
 Others:         
 *************************************************************************/
-uint8_t BMV31K304::checkCRC8(uint8_t *ptr, uint8_t len) 
+BMV31K304Playlist::BMV31K304Playlist(BMV31K304 *player)
 {
-  uint8_t  crc = 0x00;
+  _player = player;
+  _head = 0;
+  _tail = 0;
+  _state = PLAYLIST_IDLE;
+  _repeatLeft = 0;
+  _stamp = 0;
+}
 
-  while (len--)
-  {
-    crc = crc_table[crc ^ *ptr++];
-  }
-  return (crc);
+/************************************************************************* 
+Description:Prepare the player for the sequencer
+parameter:  void
+Return:     void
+Others:     Selects BMV31K304_CMD_ASYNC and the busy line interrupt,
+            call it after the player's begin().
+*************************************************************************/
+void BMV31K304Playlist::begin(void)
+{
+  _player->setCmdMode(BMV31K304_CMD_ASYNC);
+  _player->enableBusyInterrupt();
 }
 
 /************************************************************************* 
-Description:Receive audio data update from upper computer into BMV31K304
-parameter:  void       
-Return:     1:Correct reception; 0:Error of reception
+Description:Append a voice to the list
+parameter:  num:voice number 0~255
+            repeat:times to play,BMV31K304_REPEAT_FOREVER:until cancel()
+            gap:silence after each play in ms
+Return:     true:added; false:list full
 Others:         
 *************************************************************************/
-void BMV31K304::recAudioData(void)
+bool BMV31K304Playlist::addVoice(uint8_t num, uint8_t repeat, uint16_t gap)
 {
-  static int8_t dataLength = 0;
-  static uint8_t remainder = 0;
-  static uint32_t sumDataCnt = 0;
-  if ((0x55 == rxBuffer[0]) && (0x23 == rxBuffer[1]))
-  {
-    rxBuffer[0]=rxBuffer[1]=0;
-    dataLength = rxBuffer[2];
-    SerialUSB.readBytes(rxBuffer + 3, dataLength + 2);  
-    if(rxBuffer[dataLength + 3] == checkCRC8(rxBuffer + 2, dataLength + 1))
-    {
-      sumDataCnt += dataLength;
-      remainder = sumDataCnt % 64;
-      if (remainder <= 59)
-      {
-        SPIFlashPageWrite(rxBuffer + 3, _flashAddr, dataLength - remainder);
-        SPIFlashPageWrite(rxBuffer + 3 + dataLength - remainder, _flashAddr + dataLength - remainder, remainder);         
-      }
-      else
-      {
-        SPIFlashPageWrite(rxBuffer + 3, _flashAddr, dataLength);
-      }
-                
-      _flashAddr += dataLength;
-      SerialUSB.write(0x3e);//ACK
-    }
-    else
-    {
-      SerialUSB.write(0xe3);//NACK
-      return;
-    }
-  }
+  return addItem(BMV31K304_ITEM_VOICE, num, repeat, gap);
 }
 
 /************************************************************************* 
-Description:Enables the write access to the FLASH.
-parameter:  void      
-Return:     void    
+Description:Append a sentence to the list
+parameter:  num:sentence command
+            repeat:times to play,BMV31K304_REPEAT_FOREVER:until cancel()
+            gap:silence after each play in ms
+Return:     true:added; false:list full
 Others:         
 *************************************************************************/
-void BMV31K304::SPIFlashWriteEnable(void)
+bool BMV31K304Playlist::addSentence(uint8_t num, uint8_t repeat, uint16_t gap)
 {
-  /* Select the FLASH: Chip Select low */
-  digitalWrite(_sel, LOW);
-
-  /* Send instruction */
-  _spi->transfer(WREN);
-
-  /* Deselect the FLASH: Chip Select high */
-  digitalWrite(_sel, HIGH);
+  return addItem(BMV31K304_ITEM_SENTENCE, num, repeat, gap);
 }
 
 /************************************************************************* 
-Description:Polls the status of the Write In Progress (WIP) flag in 
-            the FLASH's status register and loop until write  opertaion has completed.
-parameter:  void                       
-Return:     void    
+Description:Clear the list
+parameter:  stop:true:also stop the item that is playing
+Return:     void
 Others:         
 *************************************************************************/
-void BMV31K304::SPIFlashWaitForWriteEnd(void)
+void BMV31K304Playlist::cancel(bool stop)
 {
-  uint8_t FLASH_Status = 0;
-  /* Select the FLASH: Chip Select low */
-  digitalWrite(_sel, LOW);	
-  /* Send "Read Status Register" instruction */
-  _spi->transfer(RDSR);
-  /* Loop as long as the memory is busy with a write cycle */
-  do
+  bool running = (_state != PLAYLIST_IDLE);
+  _tail = _head;
+  _state = PLAYLIST_IDLE;
+  if(stop && running)
   {
-    /* Send a dummy byte to generate the clock needed by the FLASH 
-    and put the value of the status register in FLASH_Status variable */
-    FLASH_Status = _spi->transfer(DUMMY_BYTE);
+    _player->playStop();
+  }
+}
 
-  } while((FLASH_Status & WIP_FLAG) == 1); /* Write in progress */
-    /* Deselect the FLASH: Chip Select high */
-  digitalWrite(_sel, HIGH);	
+/************************************************************************* 
+Description:Run the sequencer
+parameter:  void
+Return:     void
+Others:     Call it from loop().It also runs the player's poll().The next
+            command is queued in the same call that sees the busy line
+            go high,and a frame after an idle line skips its lead-in.
+*************************************************************************/
+void BMV31K304Playlist::poll(void)
+{
+  _player->poll();
+  while(1)
+  {
+    switch(_state)
+    {
+      case PLAYLIST_IDLE:
+        if(_head == _tail)
+        {
+          return;
+        }
+        _repeatLeft = _itemRepeat[_tail];
+        _state = PLAYLIST_SEND;
+        break;
+      case PLAYLIST_SEND:
+        _player->isFinished();//clear the flag left by the previous item
+        if(BMV31K304_ITEM_VOICE == _itemType[_tail])
+        {
+          _player->playVoice(_itemNum[_tail]);
+        }
+        else
+        {
+          _player->playSentence(_itemNum[_tail]);
+        }
+        _state = PLAYLIST_SENDING;
+        break;
+      case PLAYLIST_SENDING:
+        if(false == _player->isIdle())
+        {
+          return;
+        }
+        _stamp = millis();
+        _state = PLAYLIST_STARTING;
+        break;
+      case PLAYLIST_STARTING:
+        if(_player->isPlaying())
+        {
+          _state = PLAYLIST_PLAYING;
+        }
+        else if(_player->isFinished() || ((uint32_t)(millis() - _stamp) >= PLAY_START_TIMEOUT))
+        {
+          _stamp = millis();//a short clip already ended,or no clip
+          _state = PLAYLIST_GAP;
+        }
+        else
+        {
+          return;
+        }
+        break;
+      case PLAYLIST_PLAYING:
+        if(_player->isPlaying())
+        {
+          return;
+        }
+        _stamp = millis();
+        _state = PLAYLIST_GAP;
+        break;
+      case PLAYLIST_GAP:
+        if((uint32_t)(millis() - _stamp) < _itemGap[_tail])
+        {
+          return;
+        }
+        nextItem();
+        break;
+      default:
+        _state = PLAYLIST_IDLE;
+        return;
+    }
+  }
 }
 
 /************************************************************************* 
-Description:Erases the entire FLASH.
-parameter:  void      
-Return:     void    
+Description:Get the sequencer status
+parameter:  void
+Return:     true:an item is playing or waiting
 Others:         
 *************************************************************************/
-void BMV31K304::SPIFlashChipErase(void)
+bool BMV31K304Playlist::isRunning(void)
 {
-  //int i;
-  /* Send write enable instruction */
-  SPIFlashWriteEnable();
-  /* Bulk Erase */ 
-  /* Select the FLASH: Chip Select low */
-  digitalWrite(_sel, LOW);
-  /* Send Chip Erase instruction  */
-  _spi->transfer(CE);
-  /* Deselect the FLASH: Chip Select high */
-  digitalWrite(_sel, HIGH);	
-  delay(200);
-  /* Wait the end of Flash writing */
-  SPIFlashWaitForWriteEnd();
+  if((_state != PLAYLIST_IDLE) || (_head != _tail))
+  {
+    return true;
+  }
+  else
+  {
+    return false;
+  }
 }
 
 /************************************************************************* 
-Description:Writes more than one byte to the FLASH with a single WRITE cycle(Page WRITE sequence). 
-            The number of byte can't exceed the FLASH page size.
-parameter:  pBuffer : pointer to the buffer  containing the data to be written to the FLASH.
-            writeAddr : FLASH's internal address to write to.
-            numByteToWrite : number of bytes to write to the FLASH, must be equal or less 
-            than "SPI_FLASH_PAGESIZE" value.       
-Return:     void        
+Description:Get the number of items in the list
+parameter:  void
+Return:     items,including the one playing
 Others:         
 *************************************************************************/
-void BMV31K304::SPIFlashPageWrite(uint8_t* pBuffer, uint32_t writeAddr, uint16_t numByteToWrite)
+uint8_t BMV31K304Playlist::getCount(void)
 {
-  /* Enable the write access to the FLA
-  SH */
-  SPIFlashWriteEnable();
-  /* Select the FLASH: Chip Select low */
-  digitalWrite(_sel, LOW);
-  /* Send "Write to Memory " instruction */
-  _spi->transfer(PP);
-  /* Send writeAddr high nibble address byte to write to */
-  _spi->transfer((writeAddr & 0xFF0000) >> 16);
-  /* Send writeAddr medium nibble address byte to write to */
-  _spi->transfer((writeAddr & 0xFF00) >> 8);  
-  /* Send writeAddr low nibble address byte to write to */
-  _spi->transfer(writeAddr & 0xFF);
-  
-  /* while there is data to be written on the FLASH */
-  while(numByteToWrite--) 
-  {
-    /* Send the current byte */
-    _spi->transfer(*pBuffer);
-    /* Point on the next byte to be written */
-    pBuffer++; 
-  }
-  
-  /* Deselect the FLASH: Chip Select high */
-  digitalWrite(_sel, HIGH);	
-  /* Wait the end of Flash writing */
-  SPIFlashWaitForWriteEnd();
+  return (_head + BMV31K304_PLAYLIST_SIZE - _tail) % BMV31K304_PLAYLIST_SIZE;
 }
 
 /************************************************************************* 
-Description:Read SFDP.
-parameter:  pBuffer : pointer to the buffer that receives the data read from the FLASH.
-            ReadAddr : FLASH's internal address to read from.
-            NumByteToRead : number of bytes to read from the FLASH.        
-Return:     void        
+Description:Get the item being played
+parameter:  *type:BMV31K304_ITEM_VOICE/BMV31K304_ITEM_SENTENCE
+            *num:voice/sentence number
+            *repeatLeft:plays left including this one,0:forever
+Return:     true:an item is current; false:list empty
 Others:         
 *************************************************************************/
-void BMV31K304::SPIFlashReadSFDP(uint8_t* pBuffer, uint32_t ReadAddr, uint16_t NumByteToRead)
+bool BMV31K304Playlist::getCurrent(uint8_t *type, uint8_t *num, uint8_t *repeatLeft)
 {
-  /* Select the FLASH: Chip Select low */
-  digitalWrite(_sel,LOW);	
-  /* Send "Read from Memory " instruction */
-  _spi->transfer(SFDP);
-  /* Send ReadAddr high nibble address byte to read from */
-  _spi->transfer((ReadAddr & 0xFF0000) >> 16);
-    /* Send ReadAddr medium nibble address byte to read from */
-  _spi->transfer((ReadAddr& 0xFF00) >> 8);
-    /* Send ReadAddr low nibble address byte to read from */
-  _spi->transfer(ReadAddr & 0xFF);
-	/* Send 1 byte dummy clock */
-	_spi->transfer(DUMMY_BYTE);
-  //SPI_FIFOReset(SPIx, SPI_FIFO_RX);
-  while(NumByteToRead--) /* while there is data to be read */
+  if(_head == _tail)
   {
-		/* Read a byte from the FLASH */
-		*pBuffer = _spi->transfer(DUMMY_BYTE);
-		/* Point to the next location where the byte read will be saved */
-		pBuffer++;
+    return false;
   }
-  /* Deselect the FLASH: Chip Select high */
-  digitalWrite(_sel,HIGH);	
+  *type = _itemType[_tail];
+  *num = _itemNum[_tail];
+  *repeatLeft = (PLAYLIST_IDLE == _state) ? _itemRepeat[_tail] : _repeatLeft;
+  return true;
 }
 
 /************************************************************************* 
-Description:Read 0x90
-parameter:  pBuffer : pointer to the buffer that receives the data read from the FLASH.
-            NumByteToRead : number of bytes to read from the FLASH.        
-Return:     void       
+Description:Append an item
+parameter:  type,num,repeat,gap:see addVoice()
+Return:     true:added; false:list full
 Others:         
 *************************************************************************/
-void BMV31K304::SPIFlashRead0x90(uint8_t* pBuffer,  uint16_t NumByteToRead)
+bool BMV31K304Playlist::addItem(uint8_t type, uint8_t num, uint8_t repeat, uint16_t gap)
 {
-  /* Select the FLASH: Chip Select low */
-  delay(100);
-  digitalWrite(_sel,LOW);	
-
-  /* Send "Read from Memory " instruction */
-  _spi->transfer(0x90);
-
-	/* Send 1 byte dummy clock */
-	_spi->transfer(DUMMY_BYTE);
-	/* Send 1 byte dummy clock */
-	_spi->transfer(DUMMY_BYTE);	
-  /* Send 1 byte dummy clock */
-	_spi->transfer(DUMMY_BYTE);
-
-  //SPI_FIFOReset(SPIx, SPI_FIFO_RX);
-
-  while(NumByteToRead--) /* while there is data to be read */
+  uint8_t next = (_head + 1) % BMV31K304_PLAYLIST_SIZE;
+  if(next == _tail)
   {
-		/* Read a byte from the FLASH */
-		*pBuffer = _spi->transfer(DUMMY_BYTE);
-		/* Point to the next location where the byte read will be saved */
-		pBuffer++;
+    return false;
   }
-
-  /* Deselect the FLASH: Chip Select high */
-  digitalWrite(_sel,HIGH);	
+  _itemType[_head] = type;
+  _itemNum[_head] = num;
+  _itemRepeat[_head] = repeat;
+  _itemGap[_head] = gap;
+  _head = next;
+  return true;
 }
 
 /************************************************************************* 
-Description:Read 0x9f
-parameter:  pBuffer : pointer to the buffer that receives the data read from the FLASH.
-            NumByteToRead : number of bytes to read from the FLASH.        
-Return:     void        
+Description:Repeat the current item or move to the next one
+parameter:  void
+Return:     void
 Others:         
 *************************************************************************/
-void BMV31K304::SPIFlashRead0x9F(uint8_t* pBuffer,  uint16_t NumByteToRead)
+void BMV31K304Playlist::nextItem(void)
 {
-  /* Select the FLASH: Chip Select low */
-  delay(100);
-  digitalWrite(_sel,LOW);	
-
-  /* Send "Read from Memory " instruction */
-  _spi->transfer(0x9F);
-
-  while(NumByteToRead--) /* while there is data to be read */
+  if(BMV31K304_REPEAT_FOREVER == _repeatLeft)
+  {
+    _state = PLAYLIST_SEND;
+    return;
+  }
+  _repeatLeft--;
+  if(_repeatLeft != 0)
   {
-		/* Read a byte from the FLASH */
-		*pBuffer = _spi->transfer(DUMMY_BYTE);
-		/* Point to the next location where the byte read will be saved */
-		pBuffer++;
+    _state = PLAYLIST_SEND;
+    return;
   }
-  /* Deselect the FLASH: Chip Select high */
-  digitalWrite(_sel,HIGH);	
+  _tail = (_tail + 1) % BMV31K304_PLAYLIST_SIZE;
+  _state = PLAYLIST_IDLE;
 }
@@ -7,9 +7,9 @@ History：  V1.0.1   -- 2024-07-19
 #ifndef _BMV31K304_H
 #define _BMV31K304_H
 
-#include <SPI.h>
-#include <Arduino.h>
+#include "BMV31K304_HAL.h"
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 /*************************playback control command***************************************************************************************
  * Play voice                                00H~7FH ——> when the 0xfa command is used,00H:is voice 0； from 0 to 127;
@@ -28,14 +28,187 @@ History：  V1.0.1   -- 2024-07-19
 #define BMV31K304_POWER_ENABLE	1	 	 
 #define BMV31K304_POWER_DISABLE 0
 #define BMV31K304_UPDATE_BEGIN  1
+#define BMV31K304_UPDATE_IDLE     0 //updatePoll():no update started
+#define BMV31K304_UPDATE_RUNNING  1 //updatePoll():call again
+#define BMV31K304_UPDATE_DONE     2 //updatePoll():completed
+#define BMV31K304_UPDATE_FAILED   3 //updatePoll():host timeout or flash error
 #define BMV31K304_NO_KEY		    0
 #define BMV31K304_VOLUME_MAX    11
 #define BMV31K304_VOLUME_MIN	  0
+#define BMV31K304_CMD_BLOCKING  0   //playback commands return after the waveform has been sent
+#define BMV31K304_CMD_ASYNC     1   //playback commands are queued and sent by poll()
+#ifndef BMV31K304_CMD_QUEUE_SIZE
+#define BMV31K304_CMD_QUEUE_SIZE  8 //depth of the playback command FIFO
+#endif
+#ifndef BMV31K304_WAVE_BUFFER_SIZE
+#define BMV31K304_WAVE_BUFFER_SIZE  128 //sample buffer of BMV31K304SPIWave(bytes),must hold the longest frame
+#endif
+#define BMV31K304_PLAYLIST_SIZE   16  //items of a BMV31K304Playlist
+#ifndef BMV31K304_CMD_STATS
+#define BMV31K304_CMD_STATS       0   //1:command latency statistics(getStats()),0:no code or RAM for them
+#endif
+#define BMV31K304_STAT_VOICE      0   //getStats() command types:playVoice()
+#define BMV31K304_STAT_SENTENCE   1   //playSentence()
+#define BMV31K304_STAT_VOLUME     2   //setVolume()
+#define BMV31K304_STAT_STOP       3   //playStop()
+#define BMV31K304_STAT_PAUSE      4   //playPause()
+#define BMV31K304_STAT_CONTINUE   5   //playContinue()
+#define BMV31K304_STAT_LOOP       6   //loop of playVoice()/playSentence(),playRepeat()
+#define BMV31K304_STAT_OTHER      7   //other command bytes
+#define BMV31K304_STAT_TYPES      8
+#define BMV31K304_STAT_QUEUE      0   //getStats() stages:command call to the frame going on the line
+#define BMV31K304_STAT_WIRE       1   //frame on the line
+#define BMV31K304_STAT_BUSY       2   //end of the frame to the busy line going low
+#define BMV31K304_STAT_TOTAL      3   //command call to the busy line going low
+#define BMV31K304_STAT_STAGES     4
+#define BMV31K304_STATS_BINS      12  //histogram bins,bin n counts times below BMV31K304_STATS_BIN_US<<n,the last one the rest
+#define BMV31K304_STATS_BIN_US    250 //us,upper edge of histogram bin 0
+#ifndef BMV31K304_FLASH_PAGE_SIZE
+#define BMV31K304_FLASH_PAGE_SIZE 256 //page buffer of the update,programs are split to the SFDP page size
+#endif
+#define BMV31K304_FLASH_ERASE_TYPES 4 //erase types of the SFDP basic table
+#define BMV31K304_FLASH_SECTOR_SIZE 4096 //erase and hash unit of the v2 update
+#ifndef BMV31K304_ERASED_RANGES
+#define BMV31K304_ERASED_RANGES   4   //erased flash ranges remembered by the update,see pageFlush()
+#endif
+#ifndef BMV31K304_FLASH_CLOCK
+#define BMV31K304_FLASH_CLOCK     8000000 //Hz,SPI clock of the voice flash,see setFlashClock()
+#endif
+#ifndef BMV31K304_FRAME_SIZE_MAX
+#define BMV31K304_FRAME_SIZE_MAX  BMV31K304_FLASH_PAGE_SIZE //data bytes of a v2 update frame
+#endif
+#define BMV31K304_RX_BUFFER_SIZE  (2 * (BMV31K304_FRAME_SIZE_MAX + 14)) //update receive buffer,two of the largest frames
+#ifndef BMV31K304_UNPACK_SIZE
+#define BMV31K304_UNPACK_SIZE     1024 //decoded bytes of a compressed v2 frame,0:no compressed frames
+#endif
+
+/*One-wire command timing in us*/
+typedef struct
+{
+  uint16_t leadIn;    //idle time before a frame
+  uint16_t start;     //start signal(low)
+  uint16_t stop;      //stop signal(high)
+  uint16_t longCell;  //long half of a bit cell
+  uint16_t shortCell; //short half of a bit cell
+}BMV31K304Timing;
+#define BMV31K304_TIMING_DEFAULT  {5000, 5000, 5000, 1200, 400} //timing of V1.0.1
+#define BMV31K304_TIMING_FAST     {2500, 2500, 2500, 600, 200}  //half of the default,check it with calibrateTiming()
+#ifndef BMV31K304_TIMING
+#define BMV31K304_TIMING          BMV31K304_TIMING_DEFAULT      //timing used after construction
+#endif
+
+/*Voice flash parameters,read from its SFDP table when the update enters SPI mode*/
+typedef struct
+{
+  uint32_t size;        //bytes,0:unknown
+  uint16_t pageSize;    //bytes per page program(the flash page,at most BMV31K304_FLASH_PAGE_SIZE)
+  uint8_t  addrBytes;   //3,or 4 above 16MB
+  uint8_t  readOp;      //fast read instruction
+  uint8_t  readDummy;   //dummy bytes between the read address and the data
+  uint8_t  programOp;   //page program instruction
+  uint8_t  eraseOp[BMV31K304_FLASH_ERASE_TYPES];      //erase instructions from the smallest size up,0:none
+  uint8_t  eraseShift[BMV31K304_FLASH_ERASE_TYPES];   //log2 of the erase sizes
+  uint32_t eraseTimeout[BMV31K304_FLASH_ERASE_TYPES]; //ms,max erase times
+  uint32_t pageTimeout; //ms,max page program time
+  uint32_t chipTimeout; //ms,max chip erase time,0:unknown
+  uint32_t maxClock;    //Hz,fastest SPI clock for the instructions used
+  bool     sfdp;        //false:no SFDP table,the defaults of common 3-byte SPI NOR are used
+}BMV31K304FlashInfo;
+
+/*Counters of an update session,from beginUpdate() to its end,see getUpdateStats()*/
+typedef struct
+{
+  uint32_t rxBytes;     //bytes received from the host
+  uint32_t dataBytes;   //image bytes taken in(data frames after decoding,COMFL ranges)
+  uint32_t frames;      //frames that checked out
+  uint32_t crcNacks;    //damaged frames answered with NACK
+  uint32_t resyncBytes; //bytes dropped while looking for the next frame
+  uint32_t pagePrograms;
+  uint32_t eraseMs;     //ms of chip,block and sector erases
+  uint32_t programUs;   //us of page programs,mostly overlapped with receiving
+  uint32_t waitUs;      //us blocked waiting for the flash(WIP)
+  uint32_t idleUs;      //us waiting for the host with nothing to do(USB idle)
+  uint32_t elapsedMs;   //ms of the session so far
+  uint32_t bytesPerSec; //dataBytes per second of elapsedMs
+}BMV31K304UpdateStats;
+
+/*Latency of one command type and stage,in us*/
+typedef struct
+{
+  uint32_t count;
+  uint32_t min;
+  uint32_t max;
+  uint32_t mean;
+  uint64_t sum;
+  uint16_t hist[BMV31K304_STATS_BINS];//saturates at 0xffff
+}BMV31K304Latency;
+#define BMV31K304_ITEM_VOICE      0
+#define BMV31K304_ITEM_SENTENCE   1
+#define BMV31K304_REPEAT_FOREVER  0
+
+/*Waveform output peripheral:clocks a packed sample buffer(MSB first,1 bit per sample)
+  out on the one-wire data line without CPU work per edge.BMV31K304SPIWave is the
+  only backend shipped;a timer PWM or GPIO DMA output can be added by deriving
+  from this class.*/
+class BMV31K304WaveOut
+{
+public:
+  virtual bool begin(void) { return true; }
+  virtual uint32_t sampleRate(void) = 0;
+  virtual uint8_t *buffer(uint16_t *size) = 0;
+  virtual bool write(uint16_t length) = 0;
+  virtual bool isBusy(void) = 0;
+};
+
+/*Waveform output on the MOSI line of a SPI port(MOSI wired to the BMV31K304 DATA pin).
+  The offload works only on cores with the non-blocking EventResponder SPI
+  transfer(SPI_HAS_TRANSFER_ASYNC,e.g. Teensy).The BMduino,AVR and most other
+  cores do not have it:there begin() fails and poll() bit-bangs every frame,
+  with one call per edge as without a BMV31K304WaveOut.*/
+class BMV31K304SPIWave : public BMV31K304WaveOut
+{
+public:
+  BMV31K304SPIWave(SPIClass *spiClass, uint32_t sampleRate = 10000);
+  bool begin(void);
+  uint32_t sampleRate(void);
+  uint8_t *buffer(uint16_t *size);
+  bool write(uint16_t length);
+  bool isBusy(void);
+private:
+#if defined(SPI_HAS_TRANSFER_ASYNC)
+  static void transferDone(EventResponderRef event);
+  EventResponder _event;
+#endif
+  SPIClass *_spi;
+  uint32_t _sampleRate;
+  volatile bool _busy;
+  uint8_t _samples[BMV31K304_WAVE_BUFFER_SIZE];
+};
+
+/*ICP bit-level signalling on ICPCK/ICPDA.CK and DA are BMV31K304FastPin
+  (pins chosen at run time) or BMV31K304Pin<n>(pin numbers fixed at compile time).*/
+template<class CK, class DA>
+class BMV31K304ICPBus
+{
+public:
+  void matchPattern(uint16_t mode);
+  uint16_t ack(void);
+  void dummyClocks(void);
+  void sendAddr(uint16_t addr);
+  void sendData(uint16_t data);
+  uint16_t readData(void);
+
+  CK ck;
+  DA da;
+private:
+  inline void programDataOut(uint8_t bit);
+  inline void programAddrOut(uint8_t bit);
+};
 
 class BMV31K304
 {
 public:
-	BMV31K304(uint8_t cs1_ledPin = 29,SPIClass *spiClass = &SPI1,uint8_t powerPin = 22);
+	BMV31K304(uint8_t cs1_ledPin = 29,SPIClass *spiClass = &SPI1,uint8_t powerPin = 22,BMV31K304WaveOut *waveOut = NULL);
 	void begin(void);
 	void setVolume(uint8_t volume = 8);
 	void playVoice(uint8_t num, uint8_t loop = 0);
@@ -46,52 +219,474 @@ public:
 	void playRepeat(void);
 	bool isPlaying(void);
 	void setLED(uint8_t status);
+	void setCmdMode(uint8_t mode = BMV31K304_CMD_ASYNC);
+	void poll(void);
+	bool isIdle(void);
+	void flush(void);
+	void setCmdCoalesce(bool enable = true);
+	uint32_t getSentFrames(void);
+	uint32_t getSavedFrames(void);
+	uint32_t getDroppedFrames(void);
+	void enableBusyInterrupt(uint16_t debounceUs = 0);
+	void disableBusyInterrupt(void);
+	void onPlaybackStarted(void (*callback)(void));
+	void onPlaybackFinished(void (*callback)(void));
+	bool waitIdle(uint32_t timeout = 0);
+	bool isFinished(void);
+	uint32_t getPlayStartTime(void);
+	uint32_t getPlayEndTime(void);
+	void setTiming(const BMV31K304Timing *timing);
+	void getTiming(BMV31K304Timing *timing);
+	bool calibrateTiming(uint8_t voice, uint8_t minPercent = 20);
+	uint32_t getWireTime(uint8_t cmd, uint8_t data = 0xff);
+#if BMV31K304_CMD_STATS
+  bool getStats(uint8_t type, uint8_t stage, BMV31K304Latency *stat);
+  void clearStats(void);
+  void dumpStats(void);
+#endif
   
 	void initAudioUpdate(unsigned long baudrate = 256000);
 	bool isUpdateBegin(void);
   bool executeUpdate(uint8_t mode);
+  bool beginUpdate(uint8_t mode);
+  uint8_t updatePoll(void);
+  uint32_t getPagePrograms(void);
+  void getUpdateStats(BMV31K304UpdateStats *stats);
+  void getFlashInfo(BMV31K304FlashInfo *info);
+  void setFlashClock(uint32_t clock);
+  uint32_t getFlashClock(void);
+protected:
+  void setPins(uint8_t dataPin, uint8_t icpckPin, uint8_t icpdaPin);
+  virtual void writeData(uint8_t level);
+  virtual void writeSel(uint8_t level);
+  virtual void matchPattern(uint16_t mode);
+  virtual uint16_t ack(void);
+  virtual void dummyClocks(void);
+  virtual void sendAddr(uint16_t addr);
+  virtual void sendData(uint16_t data);
+  virtual uint16_t readData(void);
 private:
-  bool executeUpdateWidget(void);
-  bool executeUpdateWorkshop(void);
+  /*What differs between the update tools*/
+  typedef struct
+  {
+    uint8_t spiReplyLen;//bytes of the COMSPI reply
+    void (BMV31K304::*release)(void);//hand the module back after COMORD
+  }UpdatePolicy;
+  static const UpdatePolicy updatePolicy[];
+
+  bool recFrame(void);
+  void endUpdate(uint8_t state);
+  void recControl(void);
+  bool isCommand(const char *name, uint8_t len);
+  void releaseWidget(void);
+  void releaseWorkshop(void);
   void reset(void);
   void setPower(uint8_t status);
   uint8_t CheckIC(void);
   bool switchSPIMode(void);  
+  void defaultFlashInfo(uint8_t capacity);
+  bool readFlashInfo(void);
   void writeCmd(uint8_t cmd, uint8_t data = 0xff);
+  static void busyISR(void);
+  void busyEdge(uint8_t level, uint32_t timeUs);
+  void busyCheck(void);
+  bool coalesceCmd(uint8_t cmd);
+  void clearShadow(void);
+  bool cmdSegment(uint8_t phase, uint8_t cmd, uint8_t data, uint8_t *level, uint16_t *width);
+  uint16_t encodeWave(uint8_t cmd, uint8_t data, uint32_t sampleRate, uint8_t *buf, uint16_t size);
+  bool waveFits(void);
+  void frameSent(uint8_t cmd, uint32_t endUs);
+  bool playStarting(void);
+  bool checkTiming(const BMV31K304Timing *timing, uint8_t voice);
+#if BMV31K304_CMD_STATS
+  uint8_t statType(uint8_t cmd);
+  void statStart(uint8_t cmd, uint8_t slot, uint32_t startUs);
+  void statFrame(uint8_t cmd, uint8_t slot, uint32_t endUs);
+  void statBusy(void);
+  void statRecord(uint8_t type, uint8_t stage, uint32_t us);
+#endif
 	//--------------------program voice source--------------------------
   bool programEntry(uint16_t mode);
-  uint16_t ack(void);
-  void dummyClocks(void);
-  void programDataOut1(void);
-  void programDataOut0(void);
-  void programAddrOut1(void);
-  void programAddrOut0(void);
-  void matchPattern(uint16_t mode);
-  void sendAddr(uint16_t addr);
-  void sendData(uint16_t data);
-  uint16_t readData(void);
 
   uint8_t checkCRC8(uint8_t *ptr, uint8_t len); 
+  uint32_t checkCRC32(uint32_t crc, const uint8_t *ptr, uint16_t len);
   void recAudioData(void);
+  void recAudioFrame(void);
+  void sendCapability(void);
+  void sendUpdateStats(void);
+  bool recControlV2(uint8_t len);
+  void sendSectorHash(uint16_t first, uint16_t count);
+  bool flashRangeValid(uint32_t addr, uint32_t size);
+  uint32_t readFlashRange(uint32_t addr, uint32_t size, bool send);
+  void fillFlashRange(uint32_t addr, uint32_t size, uint8_t value);
+  bool unpackFrame(const uint8_t *pBuffer, uint16_t len, uint16_t rawLen);
+  bool eraseSectors(uint16_t first, uint16_t count);
+  bool eraseNext(void);
+  void eraseDone(bool ok);
+  void chipEraseDone(bool ok);
+  void pageAppend(const uint8_t *pBuffer, uint16_t len);
+  void pageFlush(void);
+  void erasedAdd(uint32_t addr, uint32_t end);
+  bool erasedCheck(uint32_t addr, uint32_t end);
+  void erasedTrim(uint32_t addr, uint32_t end);
+  void pageDone(bool ok);
+  void flashStart(uint8_t op, uint32_t timeout, void (BMV31K304::*done)(bool ok));
+  bool flashPoll(bool now = false);
+  void flashWait(void);
+  void SPIFlashSelect(void);
+  void SPIFlashDeselect(void);
   void SPIFlashWriteEnable(void);
-  void SPIFlashWaitForWriteEnd(void);
+  uint8_t SPIFlashReadStatus(void);
   void SPIFlashChipErase(void);
-  void SPIFlashPageWrite(uint8_t* pBuffer, uint32_t writeAddr, uint16_t numByteToWrite);
+  void SPIFlashErase(uint8_t type, uint32_t addr);
+  uint8_t SPIFlashCommand(uint8_t *cmd, uint8_t instruction, uint32_t addr);
+  void SPIFlashRead(uint8_t* pBuffer, uint32_t ReadAddr, uint16_t NumByteToRead);
+  void SPIFlashPageProgram(uint8_t* pBuffer, uint32_t writeAddr, uint16_t numByteToWrite);
   void SPIFlashReadSFDP(uint8_t* pBuffer, uint32_t ReadAddr, uint16_t NumByteToRead);
   void SPIFlashRead0x90(uint8_t* pBuffer,  uint16_t NumByteToRead);
   void SPIFlashRead0x9F(uint8_t* pBuffer,  uint16_t NumByteToRead);
   
   uint8_t   deviceIDBuf[4];
   uint8_t   deviceSFDPBuf[3];
-  uint8_t   rxBuffer[64];
+  uint8_t   *rxBuffer;//frame being handled,inside _rxData
   uint32_t  _flashAddr;
   uint8_t   _EraseCnt;
+  BMV31K304FlashInfo _flash;
+  uint32_t  _flashClock;//setFlashClock()
+  uint8_t   _pageBuffer[2][BMV31K304_FLASH_PAGE_SIZE];//receiving page and page being programmed
+  uint8_t   _pageIndex;//buffer receiving the page at _flashAddr
+  uint16_t  _pageFill;
+  uint8_t   _flashOp;//flash operation in flight
+  void (BMV31K304::*_flashDone)(bool ok);//completion callback of _flashOp
+  uint32_t  _flashStart;//millis() at the start of _flashOp
+  uint32_t  _flashTimeout;//ms,0:no limit
+  uint32_t  _flashStartUs;//micros() at the start of _flashOp
+  uint32_t  _flashPollStamp;//micros() of the last status read
+  uint16_t  _flashPollDelay;//us from the last status read to the next one
+  uint32_t  _eraseAddr;//next block of the COMSE range
+  uint32_t  _eraseEnd;
+  uint32_t  _eraseStart;//first block of the COMSE range
+  uint32_t  _erasedStart[BMV31K304_ERASED_RANGES];//ranges erased by COMCE/COMSE in this session
+  uint32_t  _erasedEnd[BMV31K304_ERASED_RANGES];//and not programmed since,start==end:unused
+  uint8_t   _erasedNext;//slot of the next erased range
+  bool      _pageError;//a page program failed,NACK the rest of the update
+  bool      _updateV2;//COMV2 received,5A 23 data frames accepted
+  uint8_t   _frameBuffer[BMV31K304_FRAME_SIZE_MAX];//flash data read back or filled by the update
+#if BMV31K304_UNPACK_SIZE > 0
+  uint8_t   _unpackBuffer[BMV31K304_UNPACK_SIZE];//decoded compressed frame
+#endif
+  uint32_t  _pagePrograms;
+  BMV31K304UpdateStats _updateStats;//counters of the session,elapsedMs and bytesPerSec are filled in by getUpdateStats()
+  uint32_t  _updateStartMs;//millis() of beginUpdate()
+  uint32_t  _updateEndMs;//millis() of endUpdate()
+  uint32_t  _rxIdleUs;//micros() since updatePoll() waits for the host
+  bool      _rxIdle;
+  uint32_t  _journalId;//image id of the last COMCP,kept across executeUpdate() calls
+  uint32_t  _journalAddr;//the image is programmed below this address
+  const UpdatePolicy *_policy;
+  uint8_t   _updateState;//BMV31K304_UPDATE_xxx
+  bool      _updateTracking;//busy interrupt to enable again after the update
+  uint8_t   _rxData[BMV31K304_RX_BUFFER_SIZE];//received update bytes,frames are handled in place
+  uint16_t  _rxStart;//first byte not parsed yet
+  uint16_t  _rxEnd;
+  bool      _rxSync;//the last frame checked out(or none yet),NACK if the next one does not
+  uint32_t  _rxStamp;//millis() of the last byte
+
+  uint16_t  _cmdQueue[BMV31K304_CMD_QUEUE_SIZE];//low byte:cmd,high byte:data
+  volatile uint8_t _cmdHead;
+  volatile uint8_t _cmdTail;
+  volatile uint8_t _txLock;
+  uint8_t   _cmdMode;
+  BMV31K304Timing _timing;
+  uint8_t   _txPhase;//0:idle,1:lead-in,2~19:cmd byte,20~37:data byte,0xff:frame on _waveOut
+  uint8_t   _txCmd;
+  uint8_t   _txData;
+  uint32_t  _txStamp;
+  uint32_t  _txWidth;
+  uint32_t  _txIdleSince;//end of the last frame
+  bool      _txIdleValid;
+  volatile bool _playSent;//a voice/sentence/continue frame has ended,busy low not seen yet
+  volatile uint32_t _playSentUs;//end of that frame
+  bool      _cmdCoalesce;
+  uint8_t   _shadowVolume;//last volume command,0xff:unknown
+  uint8_t   _shadowLoop;//0:no,1:loop,0xff:unknown
+  uint8_t   _shadowPause;//0:no,1:paused,0xff:unknown
+  uint32_t  _cmdSent;
+  uint32_t  _cmdSaved;
+  uint32_t  _cmdDropped;
+#if BMV31K304_CMD_STATS
+  uint32_t  _statCallUs[BMV31K304_CMD_QUEUE_SIZE];//micros() of the writeCmd() call of each queued frame
+  uint32_t  _statWireUs;//start of the frame on the line
+  volatile uint8_t  _statPending;//type of the last frame that starts playback,0xff:none
+  volatile uint8_t  _statFlags;//what is known of that frame
+  volatile uint32_t _statPendingCallUs;
+  volatile uint32_t _statPendingEndUs;//last edge of that frame
+  volatile uint32_t _statBusyUs;//busy line low after it started
+  BMV31K304Latency _stats[BMV31K304_STAT_TYPES][BMV31K304_STAT_STAGES];
+#endif
+
+  static BMV31K304 *_busyInstance;//object served by busyISR()
+  bool      _busyTracking;
+  uint16_t  _busyDebounce;
+  volatile uint8_t  _busyLevel;//latched busy line level
+  volatile bool     _busyFinished;
+  volatile uint32_t _busyEdgeUs;
+  volatile uint32_t _busyStartUs;
+  volatile uint32_t _busyEndUs;
+  void (*_playStartedCallback)(void);
+  void (*_playFinishedCallback)(void);
 
   SPIClass *_spi = NULL;
+  BMV31K304WaveOut *_waveOut = NULL;
   uint8_t _power = 22;
   uint8_t _sel = 29;
   uint8_t _icpck = 27;
   uint8_t _icpda = 28;
   uint8_t _data = 26;
+  BMV31K304FastPin _dataOut;
+  BMV31K304FastPin _selOut;
+  BMV31K304ICPBus<BMV31K304FastPin, BMV31K304FastPin> _icp;
+};
+
+/*BMV31K304 with the pin numbers fixed at compile time,e.g.
+  BMV31K304T<26, 27, 28, 29, 22> voice(&SPI1);
+  DataPin/IcpckPin/IcpdaPin must be the MOSI/SCK/MISO pins of spiClass.
+  Inside an ICP word every clock and data edge inlines against BMV31K304Pin,
+  with constant port registers where BMV31K304_PIN_MAP is 1 and registers
+  looked up once at construction elsewhere.The driver in BMV31K304.cpp reaches
+  these pins through one virtual call per ICP word,command edge and flash
+  select,not per bit.*/
+template<uint8_t DataPin, uint8_t IcpckPin, uint8_t IcpdaPin, uint8_t SelPin, uint8_t PowerPin>
+class BMV31K304T : public BMV31K304
+{
+public:
+  BMV31K304T(SPIClass *spiClass = &SPI1, BMV31K304WaveOut *waveOut = NULL)
+    : BMV31K304(SelPin, spiClass, PowerPin, waveOut)
+  {
+    setPins(DataPin, IcpckPin, IcpdaPin);
+    BMV31K304Pin<DataPin>::attach();
+    BMV31K304Pin<IcpckPin>::attach();
+    BMV31K304Pin<IcpdaPin>::attach();
+    BMV31K304Pin<SelPin>::attach();
+  }
+protected:
+  void writeData(uint8_t level) { BMV31K304Pin<DataPin>::writeAtomic(level); }
+  void writeSel(uint8_t level) { BMV31K304Pin<SelPin>::write(level); }
+  void matchPattern(uint16_t mode) { _bus.matchPattern(mode); }
+  uint16_t ack(void) { return _bus.ack(); }
+  void dummyClocks(void) { _bus.dummyClocks(); }
+  void sendAddr(uint16_t addr) { _bus.sendAddr(addr); }
+  void sendData(uint16_t data) { _bus.sendData(data); }
+  uint16_t readData(void) { return _bus.readData(); }
+private:
+  BMV31K304ICPBus<BMV31K304Pin<IcpckPin>, BMV31K304Pin<IcpdaPin> > _bus;
 };
+
+/*Plays a list of voices/sentences back to back,driven by the busy line*/
+class BMV31K304Playlist
+{
+public:
+  BMV31K304Playlist(BMV31K304 *player);
+  void begin(void);
+  bool addVoice(uint8_t num, uint8_t repeat = 1, uint16_t gap = 0);
+  bool addSentence(uint8_t num, uint8_t repeat = 1, uint16_t gap = 0);
+  void cancel(bool stop = true);
+  void poll(void);
+  bool isRunning(void);
+  uint8_t getCount(void);
+  bool getCurrent(uint8_t *type, uint8_t *num, uint8_t *repeatLeft);
+private:
+  bool addItem(uint8_t type, uint8_t num, uint8_t repeat, uint16_t gap);
+  void nextItem(void);
+
+  BMV31K304 *_player;
+  uint8_t   _itemType[BMV31K304_PLAYLIST_SIZE];
+  uint8_t   _itemNum[BMV31K304_PLAYLIST_SIZE];
+  uint8_t   _itemRepeat[BMV31K304_PLAYLIST_SIZE];
+  uint16_t  _itemGap[BMV31K304_PLAYLIST_SIZE];
+  uint8_t   _head;
+  uint8_t   _tail;
+  uint8_t   _state;
+  uint8_t   _repeatLeft;
+  uint32_t  _stamp;
+};
+
+/************************************************************************* 
+Description:Send data bit
+parameter:  bit:0 or 1
+Return:     void    
+Others:         
+*************************************************************************/
+template<class CK, class DA>
+void BMV31K304ICPBus<CK, DA>::programDataOut(uint8_t bit)
+{
+  da.write(bit ? HIGH : LOW);
+  delayMicroseconds(1);
+  ck.write(LOW);
+  delayMicroseconds(1);//tckl:1~15us
+  ck.write(HIGH);
+}
+
+/************************************************************************* 
+Description:Send address bit
+parameter:  bit:0 or 1
+Return:     void    
+Others:     at entry mode :tckl+tckh < 15us
+*************************************************************************/
+template<class CK, class DA>
+void BMV31K304ICPBus<CK, DA>::programAddrOut(uint8_t bit)
+{
+  da.write(bit ? HIGH : LOW);
+  ck.write(LOW);
+  delayMicroseconds(1);//tckl:1~15us
+  ck.write(HIGH);
+  delayMicroseconds(4);//tckh:1~15us
+}
+
+/************************************************************************* 
+Description:Pattern(mode) matching
+parameter:  mode:0x02       
+Return:     void       
+Others:         
+*************************************************************************/
+template<class CK, class DA>
+void BMV31K304ICPBus<CK, DA>::matchPattern(uint16_t mode)
+{
+  uint16_t i, mData;
+  mData = (0x4A8 | mode) << 4;//0100 1010 1000:low 3 bits are mode; high 9 bits are fixed
+  for (i = 0; i < 12; i++)//MSB
+  {
+    programDataOut((mData & 0x8000) ? 1 : 0);
+    mData <<= 1;
+  }
+  da.write(HIGH);
+}
+
+/************************************************************************* 
+Description:ack of mode
+parameter:  void       
+Return:     mode data
+Others:     MSB first
+*************************************************************************/
+template<class CK, class DA>
+uint16_t BMV31K304ICPBus<CK, DA>::ack(void)
+{
+  uint8_t i;
+  uint16_t ackData = 0;
+  da.mode(INPUT);
+  ck.write(LOW);
+  for (i = 0; i < 3; i++)
+  {
+    ck.write(HIGH);
+    ck.write(LOW);
+    if (HIGH == da.read())
+    {
+      ackData |= (0x04 >> i);
+    }
+    delayMicroseconds(5);
+  } 
+  ck.write(HIGH);
+  da.mode(OUTPUT);
+  return ackData;
+}
+
+/************************************************************************* 
+Description:Send the dummy Clocks
+parameter:  void       
+Return:     void    
+Others:         
+*************************************************************************/
+template<class CK, class DA>
+void BMV31K304ICPBus<CK, DA>::dummyClocks(void)
+{
+  uint16_t i;
+  for (i = 0; i < 512; i++)
+  {
+    ck.write(LOW);
+    delayMicroseconds(1);
+    ck.write(HIGH);
+    delayMicroseconds(1);    
+  }
+}
+
+/************************************************************************* 
+Description:Send the address
+parameter:  addr;send addr       
+Return:     void    
+Others:     LSB first
+*************************************************************************/
+template<class CK, class DA>
+void BMV31K304ICPBus<CK, DA>::sendAddr(uint16_t addr)
+{
+  uint16_t i;
+  da.mode(OUTPUT);
+  da.write(HIGH);
+  for (i = 0; i < 12; i++)
+  {
+    programAddrOut(addr & 0x0001);
+    addr >>= 1;	
+  }
+}
+
+/************************************************************************* 
+Description:Send the data
+parameter:  data:Data sent to the BMV31K304 at a fixed address
+Return:     void    
+Others:     LSB first
+*************************************************************************/
+template<class CK, class DA>
+void BMV31K304ICPBus<CK, DA>::sendData(uint16_t data)
+{
+  uint16_t i;
+  da.mode(OUTPUT);
+  for (i = 0; i < 14; i++)
+  {
+    programDataOut(data & 0x0001);
+    data >>= 1;		
+  }
+  delayMicroseconds(1);
+  ck.write(LOW);
+  delayMicroseconds(1);
+  ck.write(HIGH);
+  delayMicroseconds(2000);
+  ck.write(LOW);
+  delayMicroseconds(1);
+  ck.write(HIGH);
+  delayMicroseconds(5);
+}
+
+/************************************************************************* 
+Description:Read the data
+parameter:  void
+Return:     data:Data  
+Others:     LSB first
+*************************************************************************/
+template<class CK, class DA>
+uint16_t BMV31K304ICPBus<CK, DA>::readData(void)
+{
+  uint8_t i;
+  uint16_t rxData = 0;
+  da.mode(INPUT);
+  ck.write(LOW);    	
+  for (i = 0; i < 14; i++)
+  {
+    ck.write(LOW);
+    if (HIGH == da.read())
+    {
+      rxData |= (0x01 << i);
+    }
+    ck.write(HIGH);
+    delayMicroseconds(2);
+  }
+  ck.write(HIGH);//15th
+  delayMicroseconds(2);
+  ck.write(LOW);
+  delayMicroseconds(1);
+  ck.write(HIGH);//16th
+  delayMicroseconds(2000);
+  ck.write(LOW);
+  delayMicroseconds(1);
+  ck.write(HIGH);
+  return rxData;
+}
 #endif
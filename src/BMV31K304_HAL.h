@@ -0,0 +1,354 @@
+/*************************************************************************
+File:         BMV31K304_HAL.h
+Author:       BEST MODULES CORP.
+Description:  Hardware abstraction of the BMV31K304 driver.
+              The driver only uses the Arduino API subset below(GPIO,
+              delay/clock,interrupts,SPI,SerialUSB stream).On Arduino
+              it comes from the core;on a Linux host it is provided by
+              BMV31K304_HAL_Linux.cpp,which runs on a virtual clock and
+              simulates the BMV31K304(one-wire decoder,ICP entry responder
+              and SPI NOR flash,optionally kept in a mapped image file).
+History：  V1.0.1   -- 2024-07-19
+**************************************************************************/
+#ifndef _BMV31K304_HAL_H
+#define _BMV31K304_HAL_H
+
+#if defined(ARDUINO)
+
+#include <SPI.h>
+#include <Arduino.h>
+
+#else
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define HIGH            1
+#define LOW             0
+#define INPUT           0
+#define OUTPUT          1
+#define INPUT_PULLUP    2
+#define INPUT_PULLDOWN  3
+#define CHANGE          1
+#define FALLING         2
+#define RISING          3
+#define MSBFIRST        1
+#define LSBFIRST        0
+#define SPI_MODE0       0
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+unsigned long micros(void);
+unsigned long millis(void);
+void yield(void);
+void attachInterrupt(uint8_t interruptNum, void (*userFunc)(void), int mode);
+void detachInterrupt(uint8_t interruptNum);
+void noInterrupts(void);
+void interrupts(void);
+#define digitalPinToInterrupt(p)  (p)
+
+class SPISettings
+{
+public:
+  SPISettings(uint32_t clock = 4000000, uint8_t bitOrder = MSBFIRST, uint8_t dataMode = SPI_MODE0)
+  {
+    _clock = clock;
+    (void)bitOrder;
+    (void)dataMode;
+  }
+  uint32_t _clock;
+};
+
+/*Completion event of a non-blocking SPI transfer(the Teensy core API)*/
+class EventResponder;
+typedef EventResponder &EventResponderRef;
+typedef void (*EventResponderFunction)(EventResponderRef);
+class EventResponder
+{
+public:
+  void attachImmediate(EventResponderFunction function)
+  {
+    _function = function;
+  }
+  void setContext(void *context)
+  {
+    _context = context;
+  }
+  void *getContext(void)
+  {
+    return _context;
+  }
+  void triggerEvent(int status = 0, void *data = NULL)
+  {
+    (void)status;
+    (void)data;
+    if(_function != NULL)
+    {
+      _function(*this);
+    }
+  }
+private:
+  EventResponderFunction _function = NULL;
+  void *_context = NULL;
+};
+
+#define SPI_HAS_TRANSFER_ASYNC  1
+class SPIClass
+{
+public:
+  void begin(void);
+  void end(void);
+  void beginTransaction(SPISettings settings);
+  void endTransaction(void);
+  uint8_t transfer(uint8_t data);
+  void transfer(void *buf, size_t count);
+  bool transfer(const void *txBuffer, void *rxBuffer, size_t count, EventResponderRef event);
+};
+extern SPIClass SPI;
+extern SPIClass SPI1;
+extern SPIClass SPI2;
+
+class BMV31K304SimSerial
+{
+public:
+  void begin(unsigned long baudrate);
+  int available(void);
+  int read(void);
+  size_t readBytes(uint8_t *buffer, size_t length);
+  size_t write(uint8_t data);
+  size_t write(const uint8_t *buffer, size_t size);
+  void setTimeout(unsigned long timeout);
+  void flush(void);
+};
+extern BMV31K304SimSerial SerialUSB;
+
+/*Control of the simulated BMV31K304 and the virtual clock(Linux host only)*/
+class BMV31K304Sim
+{
+public:
+  static void setPins(uint8_t dataPin, uint8_t icpckPin, uint8_t icpdaPin, uint8_t selPin, uint8_t powerPin);
+  static void setRealTime(bool enable);
+  static uint64_t nanos(void);
+  static void setIoCost(uint32_t gpioNs, uint32_t spiCallNs);
+  static void setClip(uint32_t latencyUs, uint32_t lengthUs);
+  static uint16_t commandCount(void);
+  static bool command(uint16_t index, uint8_t *cmd, uint8_t *data, uint64_t *timeUs);
+  static bool isBusy(void);
+  static bool isICPMode(void);
+  static bool setFlashSize(uint32_t size);
+  static void setFlashTiming(uint32_t pageProgramUs, uint32_t sectorEraseUs, uint32_t chipEraseMs);
+  static bool setFlashFile(const char *path);
+  static uint32_t flashSize(void);
+  static uint8_t *flashData(void);
+  static void serialInput(const uint8_t *buffer, size_t size);
+  static void setSerialHandler(void (*handler)(const uint8_t *buffer, size_t size));
+  static void setSerialFd(int fd);
+  static void setDataHandler(void (*handler)(uint8_t level, uint64_t timeNs));
+};
+
+#endif
+
+/*Lowest clock SPISettings can give on the core(largest prescaler);slower
+  settings are rounded up.Conservative for cores that are not listed,define
+  it before including the library for the actual limit.*/
+#ifndef BMV31K304_SPI_CLOCK_MIN
+#if defined(ARDUINO) && defined(__AVR__)
+#define BMV31K304_SPI_CLOCK_MIN   (F_CPU / 128)
+#elif defined(ARDUINO) && defined(F_CPU)
+#define BMV31K304_SPI_CLOCK_MIN   (F_CPU / 256)
+#else
+#define BMV31K304_SPI_CLOCK_MIN   0
+#endif
+#endif
+
+/*Direct port access of a pin:the port register and bit mask are looked up
+  once,writes and reads then skip the pin lookup of digitalWrite()/digitalRead().
+  Only on AVR and ARM Cortex-M,where BMV31K304_PORT_LOCK() can save and restore
+  the interrupt state.Other cores(and the Linux host,whose simulator watches
+  digitalWrite()) keep the plain calls.The pin must be set up with pinMode().*/
+#if defined(ARDUINO) && defined(portOutputRegister) && defined(portInputRegister) && defined(digitalPinToPort) && defined(digitalPinToBitMask) \
+ && (defined(__AVR__) || (defined(__arm__) && defined(__ARM_ARCH_PROFILE) && (__ARM_ARCH_PROFILE == 'M')))
+#define BMV31K304_FAST_IO   1
+typedef decltype(portOutputRegister(digitalPinToPort(0))) BMV31K304PortReg;
+typedef decltype(portInputRegister(digitalPinToPort(0))) BMV31K304PortInReg;
+typedef decltype(digitalPinToBitMask(0)) BMV31K304PortMask;
+#else
+#define BMV31K304_FAST_IO   0
+#endif
+
+/*Critical section around the port read-modify-write of DATA:poll() may drive
+  it from a timer interrupt while the sketch or another interrupt writes other
+  pins of the same port.The interrupt state is saved and restored,so it is
+  also safe inside an interrupt.Without BMV31K304_FAST_IO the pins go through
+  digitalWrite(),which the core keeps safe,and no lock is needed.*/
+#if BMV31K304_FAST_IO && defined(__AVR__)
+#define BMV31K304_PORT_LOCK()     uint8_t portLockState = SREG; cli()
+#define BMV31K304_PORT_UNLOCK()   SREG = portLockState
+#elif BMV31K304_FAST_IO
+#define BMV31K304_PORT_LOCK()     uint32_t portLockState; __asm__ volatile("mrs %0, primask\n\tcpsid i" : "=r"(portLockState) : : "memory")
+#define BMV31K304_PORT_UNLOCK()   __asm__ volatile("msr primask, %0" : : "r"(portLockState) : "memory")
+#else
+#define BMV31K304_PORT_LOCK()
+#define BMV31K304_PORT_UNLOCK()
+#endif
+
+/*Pin chosen at run time*/
+class BMV31K304FastPin
+{
+public:
+  void attach(uint8_t pin)
+  {
+    _pin = pin;
+#if BMV31K304_FAST_IO
+    _out = portOutputRegister(digitalPinToPort(pin));
+    _in = portInputRegister(digitalPinToPort(pin));
+    _mask = digitalPinToBitMask(pin);
+#endif
+  }
+  void mode(uint8_t mode)
+  {
+    pinMode(_pin, mode);
+  }
+  inline void write(uint8_t level)
+  {
+#if BMV31K304_FAST_IO
+    if(level)
+    {
+      *_out |= _mask;
+    }
+    else
+    {
+      *_out &= ~_mask;
+    }
+#else
+    digitalWrite(_pin, level);
+#endif
+  }
+  inline void writeAtomic(uint8_t level)//for a pin that is also written from an interrupt
+  {
+    BMV31K304_PORT_LOCK();
+    write(level);
+    BMV31K304_PORT_UNLOCK();
+  }
+  inline uint8_t read(void)
+  {
+#if BMV31K304_FAST_IO
+    return (*_in & _mask) ? HIGH : LOW;
+#else
+    return digitalRead(_pin);
+#endif
+  }
+private:
+  uint8_t _pin;
+#if BMV31K304_FAST_IO
+  BMV31K304PortReg _out;
+  BMV31K304PortInReg _in;
+  BMV31K304PortMask _mask;
+#endif
+};
+
+/*Port registers of the Arduino pin map of the ATmega328P/168(Uno,Nano,Pro
+  Mini):pins 0~7 PORTD,8~13 PORTB,14~19 PORTC.Register and bit are constants,
+  so a write inlines to one sbi/cbi instruction,which an interrupt cannot split.*/
+#if BMV31K304_FAST_IO && (defined(__AVR_ATmega328P__) || defined(__AVR_ATmega328__) || defined(__AVR_ATmega168__) || defined(__AVR_ATmega168P__))
+#define BMV31K304_PIN_MAP   1
+template<uint8_t Pin>
+struct BMV31K304PinMap
+{
+  static_assert(Pin < 20, "not a pin of the ATmega328P Arduino pin map");
+  static inline volatile uint8_t &out(void)
+  {
+    return (Pin < 8) ? PORTD : ((Pin < 14) ? PORTB : PORTC);
+  }
+  static inline volatile uint8_t &in(void)
+  {
+    return (Pin < 8) ? PIND : ((Pin < 14) ? PINB : PINC);
+  }
+  static constexpr uint8_t mask = 1 << ((Pin < 8) ? Pin : ((Pin < 14) ? (Pin - 8) : (Pin - 14)));
+};
+#else
+#define BMV31K304_PIN_MAP   0
+#endif
+
+/*Pin number fixed at compile time,no object state.With BMV31K304_PIN_MAP the
+  port register and mask are compile-time constants;other cores have no
+  constant pin map,so attach() looks them up once like BMV31K304FastPin and
+  keeps them in static members.*/
+template<uint8_t Pin>
+class BMV31K304Pin
+{
+public:
+  static void attach(void)
+  {
+#if BMV31K304_FAST_IO && !BMV31K304_PIN_MAP
+    _out = portOutputRegister(digitalPinToPort(Pin));
+    _in = portInputRegister(digitalPinToPort(Pin));
+    _mask = digitalPinToBitMask(Pin);
+#endif
+  }
+  static void mode(uint8_t mode)
+  {
+    pinMode(Pin, mode);
+  }
+  static inline void write(uint8_t level)
+  {
+#if BMV31K304_PIN_MAP
+    if(level)
+    {
+      BMV31K304PinMap<Pin>::out() |= BMV31K304PinMap<Pin>::mask;
+    }
+    else
+    {
+      BMV31K304PinMap<Pin>::out() &= (uint8_t)~BMV31K304PinMap<Pin>::mask;
+    }
+#elif BMV31K304_FAST_IO
+    if(level)
+    {
+      *_out |= _mask;
+    }
+    else
+    {
+      *_out &= ~_mask;
+    }
+#else
+    digitalWrite(Pin, level);
+#endif
+  }
+  static inline void writeAtomic(uint8_t level)
+  {
+#if BMV31K304_PIN_MAP
+    write(level);//sbi/cbi
+#else
+    BMV31K304_PORT_LOCK();
+    write(level);
+    BMV31K304_PORT_UNLOCK();
+#endif
+  }
+  static inline uint8_t read(void)
+  {
+#if BMV31K304_PIN_MAP
+    return (BMV31K304PinMap<Pin>::in() & BMV31K304PinMap<Pin>::mask) ? HIGH : LOW;
+#elif BMV31K304_FAST_IO
+    return (*_in & _mask) ? HIGH : LOW;
+#else
+    return digitalRead(Pin);
+#endif
+  }
+#if BMV31K304_FAST_IO && !BMV31K304_PIN_MAP
+private:
+  static BMV31K304PortReg _out;
+  static BMV31K304PortInReg _in;
+  static BMV31K304PortMask _mask;
+#endif
+};
+#if BMV31K304_FAST_IO && !BMV31K304_PIN_MAP
+template<uint8_t Pin> BMV31K304PortReg BMV31K304Pin<Pin>::_out;
+template<uint8_t Pin> BMV31K304PortInReg BMV31K304Pin<Pin>::_in;
+template<uint8_t Pin> BMV31K304PortMask BMV31K304Pin<Pin>::_mask;
+#endif
+
+#endif
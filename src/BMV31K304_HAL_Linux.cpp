@@ -0,0 +1,1537 @@
+/*********************************************************************************************
+File:             BMV31K304_HAL_Linux.cpp
+Author:           BEST MODULES CORP.
+Description:      Linux host backend of BMV31K304_HAL.h:virtual clock,GPIO,SPI and SerialUSB
+                  connected to a simulated BMV31K304(one-wire command decoder,busy line,
+                  ICP entry responder and SPI NOR flash).
+                  Build on the host without ARDUINO defined, e.g.
+                  g++ -Isrc app.cpp src/BMV31K304.cpp src/BMV31K304_HAL_Linux.cpp
+History：    V1.0.1   -- 2024-07-19
+**********************************************************************************************/
+#if !defined(ARDUINO)
+
+#include "BMV31K304_HAL.h"
+#include <vector>
+#include <deque>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SIM_PIN_NUM         64
+#define SIM_NEVER           0xffffffffffffffffULL
+#define SIM_CMD_LOG_SIZE    256
+#define SIM_SLEEP_MIN_NS    100000ULL   //real-time mode sleeps for waits from 100us on
+
+#define SIM_START_MIN_NS    2000000ULL  //one-wire start signal:low >= 2ms
+#define SIM_CELL_MIN_NS     150000ULL   //one-wire bit cell halves shorter than 150us are lost
+#define SIM_READY_MIN_NS    150000ULL   //ICP tready
+#define SIM_MATCH_PATTERN   0x4A8       //ICP match pattern,low 3 bits are mode
+
+enum
+{
+  ICP_OFF = 0,    //not powered
+  ICP_RUN,        //normal playback firmware
+  ICP_ENTRY,      //powered up with ICPCK low,waiting for READY
+  ICP_MATCH,      //shifting in the 12-bit match pattern
+  ICP_ACK,        //shifting out the 3-bit mode
+  ICP_SPI         //SPI flash connected to the host
+};
+
+SPIClass SPI;
+SPIClass SPI1;
+SPIClass SPI2;
+BMV31K304SimSerial SerialUSB;
+
+static uint8_t  simPinData = 26;
+static uint8_t  simPinIcpck = 27;
+static uint8_t  simPinIcpda = 28;
+static uint8_t  simPinSel = 29;
+static uint8_t  simPinPower = 22;
+
+static uint64_t simNs = 0;
+static bool     simRealTime = false;
+static uint64_t simRealBase = 0;
+static uint32_t simGpioNs = 100;
+static uint32_t simSpiCallNs = 500;   //per transfer() call,on top of the bit times
+static uint32_t simSpiClock = 4000000;  //clock of the open transaction,core default outside
+
+static uint8_t  simPinMode[SIM_PIN_NUM];
+static uint8_t  simPinOut[SIM_PIN_NUM];
+static void     (*simIsr[SIM_PIN_NUM])(void);
+static int      simIsrMode[SIM_PIN_NUM];
+static bool     simIrqOff = false;
+static uint8_t  simIrqPending[SIM_PIN_NUM];
+
+static uint8_t  simIcpState = ICP_OFF;
+static uint64_t simIcpEdgeNs = 0;
+static uint16_t simIcpPattern = 0;
+static uint8_t  simIcpBits = 0;
+static uint8_t  simIcpMode = 0;
+static uint8_t  simIcpAckLevel = HIGH;
+
+static uint64_t simOwEdgeNs = 0;
+static uint8_t  simOwLevel = HIGH;
+static bool     simOwActive = false;
+static uint8_t  simOwBits = 0;
+static uint8_t  simOwByte = 0;
+static uint8_t  simOwPrefix = 0;
+static uint64_t simOwHighNs = 0;//high half of the bit being received
+static uint8_t  simCmdLogCmd[SIM_CMD_LOG_SIZE];
+static uint8_t  simCmdLogData[SIM_CMD_LOG_SIZE];
+static uint64_t simCmdLogNs[SIM_CMD_LOG_SIZE];
+static uint16_t simCmdCount = 0;
+
+static uint32_t simClipLatencyNs = 2000000;
+static uint64_t simClipLengthNs = 500000000ULL;
+static uint8_t  simBusyLevel = HIGH;
+static uint64_t simBusyEventNs = SIM_NEVER;
+static uint8_t  simBusyNextLevel = HIGH;
+static bool     simBusyLoop = false;
+static uint64_t simBusyRemainNs = 0;
+
+static uint8_t  *simFlash = NULL;
+static std::vector<uint8_t> simFlashMem;  //backing without an image file
+static int      simFlashFd = -1;          //image file of setFlashFile()
+static size_t   simFlashMapBytes = 0;     //mapped bytes of simFlashFd
+static uint32_t simFlashBytes = 0x200000;
+static uint8_t  simSfdp[0xc0 + 2 * 4];
+static uint8_t  simFlashOp = 0;
+static uint8_t  simFlashAddrLen = 3;    //address bytes of simFlashOp
+static bool     simFlash4Byte = false;  //4-byte address mode(0xB7)
+static uint32_t simFlashIdx = 0;
+static uint32_t simFlashAddr = 0;
+static uint32_t simFlashCount = 0;
+static bool     simFlashWel = false;
+static uint64_t simFlashBusyNs = 0;     //WIP until this time
+static uint64_t simFlashProgramNs = 0;  //page program time
+static uint64_t simFlashSectorNs = 0;   //4K erase time,32K/64K scale with the size
+static uint64_t simFlashChipNs = 0;     //chip erase time
+
+static std::deque<uint8_t>  simRxData;
+static std::deque<uint64_t> simRxNs;
+static uint64_t simByteNs = 10000;
+static uint64_t simRxTimeoutNs = 1000000000ULL;
+static void     (*simTxHandler)(const uint8_t *buffer, size_t size) = NULL;
+static void     (*simDataHandler)(uint8_t level, uint64_t timeNs) = NULL;
+
+static std::vector<uint8_t> simWaveData;  //MOSI bytes of the running non-blocking transfer
+static size_t   simWaveBit = 0;           //next bit of simWaveData
+static uint64_t simWaveStartNs = 0;
+static uint64_t simWaveBitNs = 0;
+static EventResponder *simWaveEvent = NULL;//NULL:no transfer running
+static int      simSerialFd = -1;
+
+static void simRunEvents(uint64_t until);
+static void simOneWireEdge(uint8_t level);
+
+/*************************************************************************
+Description:Read the host monotonic clock
+parameter:  void
+Return:     ns
+Others:
+*************************************************************************/
+static uint64_t simHostNs(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*************************************************************************
+Description:Advance the clock and run the device events that fall due
+parameter:  ns:time to spend
+Return:     void
+Others:     In real-time mode the host sleeps instead.
+*************************************************************************/
+static void simAdvance(uint64_t ns)
+{
+  if(simRealTime)
+  {
+    struct timespec ts;
+    uint64_t until = simHostNs() + ns;
+    if(ns >= SIM_SLEEP_MIN_NS)
+    {
+      ts.tv_sec = ns / 1000000000ULL;
+      ts.tv_nsec = ns % 1000000000ULL;
+      nanosleep(&ts, NULL);
+    }
+    while(simHostNs() < until);//short waits spin,a sleep costs more than them
+    simNs = simHostNs() - simRealBase;
+    simRunEvents(simNs);
+    return;
+  }
+  ns += simNs;
+  simRunEvents(ns);
+  simNs = ns;
+}
+
+/*************************************************************************
+Description:Current clock
+parameter:  void
+Return:     ns since start
+Others:
+*************************************************************************/
+static uint64_t simNow(void)
+{
+  if(simRealTime)
+  {
+    simNs = simHostNs() - simRealBase;
+    simRunEvents(simNs);
+  }
+  return simNs;
+}
+
+/*************************************************************************
+Description:Raise the interrupt attached to a pin on a level change
+parameter:  pin:pin number
+            level:new level
+Return:     void
+Others:
+*************************************************************************/
+static void simPinEdge(uint8_t pin, uint8_t level)
+{
+  int mode = simIsrMode[pin];
+  if(NULL == simIsr[pin])
+  {
+    return;
+  }
+  if((CHANGE == mode) || ((RISING == mode) && level) || ((FALLING == mode) && !level))
+  {
+    if(simIrqOff)
+    {
+      simIrqPending[pin] = 1;
+    }
+    else
+    {
+      simIsr[pin]();
+    }
+  }
+}
+
+/*************************************************************************
+Description:Change the busy line driven by the device
+parameter:  level:LOW:playing; HIGH:idle
+Return:     void
+Others:
+*************************************************************************/
+static void simSetBusy(uint8_t level)
+{
+  if(level == simBusyLevel)
+  {
+    return;
+  }
+  simBusyLevel = level;
+  if(simPinMode[simPinIcpck] != OUTPUT)
+  {
+    simPinEdge(simPinIcpck, level);
+  }
+}
+
+/*************************************************************************
+Description:Time of the next bit of the non-blocking SPI transfer
+parameter:  void
+Return:     ns,the end of the transfer after its last bit
+Others:
+*************************************************************************/
+static uint64_t simWaveNextNs(void)
+{
+  if(NULL == simWaveEvent)
+  {
+    return SIM_NEVER;
+  }
+  return simWaveStartNs + simWaveBit * simWaveBitNs;
+}
+
+/*************************************************************************
+Description:Shift the next bit of the non-blocking SPI transfer out
+parameter:  void
+Return:     void
+Others:     MOSI is wired to DATA:a level change goes to the one-wire
+            decoder.After the last bit the completion event fires.
+*************************************************************************/
+static void simWaveStep(void)
+{
+  EventResponder *event;
+  uint8_t level;
+  simNs = simWaveNextNs();
+  if(simWaveBit < simWaveData.size() * 8)
+  {
+    level = (simWaveData[simWaveBit >> 3] >> (7 - (simWaveBit & 0x07))) & 0x01;
+    simWaveBit++;
+    if(level != simOwLevel)
+    {
+      simOneWireEdge(level);
+    }
+    return;
+  }
+  event = simWaveEvent;
+  simWaveEvent = NULL;
+  event->triggerEvent();
+}
+
+/*************************************************************************
+Description:Run busy line and SPI transfer events up to a time
+parameter:  until:clock in ns
+Return:     void
+Others:
+*************************************************************************/
+static void simRunEvents(uint64_t until)
+{
+  while(1)
+  {
+    if(simWaveNextNs() < simBusyEventNs)
+    {
+      if(simWaveNextNs() > until)
+      {
+        break;
+      }
+      simWaveStep();
+      continue;
+    }
+    if(simBusyEventNs > until)
+    {
+      break;
+    }
+    simNs = simBusyEventNs;
+    simBusyEventNs = SIM_NEVER;
+    simSetBusy(simBusyNextLevel);
+    if(LOW == simBusyLevel)
+    {
+      simBusyRemainNs = simClipLengthNs;
+      if(false == simBusyLoop)
+      {
+        simBusyEventNs = simNs + simClipLengthNs;
+        simBusyNextLevel = HIGH;
+      }
+    }
+  }
+}
+
+/*************************************************************************
+Description:Execute a decoded playback command
+parameter:  cmd,data:command frame(data 0xff:no data byte)
+Return:     void
+Others:
+*************************************************************************/
+static void simCommand(uint8_t cmd, uint8_t data)
+{
+  uint16_t slot = simCmdCount % SIM_CMD_LOG_SIZE;
+  simCmdLogCmd[slot] = cmd;
+  simCmdLogData[slot] = data;
+  simCmdLogNs[slot] = simNs;
+  simCmdCount++;
+
+  if((cmd >= 0xe1) && (cmd <= 0xec))//volume
+  {
+    return;
+  }
+  switch(cmd)
+  {
+    case 0xf1://pause
+      if((LOW == simBusyLevel) && (simBusyEventNs != SIM_NEVER))
+      {
+        simBusyRemainNs = simBusyEventNs - simNs;
+      }
+      simBusyEventNs = SIM_NEVER;
+      simSetBusy(HIGH);
+      break;
+    case 0xf2://continue
+      if(simBusyRemainNs != 0)
+      {
+        simSetBusy(LOW);
+        if(false == simBusyLoop)
+        {
+          simBusyEventNs = simNs + simBusyRemainNs;
+          simBusyNextLevel = HIGH;
+        }
+      }
+      break;
+    case 0xf4://loop
+      simBusyLoop = true;
+      if(LOW == simBusyLevel)
+      {
+        simBusyEventNs = SIM_NEVER;
+      }
+      break;
+    case 0xf8://stop
+      simBusyLoop = false;
+      simBusyRemainNs = 0;
+      simBusyEventNs = SIM_NEVER;
+      simSetBusy(HIGH);
+      break;
+    default://voice or sentence
+      simBusyLoop = false;
+      simSetBusy(HIGH);
+      simBusyEventNs = simNs + simClipLatencyNs;
+      simBusyNextLevel = LOW;
+      break;
+  }
+}
+
+/*************************************************************************
+Description:One-wire decoder,called on every DATA level change
+parameter:  level:new level
+Return:     void
+Others:     start:low >= 2ms; bit:high then low,1 if the high half is
+            longer(1200us/400us by default);the byte is complete after
+            the low half of bit 7.Halves under 150us abort the frame.
+*************************************************************************/
+static void simOneWireEdge(uint8_t level)
+{
+  uint64_t width = simNs - simOwEdgeNs;
+  uint8_t prev = simOwLevel;
+  if(simDataHandler != NULL)
+  {
+    simDataHandler(level, simNs);
+  }
+  simOwEdgeNs = simNs;
+  simOwLevel = level;
+  if(simIcpState != ICP_RUN)
+  {
+    simOwActive = false;
+    return;
+  }
+  if((LOW == prev) && (width >= SIM_START_MIN_NS))
+  {
+    simOwActive = true;
+    simOwBits = 0;
+    simOwByte = 0;
+    simOwHighNs = 0;
+    return;
+  }
+  if(false == simOwActive)
+  {
+    return;
+  }
+  if(width < SIM_CELL_MIN_NS)
+  {
+    simOwActive = false;
+    simOwPrefix = 0;
+    return;
+  }
+  if(HIGH == prev)
+  {
+    simOwHighNs = width;
+    return;
+  }
+  if(simOwHighNs > width)
+  {
+    simOwByte |= 1 << simOwBits;
+  }
+  simOwHighNs = 0;
+  if(++simOwBits < 8)
+  {
+    return;
+  }
+  simOwActive = false;
+  if(simOwPrefix != 0)
+  {
+    simCommand(simOwPrefix, simOwByte);
+    simOwPrefix = 0;
+  }
+  else if((0xfa == simOwByte) || (0xfb == simOwByte))
+  {
+    simOwPrefix = simOwByte;
+  }
+  else
+  {
+    simCommand(simOwByte, 0xff);
+  }
+}
+
+/*************************************************************************
+Description:ICP entry responder,called on every ICPCK level change
+parameter:  level:new level
+Return:     void
+Others:     READY(low >= 150us),MATCH,12-bit pattern sampled on rising
+            edges,then the mode is shifted out MSB first on ICPDA
+*************************************************************************/
+static void simIcpEdge(uint8_t level)
+{
+  uint64_t width = simNs - simIcpEdgeNs;
+  simIcpEdgeNs = simNs;
+  if(HIGH != level)
+  {
+    return;
+  }
+  switch(simIcpState)
+  {
+    case ICP_ENTRY:
+      if(width >= SIM_READY_MIN_NS)
+      {
+        simIcpState = ICP_MATCH;
+        simIcpPattern = 0;
+        simIcpBits = 0;
+      }
+      break;
+    case ICP_MATCH:
+      simIcpPattern = (simIcpPattern << 1) | (simPinOut[simPinIcpda] ? 1 : 0);
+      simIcpBits++;
+      if(12 == simIcpBits)
+      {
+        if((simIcpPattern & 0xff8) == SIM_MATCH_PATTERN)
+        {
+          simIcpMode = simIcpPattern & 0x07;
+          simIcpState = ICP_ACK;
+          simIcpBits = 0;
+        }
+        else
+        {
+          simIcpState = ICP_ENTRY;
+        }
+      }
+      break;
+    case ICP_ACK:
+      simIcpBits++;
+      if(simIcpBits <= 3)
+      {
+        simIcpAckLevel = (simIcpMode >> (3 - simIcpBits)) & 0x01;
+      }
+      else
+      {
+        simIcpState = ICP_SPI;
+      }
+      break;
+    case ICP_SPI:
+      if(width >= SIM_READY_MIN_NS)//host restarts the entry sequence
+      {
+        simIcpState = ICP_MATCH;
+        simIcpPattern = 0;
+        simIcpBits = 0;
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+/*************************************************************************
+Description:Power pin change
+parameter:  level:new level
+Return:     void
+Others:     Powering up with ICPCK driven low enters the ICP sequence.
+*************************************************************************/
+static void simPower(uint8_t level)
+{
+  simBusyEventNs = SIM_NEVER;
+  simBusyLoop = false;
+  simBusyRemainNs = 0;
+  simOwActive = false;
+  simOwPrefix = 0;
+  simFlashWel = false;
+  simFlashBusyNs = 0;
+  simFlash4Byte = false;
+  if(LOW == level)
+  {
+    simIcpState = ICP_OFF;
+    simSetBusy(HIGH);
+    return;
+  }
+  simSetBusy(HIGH);
+  if((OUTPUT == simPinMode[simPinIcpck]) && (LOW == simPinOut[simPinIcpck]))
+  {
+    simIcpState = ICP_ENTRY;
+  }
+  else
+  {
+    simIcpState = ICP_RUN;
+  }
+  simIcpEdgeNs = simNs;
+}
+
+/*************************************************************************
+Description:Put a little-endian DWORD into the SFDP table
+parameter:  offset:table offset
+            value:DWORD
+Return:     void
+Others:
+*************************************************************************/
+static void simSfdpDword(uint16_t offset, uint32_t value)
+{
+  simSfdp[offset] = value & 0xff;
+  simSfdp[offset + 1] = (value >> 8) & 0xff;
+  simSfdp[offset + 2] = (value >> 16) & 0xff;
+  simSfdp[offset + 3] = (value >> 24) & 0xff;
+}
+
+/*************************************************************************
+Description:Release the mapping of the image file
+parameter:  void
+Return:     void
+Others:
+*************************************************************************/
+static void simFlashUnmap(void)
+{
+  if(simFlashMapBytes > 0)
+  {
+    munmap(simFlash, simFlashMapBytes);
+    simFlash = NULL;
+    simFlashMapBytes = 0;
+  }
+}
+
+/*************************************************************************
+Description:Map the image file as the flash array
+parameter:  void
+Return:     true:mapped,false:no image file,file larger than the flash
+            (errno EFBIG) or error
+Others:     A shorter file is grown to the flash,the new part reads
+            0xFF(erased).A larger one is never truncated.The mapping is
+            shared:every program/erase is in the file at once and stays
+            there after the process.
+*************************************************************************/
+static bool simFlashMap(void)
+{
+  struct stat st;
+  void *p;
+  if((simFlashFd < 0) || (fstat(simFlashFd, &st) != 0))
+  {
+    return false;
+  }
+  if((size_t)st.st_size > simFlashBytes)
+  {
+    errno = EFBIG;
+    return false;
+  }
+  if(((size_t)st.st_size < simFlashBytes) && (ftruncate(simFlashFd, simFlashBytes) != 0))
+  {
+    return false;
+  }
+  p = mmap(NULL, simFlashBytes, PROT_READ | PROT_WRITE, MAP_SHARED, simFlashFd, 0);
+  if(MAP_FAILED == p)
+  {
+    return false;
+  }
+  simFlash = (uint8_t *)p;
+  simFlashMapBytes = simFlashBytes;
+  if((size_t)st.st_size < simFlashBytes)
+  {
+    memset(simFlash + st.st_size, 0xff, simFlashBytes - st.st_size);
+  }
+  return true;
+}
+
+/*************************************************************************
+Description:Allocate the flash array and build its SFDP table
+parameter:  void
+Return:     void
+Others:     JESD216B basic table:4K/32K/64K erase(0x20/0x52/0xD8),
+            256-byte pages,1-1-1 fast read 0x0B with 8 dummy clocks.
+            Above 16MB also the 4-byte address instruction table
+            (0x0C/0x12/0x21/0x5C/0xDC) and 4-byte mode with 0xB7.
+            With an image file the array keeps the file contents,
+            otherwise it starts erased.
+*************************************************************************/
+static void simFlashInit(void)
+{
+  uint8_t i;
+  simFlashUnmap();
+  if(simFlashMap())
+  {
+    std::vector<uint8_t>().swap(simFlashMem);
+  }
+  else
+  {
+    simFlashMem.assign(simFlashBytes, 0xff);
+    simFlash = &simFlashMem[0];
+  }
+  memset(simSfdp, 0xff, sizeof(simSfdp));
+  simSfdp[0] = 'S';
+  simSfdp[1] = 'F';
+  simSfdp[2] = 'D';
+  simSfdp[3] = 'P';
+  simSfdp[4] = 0x06;//minor revision
+  simSfdp[5] = 0x01;//major revision
+  simSfdp[6] = 0x00;//1 parameter header
+  simSfdp[7] = 0xff;
+  simSfdp[8] = 0x00;//basic flash parameter table
+  simSfdp[9] = 0x06;
+  simSfdp[10] = 0x01;
+  simSfdp[11] = 16;//16 DWORDs
+  simSfdp[12] = 0x80;
+  simSfdp[13] = 0x00;
+  simSfdp[14] = 0x00;
+  simSfdp[15] = 0xff;
+  //DW1:4K erase 0x20,write granularity >= 64 bytes,address bytes
+  simSfdpDword(0x80, 0xfff000e5 | (0x20 << 8) | ((simFlashBytes > 0x1000000) ? (0x01 << 17) : 0));
+  //DW2:density in bits - 1
+  simSfdpDword(0x84, (uint32_t)simFlashBytes * 8 - 1);
+  for(i = 3; i <= 7; i++)
+  {
+    simSfdpDword(0x80 + (i - 1) * 4, 0xffffffff);
+  }
+  //DW8/DW9:erase types 4K 0x20,32K 0x52,64K 0xD8
+  simSfdpDword(0x9c, (0x52u << 24) | (15u << 16) | (0x20u << 8) | 12u);
+  simSfdpDword(0xa0, (0xffu << 24) | (0x00u << 16) | (0xd8u << 8) | 16u);
+  //DW10:typical erase 48ms/128ms/160ms(16ms units),max = 6 x typical
+  simSfdpDword(0xa4, 2u | ((2u | (1u << 5)) << 4) | ((7u | (1u << 5)) << 11) | ((9u | (1u << 5)) << 18));
+  //DW11:page 2^8,page program 704us(64us units),chip erase 5.12s(256ms units)
+  simSfdpDword(0xa8, 2u | (8u << 4) | ((10u | (1u << 5)) << 8) | ((19u | (1u << 5)) << 24));
+  for(i = 12; i <= 16; i++)
+  {
+    simSfdpDword(0x80 + (i - 1) * 4, 0xffffffff);
+  }
+  if(simFlashBytes > 0x1000000)
+  {
+    simSfdpDword(0xbc, (0x01u << 24) | 0x00ffffff);//DW16:enter 4-byte mode with 0xB7
+    simSfdp[6] = 0x01;//2 parameter headers
+    simSfdp[16] = 0x84;//4-byte address instruction table
+    simSfdp[17] = 0x00;
+    simSfdp[18] = 0x01;
+    simSfdp[19] = 2;
+    simSfdp[20] = 0xc0;
+    simSfdp[21] = 0x00;
+    simSfdp[22] = 0x00;
+    simSfdp[23] = 0xff;
+    //DW1:0x0C fast read,0x12 page program,erase types 1~3;DW2:their 4-byte instructions
+    simSfdpDword(0xc0, 0x02u | 0x40u | (0x07u << 9));
+    simSfdpDword(0xc4, 0xff000000u | (0xdcu << 16) | (0x5cu << 8) | 0x21u);
+  }
+}
+
+/*************************************************************************
+Description:Get log2 of the flash size
+parameter:  void
+Return:     capacity code of the JEDEC ID
+Others:
+*************************************************************************/
+static uint8_t simFlashCapacity(void)
+{
+  uint8_t n = 0;
+  while((1UL << n) < simFlashBytes)
+  {
+    n++;
+  }
+  return n;
+}
+
+/*************************************************************************
+Description:Erase a range of the flash
+parameter:  addr:start address(aligned down to size)
+            size:bytes
+Return:     void
+Others:
+*************************************************************************/
+static void simFlashErase(uint32_t addr, uint32_t size)
+{
+  addr &= ~(size - 1);
+  if(addr < simFlashBytes)
+  {
+    memset(&simFlash[addr], 0xff, (addr + size <= simFlashBytes) ? size : simFlashBytes - addr);
+  }
+}
+
+/*************************************************************************
+Description:Flash chip select change
+parameter:  level:new CS level
+Return:     void
+Others:     Erase instructions execute on the rising edge of CS.
+*************************************************************************/
+static void simFlashSelect(uint8_t level)
+{
+  uint32_t size;
+  if(LOW == level)
+  {
+    simFlashOp = 0;
+    simFlashIdx = 0;
+    simFlashAddr = 0;
+    simFlashCount = 0;
+    return;
+  }
+  if(simIcpState != ICP_SPI)
+  {
+    return;
+  }
+  switch(simFlashOp)
+  {
+    case 0x02:
+    case 0x12:
+      if(simFlashWel && (simFlashIdx > 1u + simFlashAddrLen))
+      {
+        simFlashBusyNs = simNs + simFlashProgramNs;
+      }
+      simFlashWel = false;
+      break;
+    case 0x60:
+    case 0xc7:
+      if(simFlashWel && (1 == simFlashIdx))
+      {
+        simFlashErase(0, simFlashBytes);
+        simFlashBusyNs = simNs + simFlashChipNs;
+      }
+      simFlashWel = false;
+      break;
+    case 0x20:
+    case 0x21:
+    case 0x52:
+    case 0x5c:
+    case 0xd8:
+    case 0xdc:
+      if(simFlashWel && (1u + simFlashAddrLen == simFlashIdx))
+      {
+        size = ((0x20 == simFlashOp) || (0x21 == simFlashOp)) ? 0x1000 : (((0x52 == simFlashOp) || (0x5c == simFlashOp)) ? 0x8000 : 0x10000);
+        simFlashErase(simFlashAddr, size);
+        simFlashBusyNs = simNs + simFlashSectorNs * ((0x1000 == size) ? 1 : ((0x8000 == size) ? 4 : 8));
+      }
+      simFlashWel = false;
+      break;
+    case 0xb7:
+    case 0xe9:
+      if(1 == simFlashIdx)
+      {
+        simFlash4Byte = (0xb7 == simFlashOp);
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+/*************************************************************************
+Description:Shift one byte through the flash
+parameter:  data:byte from the host
+Return:     byte to the host
+Others:
+*************************************************************************/
+static uint8_t simFlashByte(uint8_t data)
+{
+  uint8_t ret = 0xff;
+  uint32_t idx = simFlashIdx++;
+  bool busy = (simNow() < simFlashBusyNs);
+  if(0 == idx)
+  {
+    simFlashOp = data;
+    //0x5A(SFDP) always has 3 address bytes,the 4-byte instructions always 4
+    simFlashAddrLen = (0x5a == data) ? 3 : (((0x0c == data) || (0x12 == data) || (0x21 == data) || (0x5c == data) || (0xdc == data) || simFlash4Byte) ? 4 : 3);
+    if(busy && (data != 0x05))
+    {
+      simFlashOp = 0;//only the status register answers during a program/erase
+      return ret;
+    }
+    if(0x06 == data)
+    {
+      simFlashWel = true;
+    }
+    else if(0x04 == data)
+    {
+      simFlashWel = false;
+    }
+    return ret;
+  }
+  switch(simFlashOp)
+  {
+    case 0x05:
+      ret = (simFlashWel ? 0x02 : 0x00) | (busy ? 0x01 : 0x00);
+      break;
+    case 0x9f:
+      if(1 == idx)
+      {
+        ret = 0xef;
+      }
+      else if(2 == idx)
+      {
+        ret = 0x40;
+      }
+      else if(3 == idx)
+      {
+        ret = simFlashCapacity();
+      }
+      break;
+    case 0x90:
+      if(idx >= 4)
+      {
+        ret = (idx & 0x01) ? simFlashCapacity() - 1 : 0xef;
+      }
+      break;
+    case 0x5a:
+    case 0x0b:
+    case 0x0c:
+    case 0x03:
+    case 0x02:
+    case 0x12:
+    case 0x20:
+    case 0x21:
+    case 0x52:
+    case 0x5c:
+    case 0xd8:
+    case 0xdc:
+      if(idx <= simFlashAddrLen)
+      {
+        simFlashAddr = (simFlashAddr << 8) | data;
+        break;
+      }
+      if(((0x5a == simFlashOp) || (0x0b == simFlashOp) || (0x0c == simFlashOp)) && (1u + simFlashAddrLen == idx))
+      {
+        break;//dummy byte
+      }
+      if(0x5a == simFlashOp)
+      {
+        ret = (simFlashAddr < sizeof(simSfdp)) ? simSfdp[simFlashAddr] : 0xff;
+        simFlashAddr++;
+      }
+      else if((0x03 == simFlashOp) || (0x0b == simFlashOp) || (0x0c == simFlashOp))
+      {
+        ret = simFlash[simFlashAddr % simFlashBytes];
+        simFlashAddr++;
+      }
+      else if(((0x02 == simFlashOp) || (0x12 == simFlashOp)) && simFlashWel)
+      {
+        //NOR program only clears bits and wraps inside the page
+        simFlash[((simFlashAddr & ~0xffUL) | ((simFlashAddr + simFlashCount) & 0xff)) % simFlashBytes] &= data;
+        simFlashCount++;
+      }
+      break;
+    default:
+      break;
+  }
+  return ret;
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+  if(pin < SIM_PIN_NUM)
+  {
+    simPinMode[pin] = mode;
+  }
+}
+
+void digitalWrite(uint8_t pin, uint8_t val)
+{
+  uint8_t level = val ? HIGH : LOW;
+  simAdvance(simGpioNs);
+  if((pin >= SIM_PIN_NUM) || (simPinOut[pin] == level))
+  {
+    return;
+  }
+  simPinOut[pin] = level;
+  if(pin == simPinPower)
+  {
+    simPower(level);
+  }
+  if(pin == simPinData)
+  {
+    simOneWireEdge(level);
+  }
+  if((pin == simPinIcpck) && (simIcpState >= ICP_ENTRY))
+  {
+    simIcpEdge(level);
+  }
+  if(pin == simPinSel)
+  {
+    simFlashSelect(level);
+  }
+}
+
+int digitalRead(uint8_t pin)
+{
+  simAdvance(simGpioNs);
+  simNow();
+  if(pin >= SIM_PIN_NUM)
+  {
+    return LOW;
+  }
+  if(OUTPUT == simPinMode[pin])
+  {
+    return simPinOut[pin];
+  }
+  if((pin == simPinIcpck) && (ICP_RUN == simIcpState))
+  {
+    return simBusyLevel;
+  }
+  if((pin == simPinIcpda) && (ICP_ACK == simIcpState))
+  {
+    return simIcpAckLevel;
+  }
+  if(INPUT_PULLDOWN == simPinMode[pin])
+  {
+    return LOW;
+  }
+  return HIGH;
+}
+
+void delay(unsigned long ms)
+{
+  simAdvance((uint64_t)ms * 1000000ULL);
+}
+
+void delayMicroseconds(unsigned int us)
+{
+  simAdvance((uint64_t)us * 1000ULL);
+}
+
+unsigned long micros(void)
+{
+  if(false == simRealTime)
+  {
+    simAdvance(100);//a clock read takes time,so spin loops make progress
+  }
+  return (unsigned long)(uint32_t)(simNow() / 1000ULL);
+}
+
+unsigned long millis(void)
+{
+  if(false == simRealTime)
+  {
+    simAdvance(100);
+  }
+  return (unsigned long)(uint32_t)(simNow() / 1000000ULL);
+}
+
+void yield(void)
+{
+  if(simRealTime)
+  {
+    sched_yield();
+  }
+  else
+  {
+    simAdvance(100);
+  }
+}
+
+void attachInterrupt(uint8_t interruptNum, void (*userFunc)(void), int mode)
+{
+  if(interruptNum < SIM_PIN_NUM)
+  {
+    simIsr[interruptNum] = userFunc;
+    simIsrMode[interruptNum] = mode;
+  }
+}
+
+void detachInterrupt(uint8_t interruptNum)
+{
+  if(interruptNum < SIM_PIN_NUM)
+  {
+    simIsr[interruptNum] = NULL;
+  }
+}
+
+void noInterrupts(void)
+{
+  simIrqOff = true;
+}
+
+void interrupts(void)
+{
+  uint8_t pin;
+  simIrqOff = false;
+  for(pin = 0; pin < SIM_PIN_NUM; pin++)
+  {
+    if(simIrqPending[pin])
+    {
+      simIrqPending[pin] = 0;
+      if(simIsr[pin] != NULL)
+      {
+        simIsr[pin]();
+      }
+    }
+  }
+}
+
+void SPIClass::begin(void)
+{
+  if(NULL == simFlash)
+  {
+    simFlashInit();
+  }
+}
+
+void SPIClass::end(void)
+{
+}
+
+void SPIClass::beginTransaction(SPISettings settings)
+{
+  simSpiClock = (settings._clock > 0) ? settings._clock : 4000000;
+}
+
+void SPIClass::endTransaction(void)
+{
+  simSpiClock = 4000000;
+}
+
+/*************************************************************************
+Description:Shift one byte through the simulated flash
+parameter:  data:byte from the host
+Return:     byte to the host
+Others:     The bit time is charged by the callers.
+*************************************************************************/
+static uint8_t simSpiByte(uint8_t data)
+{
+  if((ICP_SPI != simIcpState) || (LOW != simPinOut[simPinSel]) || (OUTPUT != simPinMode[simPinSel]))
+  {
+    return 0xff;
+  }
+  if(NULL == simFlash)
+  {
+    simFlashInit();
+  }
+  return simFlashByte(data);
+}
+
+uint8_t SPIClass::transfer(uint8_t data)
+{
+  simAdvance(simSpiCallNs + 8000000000ULL / simSpiClock);
+  return simSpiByte(data);
+}
+
+/*************************************************************************
+Description:Start a non-blocking transfer
+parameter:  *txBuffer:bytes to send
+            *rxBuffer:not filled
+            count:bytes
+            event:triggered after the last bit
+Return:     true:started; false:a transfer is running
+Others:     The bits go out on the virtual clock at the clock of the
+            transaction.MOSI is taken as wired to the BMV31K304 DATA
+            pin(BMV31K304SPIWave),so the one-wire decoder sees them.
+*************************************************************************/
+bool SPIClass::transfer(const void *txBuffer, void *rxBuffer, size_t count, EventResponderRef event)
+{
+  (void)rxBuffer;
+  if(simWaveEvent != NULL)
+  {
+    return false;
+  }
+  simAdvance(simSpiCallNs);
+  simWaveData.assign((const uint8_t *)txBuffer, (const uint8_t *)txBuffer + count);
+  simWaveBit = 0;
+  simWaveStartNs = simNs;
+  simWaveBitNs = 1000000000ULL / simSpiClock;
+  simWaveEvent = &event;
+  return true;
+}
+
+void SPIClass::transfer(void *buf, size_t count)
+{
+  uint8_t *p = (uint8_t *)buf;
+  simAdvance(simSpiCallNs);//one call for the whole buffer
+  while(count--)
+  {
+    simAdvance(8000000000ULL / simSpiClock);
+    *p = simSpiByte(*p);
+    p++;
+  }
+}
+
+/*************************************************************************
+Description:Move bytes from the serial file descriptor into the receive queue
+parameter:  timeoutMs:time to wait for the first byte,0:do not wait
+Return:     void
+Others:
+*************************************************************************/
+static void simSerialPoll(int timeoutMs)
+{
+  uint8_t buf[512];
+  struct pollfd pfd;
+  ssize_t n, i;
+  if(simSerialFd < 0)
+  {
+    return;
+  }
+  pfd.fd = simSerialFd;
+  pfd.events = POLLIN;
+  if(poll(&pfd, 1, timeoutMs) <= 0)
+  {
+    return;
+  }
+  n = ::read(simSerialFd, buf, sizeof(buf));
+  for(i = 0; i < n; i++)
+  {
+    simRxData.push_back(buf[i]);
+    simRxNs.push_back(0);
+  }
+}
+
+void BMV31K304SimSerial::begin(unsigned long baudrate)
+{
+  simByteNs = 10000000000ULL / baudrate;
+}
+
+int BMV31K304SimSerial::available(void)
+{
+  int n = 0;
+  uint64_t now = simNow();
+  simSerialPoll(0);
+  if(simRxNs.empty() || (simRxNs.back() <= now))//arrival times only grow
+  {
+    return simRxNs.size();
+  }
+  while(((size_t)n < simRxNs.size()) && (simRxNs[n] <= now))
+  {
+    n++;
+  }
+  return n;
+}
+
+int BMV31K304SimSerial::read(void)
+{
+  uint8_t data;
+  if(simRxNs.empty() || (simRxNs.front() > simNow()))
+  {
+    if(0 == available())
+    {
+      return -1;
+    }
+  }
+  data = simRxData.front();
+  simRxData.pop_front();
+  simRxNs.pop_front();
+  return data;
+}
+
+size_t BMV31K304SimSerial::readBytes(uint8_t *buffer, size_t length)
+{
+  size_t count = 0;
+  uint64_t deadline = simNow() + simRxTimeoutNs;
+  while(count < length)
+  {
+    if(available() > 0)
+    {
+      buffer[count++] = read();
+      deadline = simNow() + simRxTimeoutNs;
+      continue;
+    }
+    if(simSerialFd >= 0)
+    {
+      if(simNow() >= deadline)
+      {
+        break;
+      }
+      simSerialPoll(1);
+      continue;
+    }
+    if(simRxNs.empty() || (simRxNs.front() > deadline))
+    {
+      if(deadline > simNs)
+      {
+        simAdvance(deadline - simNs);
+      }
+      break;
+    }
+    simAdvance(simRxNs.front() - simNs);
+  }
+  return count;
+}
+
+size_t BMV31K304SimSerial::write(uint8_t data)
+{
+  return write(&data, 1);
+}
+
+size_t BMV31K304SimSerial::write(const uint8_t *buffer, size_t size)
+{
+  if(simSerialFd >= 0)
+  {
+    return ::write(simSerialFd, buffer, size);
+  }
+  if(simTxHandler != NULL)
+  {
+    simTxHandler(buffer, size);
+  }
+  return size;
+}
+
+void BMV31K304SimSerial::setTimeout(unsigned long timeout)
+{
+  simRxTimeoutNs = (uint64_t)timeout * 1000000ULL;
+}
+
+void BMV31K304SimSerial::flush(void)
+{
+}
+
+/*************************************************************************
+Description:Tell the simulator which host pins the BMV31K304 is wired to
+parameter:  dataPin,icpckPin,icpdaPin,selPin,powerPin:pin numbers
+Return:     void
+Others:     Defaults match the SPI1 wiring(26,27,28,29,22).
+*************************************************************************/
+void BMV31K304Sim::setPins(uint8_t dataPin, uint8_t icpckPin, uint8_t icpdaPin, uint8_t selPin, uint8_t powerPin)
+{
+  simPinData = dataPin;
+  simPinIcpck = icpckPin;
+  simPinIcpda = icpdaPin;
+  simPinSel = selPin;
+  simPinPower = powerPin;
+}
+
+/*************************************************************************
+Description:Select the clock source
+parameter:  enable:true:host monotonic clock,delays sleep;
+                   false:virtual clock(default),delays only advance it
+Return:     void
+Others:
+*************************************************************************/
+void BMV31K304Sim::setRealTime(bool enable)
+{
+  simRealTime = enable;
+  simRealBase = simHostNs() - simNs;
+}
+
+/*************************************************************************
+Description:Get the clock
+parameter:  void
+Return:     ns since start
+Others:
+*************************************************************************/
+uint64_t BMV31K304Sim::nanos(void)
+{
+  return simNow();
+}
+
+/*************************************************************************
+Description:Set the virtual time spent by I/O calls
+parameter:  gpioNs:per digitalWrite()/digitalRead()
+            spiCallNs:per SPI transfer() call,a byte or a whole buffer
+Return:     void
+Others:     The bits take 8/clock per byte on top,at the clock of the
+            SPISettings of the transaction(4MHz outside one).
+*************************************************************************/
+void BMV31K304Sim::setIoCost(uint32_t gpioNs, uint32_t spiCallNs)
+{
+  simGpioNs = gpioNs;
+  simSpiCallNs = spiCallNs;
+}
+
+/*************************************************************************
+Description:Set the simulated clip timing
+parameter:  latencyUs:end of the command frame to busy low
+            lengthUs:busy low time of a clip
+Return:     void
+Others:
+*************************************************************************/
+void BMV31K304Sim::setClip(uint32_t latencyUs, uint32_t lengthUs)
+{
+  simClipLatencyNs = latencyUs * 1000UL;
+  simClipLengthNs = (uint64_t)lengthUs * 1000ULL;
+}
+
+/*************************************************************************
+Description:Get the number of decoded command frames
+parameter:  void
+Return:     frames
+Others:
+*************************************************************************/
+uint16_t BMV31K304Sim::commandCount(void)
+{
+  return simCmdCount;
+}
+
+/*************************************************************************
+Description:Get a decoded command frame
+parameter:  index:0~commandCount()-1,the last 256 frames are kept
+            *cmd,*data:frame(data 0xff:no data byte)
+            *timeUs:time the frame was decoded
+Return:     true:frame available
+Others:
+*************************************************************************/
+bool BMV31K304Sim::command(uint16_t index, uint8_t *cmd, uint8_t *data, uint64_t *timeUs)
+{
+  uint16_t slot = index % SIM_CMD_LOG_SIZE;
+  if((index >= simCmdCount) || ((simCmdCount - index) > SIM_CMD_LOG_SIZE))
+  {
+    return false;
+  }
+  *cmd = simCmdLogCmd[slot];
+  *data = simCmdLogData[slot];
+  *timeUs = simCmdLogNs[slot] / 1000ULL;
+  return true;
+}
+
+/*************************************************************************
+Description:Get the simulated busy state
+parameter:  void
+Return:     true:playing
+Others:
+*************************************************************************/
+bool BMV31K304Sim::isBusy(void)
+{
+  simNow();
+  return LOW == simBusyLevel;
+}
+
+/*************************************************************************
+Description:Get the ICP state
+parameter:  void
+Return:     true:the SPI flash is connected to the host
+Others:
+*************************************************************************/
+bool BMV31K304Sim::isICPMode(void)
+{
+  return ICP_SPI == simIcpState;
+}
+
+/*************************************************************************
+Description:Set the time the flash stays busy(WIP) after a write
+parameter:  pageProgramUs:page program
+            sectorEraseUs:4K sector erase,32K/64K blocks take 4x/8x
+            chipEraseMs:chip erase
+Return:     void
+Others:     Default 0:writes complete at once.
+*************************************************************************/
+void BMV31K304Sim::setFlashTiming(uint32_t pageProgramUs, uint32_t sectorEraseUs, uint32_t chipEraseMs)
+{
+  simFlashProgramNs = (uint64_t)pageProgramUs * 1000ULL;
+  simFlashSectorNs = (uint64_t)sectorEraseUs * 1000ULL;
+  simFlashChipNs = (uint64_t)chipEraseMs * 1000000ULL;
+}
+
+/*************************************************************************
+Description:Set the simulated flash size and erase it
+parameter:  size:bytes,power of 2
+Return:     true:done,false:the image file is larger than size(errno
+            EFBIG,nothing changed) or cannot be remapped(errno tells,the
+            file is closed and the flash is an erased array in memory)
+Others:     With an image file the file is grown and remapped instead:
+            the contents are kept,the grown part reads 0xFF.
+*************************************************************************/
+bool BMV31K304Sim::setFlashSize(uint32_t size)
+{
+  struct stat st;
+  if(simFlashFd >= 0)
+  {
+    if(fstat(simFlashFd, &st) != 0)
+    {
+      return false;
+    }
+    if((size_t)st.st_size > size)
+    {
+      errno = EFBIG;
+      return false;//never truncate the image file
+    }
+  }
+  simFlashBytes = size;
+  simFlashInit();
+  if((simFlashFd >= 0) && (0 == simFlashMapBytes))
+  {
+    close(simFlashFd);
+    simFlashFd = -1;//no silent fallback with the file still open
+    return false;
+  }
+  return true;
+}
+
+/*************************************************************************
+Description:Keep the simulated flash in an image file
+parameter:  *path:file,created if missing,NULL:back to an erased array
+                  in memory
+Return:     true:file mapped,false:cannot be opened or larger than the
+            flash(errno tells)
+Others:     The file is mapped shared,so the flash persists between runs
+            and can be compared with the source image(cmp) while the
+            simulation runs.A shorter file is grown to the flash,a later
+            setFlashSize() grows and remaps it or refuses a smaller size.
+*************************************************************************/
+bool BMV31K304Sim::setFlashFile(const char *path)
+{
+  bool ok = true;
+  simFlashUnmap();
+  if(simFlashFd >= 0)
+  {
+    close(simFlashFd);
+    simFlashFd = -1;
+  }
+  if(path != NULL)
+  {
+    simFlashFd = open(path, O_RDWR | O_CREAT, 0644);
+  }
+  simFlashInit();
+  if((path != NULL) && (0 == simFlashMapBytes))
+  {
+    ok = false;
+    if(simFlashFd >= 0)
+    {
+      close(simFlashFd);
+      simFlashFd = -1;
+    }
+  }
+  return ok;
+}
+
+/*************************************************************************
+Description:Get the simulated flash size
+parameter:  void
+Return:     bytes
+Others:
+*************************************************************************/
+uint32_t BMV31K304Sim::flashSize(void)
+{
+  return simFlashBytes;
+}
+
+/*************************************************************************
+Description:Get the simulated flash contents
+parameter:  void
+Return:     flashSize() bytes
+Others:
+*************************************************************************/
+uint8_t *BMV31K304Sim::flashData(void)
+{
+  if(NULL == simFlash)
+  {
+    simFlashInit();
+  }
+  return simFlash;
+}
+
+/*************************************************************************
+Description:Send bytes to the driver's SerialUSB
+parameter:  *buffer,size:bytes
+Return:     void
+Others:     Bytes arrive one after another at the rate set by begin().
+*************************************************************************/
+void BMV31K304Sim::serialInput(const uint8_t *buffer, size_t size)
+{
+  uint64_t t = simNow();
+  if(!simRxNs.empty() && (simRxNs.back() > t))
+  {
+    t = simRxNs.back();
+  }
+  while(size--)
+  {
+    t += simByteNs;
+    simRxData.push_back(*buffer++);
+    simRxNs.push_back(t);
+  }
+}
+
+/*************************************************************************
+Description:Receive what the driver writes to SerialUSB
+parameter:  handler:called with every write
+Return:     void
+Others:
+*************************************************************************/
+void BMV31K304Sim::setSerialHandler(void (*handler)(const uint8_t *buffer, size_t size))
+{
+  simTxHandler = handler;
+}
+
+/*************************************************************************
+Description:Watch the DATA line
+parameter:  handler:called with every level change and its time in ns
+Return:     void
+Others:     For checks of the one-wire edge timing.
+*************************************************************************/
+void BMV31K304Sim::setDataHandler(void (*handler)(uint8_t level, uint64_t timeNs))
+{
+  simDataHandler = handler;
+}
+
+/*************************************************************************
+Description:Connect SerialUSB to a file descriptor(e.g. a pty)
+parameter:  fd:descriptor,-1:disconnect
+Return:     void
+Others:     Use together with setRealTime(true).
+*************************************************************************/
+void BMV31K304Sim::setSerialFd(int fd)
+{
+  simSerialFd = fd;
+}
+
+#endif